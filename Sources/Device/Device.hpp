@@ -113,6 +113,9 @@ public:
 	bool set(Param code, double value) {
 		return _impl->set(code, value);
 	}
+	void setEncoding(const Gb::Encoding& encoding) {
+		return _impl->setEncoding(encoding);
+	}
 
 	// Getters
 	const FrameFormat getFormat() const {
@@ -3,12 +3,12 @@
 #include <atomic>
 #include <thread>
 #include <mutex>
-#include <future>
 #include <chrono>
 
 #include "Device.hpp"
 #include "structures.hpp"
 #include "../Tool/Timer.hpp"
+#include "../Tool/Executor.hpp"
 
 // ------------ Device : Pull frames in a dedicated thread ------------
 class DeviceMt {	
@@ -27,6 +27,7 @@ public:
 		// Only if release() wasn't call before
 		if(_pThread || _pDevice) 
 			release();
+		_dispatcher.wait();
 	}
 	
 	// - Methods
@@ -56,6 +57,11 @@ public:
 			_pDevice->refresh();
 	}
 	
+	// Where the callbacks run, Executor::shared() by default
+	void setExecutor(const std::shared_ptr<Executor>& pExecutor) {
+		_dispatcher.setExecutor(pExecutor);
+	}
+	
 	// Set a callback
 	virtual void onFrame(const std::function<void(const Gb::Frame&)>& cbkFrame) {
 		_mutCbk.lock();
@@ -100,6 +106,13 @@ public:
 			return _pDevice->set(code, value);
 		return false;
 	}
+	bool setEncoding(const Gb::Encoding& encoding) {
+		if(_pDevice) {
+			_pDevice->setEncoding(encoding);
+			return true;
+		}
+		return false;
+	}
 	bool setFrameType(Gb::FrameType fType) {
 		std::lock_guard<std::mutex> lockFrame(_mutFrame);
 		refresh();
@@ -136,10 +149,13 @@ protected:
 
 	// - Methods	
 	virtual void _onFrame() {
-		std::lock_guard<std::mutex> lockCbk(_mutCbk);
+		std::function<void(const Gb::Frame&)> cbkFrame;
+		{
+			std::lock_guard<std::mutex> lockCbk(_mutCbk);
+			cbkFrame = _cbkFrame;
+		}
 		
-		if(_cbkFrame) 
-			_futureFrame = std::async(std::launch::async, _cbkFrame, frame); // Call back if set
+		_dispatcher.post(0, cbkFrame, frame); // Call back if set, frames in order
 	}
 	
 private:	
@@ -171,5 +187,5 @@ private:
 	
 	std::shared_ptr<Device> _pDevice;
 	std::function<void(const Gb::Frame&)> _cbkFrame;
-	std::future<void> _futureFrame;
+	Dispatcher _dispatcher;
 };
@@ -113,6 +113,9 @@ public:
 	void refresh() {
 		_translator.refresh();
 	}
+	void setEncoding(const Gb::Encoding& encoding) {
+		_translator.setEncoding(encoding);
+	}
 	
 	bool grab() {
 		if(!_open)
@@ -108,5 +108,22 @@ namespace Gb {
 		}
 		
 	};
+	
+	// Encoding settings which can change while streaming
+	struct Encoding {
+		Encoding(int bps = 1000000, float fps = 30.0f, int quality = 30) : bitrate(bps), frameRate(fps), jpgQuality(quality) {
+		}
+		
+		int bitrate;		// H264 (bit/s)
+		float frameRate;	// Frames above are skipped
+		int jpgQuality;	// Jpg420 [1, 100]
+		
+		bool operator==(const Encoding& e) const {
+			return bitrate == e.bitrate && frameRate == e.frameRate && jpgQuality == e.jpgQuality;
+		}
+		bool operator!=(const Encoding& e) const {
+			return !(*this == e);
+		}
+	};
 }
 
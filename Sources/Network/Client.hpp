@@ -4,10 +4,10 @@
 #include <memory>
 #include <string>
 #include <thread>
-#include <future>
 #include <atomic>
 #include <mutex>
 #include <vector>
+#include <cstdint>
 #include <algorithm>
 #include <functional>
 
@@ -15,15 +15,22 @@
 #include "SocketTool.hpp"
 #include "Message.hpp"
 #include "../Tool/Timer.hpp"
+#include "../Tool/Executor.hpp"
 
 class Client {
 	// -------------- Main class --------------
 public:
-	Client() : _isConnected(false), _isAlive(false) {
+	Client() : _isConnected(false), _isAlive(false), _multicast(true), _inGroup(false), _coalescing(false), _ioBackend(Io_Poll), _reportPeriod(0) {
+		// A frame is now many MTU sized datagrams: room for a few frames. Small requests not delayed.
+		_udpOptions.receiveBuffer 	= UDP_BUFFER_SIZE;
+		_udpOptions.dropCounter 	= true;
+		_tcpOptions.noDelay 		= true;
+		
 		// Wait for connectTo
 	}
 	~Client() {
 		disconnect();
+		_dispatcher.wait(); // Callbacks may still use this client
 	}
 	
 	
@@ -44,9 +51,11 @@ public:
 		// Set sockets up
 		if(!_udpSock.connect(address, Proto_Udp)) 
 			return disconnect();
+		_udpSock.setOptions(_udpOptions);
 		
 		if(!_tcpSock.connect(address, Proto_Tcp))
 			return disconnect();
+		_tcpSock.setOptions(_tcpOptions);
 		
 		// Thread
 		_isAlive = true;
@@ -70,17 +79,21 @@ public:
 		
 		_udpSock.close();
 		_tcpSock.close();
+		_groupSock.close(); // Leave the group
+		_inGroup = false;
 		
 		wlc::uninitSockets();
 		
 		return false;
 	}
 	
-	bool sendInfo(const Message& msg) const {
+	// Sent synchronously: a view on a caller's buffer is enough
+	bool sendInfo(const MessageView& msg) const {
+		std::lock_guard<std::mutex> lockTcp(_mutTcpSend); // Also used by the reception thread
 		return _send(_tcpSock, msg, "TCP send Error");
 	}
 	
-	bool sendData(const Message& msg) const {		
+	bool sendData(const MessageView& msg) const {		
 		return _send(_udpSock, msg, "UDP send Error");
 	}
 	
@@ -89,7 +102,74 @@ public:
 		return _isConnected;
 	}
 	
+	// Broadcasts received from the multicast group
+	bool inGroup() const {
+		return _inGroup;
+	}
+	
+	// Fragmented frames rebuilt with the parity, and lost ones
+	uint64_t recoveredFrames() const {
+		return _frameAssembler.recovered();
+	}
+	uint64_t lostFrames() const {
+		return _frameAssembler.expired();
+	}
+	
+	// Datagrams dropped by the udp sockets (queue full), when counted (SocketOptions::dropCounter) on the poll path
+	uint64_t socketDrops() const {
+		return _udpReceiver.dropped();
+	}
+	
+	// Values used by the kernel for the socket of this protocol
+	SocketOptions socketOptions(const ProtoType proto) const {
+		return proto == Proto_Tcp ? _tcpSock.options() : _udpSock.options();
+	}
+	
+	// From the kernel reception to the data callback posted, with SocketOptions::receiveTimestamps
+	PacketDelays processDelays() const {
+		std::lock_guard<std::mutex> lockDelays(_mutDelays);
+		return _processDelays;
+	}
+	
 	// Setters
+	// Let the kernel coalesce received datagrams (UDP GRO). Call before connectTo().
+	void setCoalescing(bool coalescing) {
+		_coalescing = coalescing;
+	}
+	
+	// Tuning of the udp sockets (group included), and of the tcp one. Call before connectTo().
+	// Best effort: check the values used with socketOptions().
+	// The receive timestamps keep the udp reception on the poll path, the send ones are not used by a client.
+	void setSocketOptions(const SocketOptions& udpOptions, const SocketOptions& tcpOptions) {
+		_udpOptions = udpOptions;
+		_tcpOptions = tcpOptions;
+		
+		_udpOptions.sendTimestamps = false;
+		_tcpOptions.sendTimestamps = false;
+	}
+	
+	// Io_Uring: the datagrams are received in buffers given once to the kernel, without a call for each batch.
+	// Kept on the poll path without io_uring, or with coalescing. Call before connectTo().
+	void setIoBackend(IoBackend backend) {
+		_ioBackend = backend;
+	}
+	
+	// Join the multicast group advertised by the server, or keep receiving its broadcasts by unicast. Call before connectTo().
+	void setMulticast(bool multicast) {
+		_multicast = multicast;
+	}
+	
+	// Fragmented frames bigger than 'maxFrameSize' are refused. Beyond 'maxFrames' rebuilt at once, the oldest is lost.
+	// Bounds the memory a sender can make the client use. Call before connectTo().
+	void setFrameLimits(const size_t maxFrameSize, const size_t maxFrames) {
+		_frameAssembler.setLimits(maxFrameSize, maxFrames);
+	}
+	
+	// Tell the server what is received every 'periodMs' (Message::REPORT), 0 to never do it
+	void setReportPeriod(int periodMs) {
+		_reportPeriod = periodMs;
+	}
+	
 	void onConnect(const std::function<void(void)>& cbkConnect) {
 		std::lock_guard<std::mutex> lockCbk(_mutCbk);
 		_cbkConnect = cbkConnect;
@@ -107,12 +187,18 @@ public:
 		_cbkError = cbkError;		
 	}
 	
+	// Where the callbacks run, Executor::shared() by default
+	void setExecutor(const std::shared_ptr<Executor>& pExecutor) {
+		_dispatcher.setExecutor(pExecutor);
+	}
+	
 private:	
 	// Methods in threads
 	void _recvTcp() {
-		const int BUFFER_SIZE = 2048; 
-		char buf[BUFFER_SIZE] = {0};
+		MessageStream stream;
+		Message message;
 		ssize_t recv_len = 0;
+		std::string udpId; // Given by the server before "udp?", empty for an old one
 		
 		// Init polling socket
 		const int TIMEOUT = 500; // 0.5 sec
@@ -134,10 +220,11 @@ private:
 			if(!(fdRead.revents & POLLIN)) // unexpected
 				break;
 				
-			// Receive TCP maybe
-			memset(buf, 0, BUFFER_SIZE);
+			// Receive TCP maybe, after the bytes already there
+			size_t space = 0;
+			char* buf = stream.reserve(space);
 			
-			if((recv_len = recv(_tcpSock.get(), buf, BUFFER_SIZE, 0)) == SOCKET_ERROR) {
+			if((recv_len = recv(_tcpSock.get(), buf, (int)space, 0)) == SOCKET_ERROR) {
 				// What kind of error ?
 				int error = wlc::getError();
 				if(wlc::errorIs(wlc::WOULD_BLOCK, error)) { // Temporary unavailable
@@ -148,164 +235,436 @@ private:
 					break;
 				}
 				else {
-					std::lock_guard<std::mutex> lockCbk(_mutCbk);
-					if(_cbkError) 
-						_futureError = std::async(std::launch::async, _cbkError, Error(error, "TCP receive Error"));
+					_dispatcher.post(TCP_KEY, _callback(_cbkError), Error(error, "TCP receive Error"));
 					break;
 				}
 			}
 			
 			if(recv_len == 0) {
-				std::lock_guard<std::mutex> lockCbk(_mutCbk);
-				if(_cbkError) 
-					_futureError = std::async(std::launch::async, _cbkError, Error(wlc::REFUSED_CONNECT, "Server disconnected"));
+				_dispatcher.post(TCP_KEY, _callback(_cbkError), Error(wlc::REFUSED_CONNECT, "Server disconnected"));
 				break;
 			}
 			
-			// Read messages
-			if(recv_len < 14) // Bad message
-				continue;
+			// Read complete messages
+			stream.commit((size_t)recv_len);
+			
+			if(_tcpOptions.quickAck) // Turned off by the kernel meanwhile
+				wlc::setOption(_tcpSock.get(), wlc::QUICK_ACK, 1);
 			
-			for(const Message& message :  MessageManager::readMessages(buf, recv_len)) {
+			while(stream.pop(message)) {
 				if(!_isConnected) {
 					if(message.code() == Message::HANDSHAKE) {
 						std::string strMessage = message.str();
 						
-						if(strMessage == "udp?") { 		// UDP needed ?
-							sendData(Message(Message::HANDSHAKE, "udp."));
+						if(strMessage.compare(0, 4, "udp=") == 0) { 	// Id to give back with the udp answer
+							udpId = strMessage.substr(4);
+						}
+						else if(strMessage == "udp?") { 	// UDP needed ? Answer with the id given
+							sendInfo(Message(Message::HANDSHAKE, "v2")); // Before: the first datagrams may use it
+							sendData(Message(Message::HANDSHAKE, "udp." + udpId));
+						}
+						else if(strMessage.compare(0, 6, "group?") == 0) { // Broadcasts sent to a group ? Answer once joined
+							if(_multicast && _joinGroup(strMessage.substr(6)))
+								sendInfo(Message(Message::HANDSHAKE, "group."));
 						}
 						else if(strMessage == "ok.") {	// Handshake complete
 							_isConnected = true;
 							
-							std::lock_guard<std::mutex> lockCbk(_mutCbk);
-							if(_cbkConnect) 
-								_futureConnect = std::async(std::launch::async, _cbkConnect);
+							_dispatcher.post(TCP_KEY, _callback(_cbkConnect));
 						}
 					}
 				}
 				else {
-					std::lock_guard<std::mutex> lockCbk(_mutCbk);
-					if(_cbkInfo)
-						_futureInfo = std::async(std::launch::async, _cbkInfo, message);
+					_dispatcher.post(TCP_KEY, _callback(_cbkInfo), message);
 				}
 			} // -- End messages
 		} // -- End loop
 	} // -- End function recv tcp
 	
 	void _recvUdp() {
-		const int BUFFER_SIZE		= 64000;
-		char buffer[BUFFER_SIZE]	= {0};
-		ssize_t recv_len 	= 0;
+		if(_ioBackend != Io_Uring || _coalescing || _udpOptions.receiveTimestamps || !_recvUdpRing())
+			_recvUdpPoll();
 		
-		// Init polling socket
+		// Forcibly disconnected
+		if(_isConnected)
+			disconnect();
+	}
+	
+	void _recvUdpPoll() {
+		// Init polling sockets: the group is added once joined
 		const int TIMEOUT = 500; // 0.5 sec
-		pollfd fdRead 	= {0};
-		fdRead.fd 		= _udpSock.get();
-		fdRead.events 	= POLLIN;
+		pollfd fdsRead[2] 	= {{0}, {0}};
+		fdsRead[0].fd 		= _udpSock.get();
+		fdsRead[0].events 	= POLLIN;
+		fdsRead[1].events 	= POLLIN;
+		unsigned long nFds 	= 1;
 		
-		std::map<unsigned int, MessageBuffer> messagesBuffering;
-		std::map<unsigned int, uint64_t> messagesBufferingTs;
+		if(_coalescing)
+			_udpReceiver.coalesce(_udpSock);
 		
 		// Loop
 		for(Timer timer; _isAlive; ) {
-			// Poll events
-			int pollResult = wlc::polling(&fdRead, 1, TIMEOUT);
+			if(nFds == 1 && _inGroup) {
+				fdsRead[1].fd = _groupSock.get();
+				nFds = 2;
+				
+				if(_coalescing)
+					_udpReceiver.coalesce(_groupSock);
+			}
+			
+			// Poll events, shortly when frames are incomplete or during the handshake
+			int pollResult = wlc::polling(fdsRead, nFds, (_frameAssembler.pending() > 0 || !_isConnected) ? (int)NACK_DELAY : TIMEOUT);
 			if (pollResult < 0) 			// failed
 				break;
 			else if(pollResult == 0) {	// timeout
+				_askMissing();
+				_frameAssembler.collect(); // Incomplete frames won't be completed anymore
+				_report();
+				
 				if(_isAlive)
 					continue;
 				else
 					break;
 			}
-			if(!(fdRead.revents & POLLIN)) // unexpected
+			
+			// UDP - Receive all datagrams waiting, on each socket
+			bool failed = false;
+			for(unsigned long i = 0; i < nFds && !failed; i++) {
+				if(fdsRead[i].revents == 0)
+					continue;
+				if(!(fdsRead[i].revents & POLLIN)) // unexpected
+					failed = true;
+				else
+					failed = !_receiveAll(i == 0 ? _udpSock : _groupSock, i == 0 ? _sequences : _groupSequences);
+			}
+			
+			if(failed)
 				break;
 			
-			// UDP - Receive
-			memset(buffer, 0, BUFFER_SIZE);
-			if((recv_len = recv(_udpSock.get(), buffer, BUFFER_SIZE, 0)) == SOCKET_ERROR) {		
+			_askMissing();
+			_report();
+		} // ENd loop receiving message
+	}
+	
+	// Multishot receptions in a ring of buffers: one system call to wait and get all the datagrams.
+	// False if io_uring can't be used here (nothing received): use the poll path.
+	bool _recvUdpRing() {
+		const int TIMEOUT = 500; // 0.5 sec
+		const unsigned int RING_ENTRIES 	= 4;
+		const unsigned int BUFFERS 			= 64;
+		const size_t BUFFER_SIZE 			= 65536; // Any datagram
+		const uint64_t UDP_SOCK 	= 0;
+		const uint64_t GROUP_SOCK 	= 1;
+		
+		IoUring ring;
+		if(!ring.create(RING_ENTRIES, 4 * BUFFERS) || !ring.createBuffers(BUFFERS, BUFFER_SIZE) || !ring.receive(_udpSock.get(), UDP_SOCK))
+			return false;
+		
+		bool groupReceived 	= false;
+		bool received 		= false;
+		bool unsupported 	= false;
+		bool failed 		= false;
+		
+		while(_isAlive && !failed) {
+			if(!groupReceived && _inGroup)
+				groupReceived = ring.receive(_groupSock.get(), GROUP_SOCK);
+			
+			// Wait, shortly when frames are incomplete or during the handshake
+			if(!ring.submit((_frameAssembler.pending() > 0 || !_isConnected) ? (int)NACK_DELAY : TIMEOUT))
+				break;
+			
+			const size_t nCompletions = ring.completions([&](const IoUring::Completion& completion) {
+				const bool fromGroup = completion.userData == GROUP_SOCK;
+				
+				if(completion.data) {
+					_readDatagram(completion.data, (size_t)completion.result, fromGroup ? _groupSequences : _sequences, 0);
+					ring.recycle(ring.bufferId(completion));
+					received = true;
+				}
+				else if(completion.result == -EINVAL && !received) { // Kernel without multishot receptions
+					unsupported = true;
+					return;
+				}
+				else if(completion.result == -ECONNREFUSED) { // Forcibly disconnected
+					failed = true;
+					return;
+				}
+				else if(completion.result < 0 && completion.result != -ENOBUFS && completion.result != -EAGAIN && completion.result != -EINTR) {
+					_dispatcher.post(UDP_KEY, _callback(_cbkError), Error(-completion.result, "UDP receive Error"));
+					failed = true;
+					return;
+				}
+				
+				// Stopped (no buffer left, ...): ask again
+				if(!completion.more)
+					ring.receive(fromGroup ? _groupSock.get() : _udpSock.get(), completion.userData);
+			});
+			
+			if(unsupported)
+				return false;
+			
+			if(nCompletions == 0) { // timeout
+				_askMissing();
+				_frameAssembler.collect(); // Incomplete frames won't be completed anymore
+			}
+			else
+				_askMissing();
+			_report();
+		}
+		
+		return true;
+	}
+	
+	// Return false when the socket can't be used anymore
+	bool _receiveAll(const Socket& udpSock, SequenceTracker* sequences) {
+		do {
+			if(_udpReceiver.receive(udpSock) == SOCKET_ERROR) {		
 				// What kind of error ?
 				int error = wlc::getError();
 				if(wlc::errorIs(wlc::WOULD_BLOCK, error) || wlc::errorIs(wlc::INVALID_ARG, error)) {
-					timer.wait(1);
-					continue;
+					return true;
 				}
 				else if(wlc::errorIs(wlc::REFUSED_CONNECT, error)) { // Forcibly disconnected
-					break;
+					return false;
 				}
 				else if(wlc::errorIs(wlc::MSG_SIZE, error)) { // Message too big
 					std::cout << "Too big" << std::endl;
 					continue;
 				}
 				else {
-					std::lock_guard<std::mutex> lockCbk(_mutCbk);
-					if(_cbkError) 
-						_futureError = std::async(std::launch::async, _cbkError, Error(error, "UDP receive Error"));
-					break;
+					_dispatcher.post(UDP_KEY, _callback(_cbkError), Error(error, "UDP receive Error"));
+					return false;
 				}
 			}
-
-			// Read buffer
-			if(recv_len < 14) // Bad message
-				continue;
 			
+			// Read buffers
+			for(const DatagramReceiver::Datagram& datagram : _udpReceiver.datagrams())
+				_readDatagram(datagram.data, datagram.length, sequences, datagram.kernelMus);
 			
-			for(ssize_t offset = 0; offset < recv_len;) { // Assume that we can received packets stacked together
-				// Read header
-				Message message(buffer + offset, 14);
+		} while(_udpReceiver.full());
+		
+		return true;
+	}
+	
+	// Group "ip,port", on the interface used to reach the server
+	bool _joinGroup(const std::string& group) {
+		const size_t comma = group.rfind(',');
+		if(comma == std::string::npos)
+			return false;
+		
+		SocketAddress groupAddress;
+		if(!groupAddress.create(group.substr(0, comma), atoi(group.substr(comma + 1).c_str())) || !groupAddress.isMulticast())
+			return false;
+		
+		SocketAddress interfaceAddress;
+		sockaddr_storage local;
+		socklen_t len = sizeof(local);
+		if(getsockname(_tcpSock.get(), (sockaddr*)&local, &len) == 0 && _tcpSock.type() == groupAddress.type())
+			interfaceAddress = SocketAddress(groupAddress.type(), *(sockaddr*)&local, len);
+		
+		if(!_groupSock.bindGroup(groupAddress, interfaceAddress))
+			return false;
+		
+		_groupSock.setOptions(_udpOptions);
+		
+		_inGroup = true;
+		return true;
+	}
+	
+	// 'sequences' : of the socket, each sender numbers its datagrams
+	// 'kernelMus' : system clock of the kernel reception, 0 if unknown
+	void _readDatagram(const char* buffer, const size_t recv_len, SequenceTracker* sequences, const uint64_t kernelMus) {
+		if(recv_len < 14) // Bad message
+			return;
+		
+		_reception.bytes += recv_len;
+		
+		// Time spent in the process since the kernel received it
+		uint64_t processMus = 0;
+		if(kernelMus > 0) {
+			const uint64_t nowMus = Timer::realtimeMus();
+			processMus = nowMus > kernelMus ? nowMus - kernelMus : 0;
+		}
+		
+		for(size_t offset = 0; offset + 14 <= recv_len;) { // Assume that we can received packets stacked together
+			// Read header: v1 or v2
+			unsigned int code = 0, size = 0;
+			uint64_t time = 0;
+			
+			HeaderV2 header;
+			const bool v2 = header.read(buffer + offset, recv_len - offset);
+			if(v2) {
+				code = header.code;
+				size = header.size;
+				time = header.timestamp;
+				offset += HeaderV2::LENGTH;
+				
+				sequences[header.stream < HeaderV2::STREAMS ? header.stream : HeaderV2::CONTROL].add(header.sequence);
+			}
+			else {
+				Message::readHeader(buffer + offset, code, size, time);
 				offset += 14;
+			}
+			
+			if(offset + size > recv_len) // Truncated
+				return;
+			
+			// Complete or Fragmented?
+			if(!(code & Message::FRAGMENT)) { // Complete message
+				Message message(code, buffer + offset, size, time);
+				if(v2)
+					message.setCaptureMus(header.captureMus);
+				message.setReceptionMus(kernelMus);
+				offset += size;
 				
-				// Complete or Fragmented?
-				if(!(message.code() & Message::FRAGMENT)) { // Complete message
-					message.appendData(buffer+offset, message.size());
-					offset += message.size();
+				_delayed(kernelMus, processMus);
+				_dispatcher.post(UDP_KEY, _callback(_cbkData), message);
+			}
+			else { // Fragment: [[FRAGMENT HEADER] [DATA]], copied at its place in the frame
+				FragmentHeader fragment;
+				if(fragment.read(buffer + offset, size)) {
+					const char* data 	= buffer + offset + FragmentHeader::LENGTH;
+					const size_t len 	= size - FragmentHeader::LENGTH;
 					
-					std::lock_guard<std::mutex> lockCbk(_mutCbk);
-					if(_cbkData) 
-						_futureData = std::async(std::launch::async, _cbkData, message);
-				}
-				else { // Fragmented messages
-					if(message.code() & Message::HEADER) { // Header don't have data, only information (timestamps, code, size total)
-						unsigned int code 		 = message.code() & ~(Message::HEADER | Message::FRAGMENT);
-						messagesBuffering[code] = MessageBuffer(code, message.timestamp(), message.size());
-						// messagesBufferingTs[code] = Timer::timestampMs();
-						// No offsets up because nothing read (data are empty and will come in fragments)
+					Message message;
+					if(_frameAssembler.add(code & ~Message::FRAGMENT, time, fragment, data, len, message)) { // The complete frame
+						if(v2)
+							message.setCaptureMus(header.captureMus);
+						message.setReceptionMus(kernelMus); // Of its last fragment
+						
+						_delayed(kernelMus, processMus);
+						_received(message, v2, processMus);
+						_dispatcher.post(UDP_KEY, _callback(_cbkData), message);
 					}
-					else { // Fragment
-						unsigned int code = message.code() & ~Message::FRAGMENT;
-						if(messagesBuffering[code].timestamp > message.timestamp()) { // discard, it's and old message
-							// do something ?
-						}
-						else { // add fragment to packet list
-							messagesBuffering[code].packets.push_back(std::vector<char>(buffer + offset, buffer + offset + message.size()));
+				}
+				offset += size;
+			} // End Fragmented message part
+		} // End loop stacked packets
+	}
 
-							// Are all the packets here ?
-							if(messagesBuffering[code].complete()) {
-								if(messagesBuffering[code].compose(message)) { // Overwrite the message by the concatenated one	
-									uint64_t now = Timer::timestampMs();
-									// std::cout << now - messagesBufferingTs[code] << "ms" << std::endl;
-									std::lock_guard<std::mutex> lockCbk(_mutCbk);
-									if(_cbkData) 
-										_futureData = std::async(std::launch::async, _cbkData, message);
-								}
-							}
-						}
-						offset += message.size();
-					} // End Fragment part
-				} // End Fragmented message part
-			} // End loop stacked packets
-		} // ENd loop receiving message
+	// Key frames with lost fragments: ask them again to the server (TCP)
+	void _askMissing() {
+		const int MAX_NACKS = 3;
 		
-		// Forcibly disconnected
-		if(_isConnected)
-			disconnect();
+		_nacks.clear();
+		_frameAssembler.missing(Message::KEY_FRAME, NACK_DELAY, MAX_NACKS, _nacks);
+		
+		for(const FragmentNack& nack : _nacks)
+			sendInfo(Message(Message::NACK, nack.str()));
 	}
-
-	bool _send(const Socket& connectSocked, const Message& msg, const std::string& msgOnError = "Send error") const {
+	
+	void _delayed(const uint64_t kernelMus, const uint64_t processMus) {
+		if(kernelMus == 0)
+			return;
+		
+		std::lock_guard<std::mutex> lockDelays(_mutDelays);
+		_processDelays.add(processMus);
+	}
+	
+	// One-way delay of a complete message, the lowest one is the reference.
+	// With v2 headers: steady clocks in µs, and the jitter (RFC 3550) between the frames.
+	// 'processMus' : spent in this process after the kernel reception, out of the jitter
+	void _received(const Message& message, const bool v2, const uint64_t processMus) {
+		const int64_t transitMus = v2 ? (int64_t)(Timer::monotonicMus() - message.captureMus() - processMus) : 1000 * ((int64_t)Timer::timestampMs() - (int64_t)message.timestamp());
+		const int64_t delay = transitMus / 1000;
+		
+		// Other clock: the references are lost
+		if(v2 != _reception.v2) {
+			_reception.v2 			= v2;
+			_reception.delayMin 	= INT64_MAX;
+			_reception.hasDelay 	= false;
+			_reception.hasTransit 	= false;
+		}
+		
+		if(v2) {
+			if(_reception.hasTransit) {
+				const int64_t diff = transitMus - _reception.lastTransitMus;
+				_reception.jitterMus += ((double)(diff < 0 ? -diff : diff) - _reception.jitterMus) / 16.0;
+			}
+			_reception.lastTransitMus 	= transitMus;
+			_reception.hasTransit 		= true;
+		}
+		
+		_reception.frames++;
+		_reception.delaySum += delay;
+		
+		if(_reception.delayMin > delay)
+			_reception.delayMin = delay;
+	}
+	
+	void _report() {
+		const uint64_t now = Timer::timestampMs();
+		
+		if(_reportPeriod <= 0 || !_isConnected) 
+			return;
+		if(_reception.begin == 0) {
+			_reception.begin 		= now;
+			_reception.lostBegin 	= _frameAssembler.expired();
+			_sequencesCount(_reception.datagramsBegin, _reception.datagramsLostBegin);
+			return;
+		}
+		if(now < _reception.begin + (uint64_t)_reportPeriod)
+			return;
+		
+		// Stats of the period
+		const uint64_t lost = _frameAssembler.expired() - _reception.lostBegin;
+		
+		uint64_t datagrams = 0, datagramsLost = 0;
+		_sequencesCount(datagrams, datagramsLost);
+		datagrams 		-= _reception.datagramsBegin;
+		datagramsLost 	-= _reception.datagramsLostBegin;
+		
+		ReceptionReport report;
+		report.rate = 1000.0 * _reception.bytes / (double)(now - _reception.begin);
+		
+		// Datagrams numbered by v2 headers: their loss, not the frames'
+		if(datagrams > 0)
+			report.loss = datagramsLost / (double)(datagrams + datagramsLost);
+		else
+			report.loss = (_reception.frames + lost > 0) ? lost / (double)(_reception.frames + lost) : 0.0;
+		
+		if(_reception.frames > 0) {
+			const int64_t delay = _reception.delaySum / (int64_t)_reception.frames - _reception.delayMin;
+			
+			report.delay 		= (int)delay;
+			report.delayTrend 	= _reception.hasDelay ? (int)(delay - _reception.lastDelay) : 0;
+			report.jitter 		= (int)_reception.jitterMus;
+			
+			_reception.lastDelay 	= delay;
+			_reception.hasDelay 	= true;
+		}
+		
+		sendInfo(Message(Message::REPORT, report.str()));
+		
+		// Next period
+		_reception.begin 		= now;
+		_reception.lostBegin 	= _frameAssembler.expired();
+		_reception.bytes 		= 0;
+		_reception.frames 		= 0;
+		_reception.delaySum 	= 0;
+		_sequencesCount(_reception.datagramsBegin, _reception.datagramsLostBegin);
+	}
+	void _sequencesCount(uint64_t& received, uint64_t& lost) const {
+		received 	= 0;
+		lost 		= 0;
+		for(const SequenceTracker* pSequences : { _sequences, _groupSequences }) {
+			for(size_t i = 0; i < HeaderV2::STREAMS; i++) {
+				received 	+= pSequences[i].received();
+				lost 		+= pSequences[i].lost();
+			}
+		}
+	}
+	
+	// Copy of a callback, called out of the lock
+	template <typename F>
+	F _callback(const F& cbk) const {
+		std::lock_guard<std::mutex> lockCbk(_mutCbk);
+		return cbk;
+	}
+	
+	bool _send(const Socket& connectSocked, const MessageView& msg, const std::string& msgOnError = "Send error") const {
 		if(!connectSocked.send(msg)) {
-			std::lock_guard<std::mutex> lockCbk(_mutCbk);
-			if(_cbkError) 
-				_futureError = std::async(std::launch::async, _cbkError, Error(wlc::getError(), "Send error"));
+			_dispatcher.post(TCP_KEY, _callback(_cbkError), Error(wlc::getError(), "Send error"));
 			return false;
 		}
 		return true;
@@ -318,6 +677,50 @@ private:
 	
 	Socket _udpSock;
 	Socket _tcpSock;
+	mutable std::mutex _mutTcpSend;
+	
+	static const int UDP_BUFFER_SIZE = 4 * 1024 * 1024;
+	SocketOptions _udpOptions;
+	SocketOptions _tcpOptions;
+	
+	// Multicast
+	std::atomic<bool> _multicast;
+	std::atomic<bool> _inGroup; // _groupSock ready
+	Socket _groupSock;
+	
+	// Udp reception
+	bool _coalescing;
+	IoBackend _ioBackend;
+	DatagramReceiver _udpReceiver;
+	FrameAssembler _frameAssembler;
+	std::vector<FragmentNack> _nacks;
+	static const uint64_t NACK_DELAY = 5; // ms without fragment before asking the missing ones
+	
+	// Reception reports
+	struct _Reception {
+		uint64_t begin 		= 0;
+		uint64_t lostBegin 	= 0;
+		uint64_t bytes 		= 0;
+		uint64_t frames 	= 0;
+		int64_t delaySum 	= 0;
+		int64_t delayMin 	= INT64_MAX;
+		int64_t lastDelay 	= 0;
+		bool hasDelay 		= false;
+		
+		// v2 headers
+		bool v2 					= false;
+		uint64_t datagramsBegin 	= 0;
+		uint64_t datagramsLostBegin = 0;
+		int64_t lastTransitMus 		= 0;
+		bool hasTransit 			= false;
+		double jitterMus 			= 0.0;
+	} _reception;
+	SequenceTracker _sequences[HeaderV2::STREAMS];
+	SequenceTracker _groupSequences[HeaderV2::STREAMS];
+	std::atomic<int> _reportPeriod;
+	
+	mutable std::mutex _mutDelays;
+	PacketDelays _processDelays; // Kernel timestamps
 	
 	// Callbacks
 	mutable std::mutex _mutCbk;
@@ -326,10 +729,9 @@ private:
 	std::function<void(const Message& message)> _cbkData;
 	std::function<void(void)> _cbkConnect;
 	
-	mutable std::future<void> _futureError;
-	std::future<void> _futureInfo;
-	std::future<void> _futureData;
-	std::future<void> _futureConnect;
+	mutable Dispatcher _dispatcher;
+	static const uint64_t TCP_KEY = 0; // Connection, infos and errors keep their order
+	static const uint64_t UDP_KEY = 1; // Data
 
 	// Threads
 	std::shared_ptr<std::thread> _pRecvTcp;
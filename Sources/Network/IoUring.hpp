@@ -0,0 +1,479 @@
+#pragma once
+
+#include "WinLinConversion.hpp"
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+	#include <linux/io_uring.h>
+	#include <sys/syscall.h>
+	#include <sys/mman.h>
+	#include <signal.h>
+	#include <ctime>
+#endif
+
+// Multishot receptions and buffer rings: kernel headers 6.0 or newer
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+	#define IO_URING_AVAILABLE
+#endif
+
+// How the network threads use the sockets
+enum IoBackend {
+	Io_Poll, 	// poll + recvmmsg / sendmmsg, everywhere
+	Io_Uring 	// io_uring when the kernel has it, else Io_Poll
+};
+
+// ------------------- IoUring : batched socket operations, few system calls -------------------
+// Requests are queued, then given to the kernel with their completions in one call (io_uring_enter).
+// Receptions are multishot, in a ring of buffers given to the kernel once: one request for all the datagrams.
+// Sends are queued with a copy of their headers, the payloads must live until submitSends().
+// A ring is used by one thread, either to send or to receive: the other requests are refused, submitSends() reads every result as a send's.
+// Without kernel support, create() fails: use the poll path.
+class IoUring {
+public:
+	struct Completion {
+		uint64_t userData;
+		int result; 		// Bytes received, or -errno
+		const char* data; 	// Buffer filled, nullptr if none
+		bool more; 			// The multishot reception goes on, else it has to be asked again
+	};
+	
+	// Constructors
+	IoUring() {
+		// Wait for create()
+	}
+	~IoUring() {
+		close();
+	}
+	
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+	
+	// Methods
+	// 'entries' : requests queued at once, rounded to a power of 2. 'completions' : room for the results (0 : twice the entries).
+	bool create(const unsigned int entries, const unsigned int completions = 0) {
+#ifdef IO_URING_AVAILABLE
+		if(opened())
+			return true;
+		
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		if(completions > 0) {
+			params.flags 		|= IORING_SETUP_CQSIZE;
+			params.cq_entries 	= completions;
+		}
+		
+		int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if(fd < 0)
+			return false;
+		_fd = fd;
+		
+		// One mapping for both rings, results never dropped, timeouts given to io_uring_enter, requests read once submitted
+		const unsigned int NEEDED = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_SUBMIT_STABLE;
+		if((params.features & NEEDED) != NEEDED) {
+			close();
+			return false;
+		}
+		
+		const size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		const size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		_ringSize 	= sqSize > cqSize ? sqSize : cqSize;
+		_sqesSize 	= params.sq_entries * sizeof(io_uring_sqe);
+		
+		void* pRing = mmap(nullptr, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+		if(pRing == MAP_FAILED) {
+			close();
+			return false;
+		}
+		_pRing = (char*)pRing;
+		
+		void* pSqes = mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+		if(pSqes == MAP_FAILED) {
+			close();
+			return false;
+		}
+		_sqes = (io_uring_sqe*)pSqes;
+		
+		_sqHead 	= (unsigned int*)(_pRing + params.sq_off.head);
+		_sqTail 	= (unsigned int*)(_pRing + params.sq_off.tail);
+		_sqMask 	= *(unsigned int*)(_pRing + params.sq_off.ring_mask);
+		_sqArray 	= (unsigned int*)(_pRing + params.sq_off.array);
+		_sqEntries 	= params.sq_entries;
+		_sqLocal 	= *_sqTail;
+		
+		_cqHead 	= (unsigned int*)(_pRing + params.cq_off.head);
+		_cqTail 	= (unsigned int*)(_pRing + params.cq_off.tail);
+		_cqMask 	= *(unsigned int*)(_pRing + params.cq_off.ring_mask);
+		_cqes 		= (io_uring_cqe*)(_pRing + params.cq_off.cqes);
+		
+		// Storage of the queued sends
+		_sends.resize(_sqEntries);
+		_iovecs.resize(SEND_BUFFERS);
+		_bytes.resize(SEND_BYTES);
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	void close() {
+#ifdef IO_URING_AVAILABLE
+		if(_pBufferRing)
+			munmap(_pBufferRing, _bufferRingSize);
+		if(_sqes)
+			munmap(_sqes, _sqesSize);
+		if(_pRing)
+			munmap(_pRing, _ringSize);
+		if(_fd >= 0)
+			::close(_fd);
+		_receiving 	= false;
+		_sending 	= false;
+#endif
+		_fd 			= -1;
+		_pRing 			= nullptr;
+		_sqes 			= nullptr;
+		_pBufferRing 	= nullptr;
+	}
+	
+	// Buffers the kernel fills with the receptions, given back with recycle()
+	bool createBuffers(const unsigned int count, const size_t size) {
+#ifdef IO_URING_AVAILABLE
+		if(!opened() || _pBufferRing || count == 0 || count > 32768 || (count & (count - 1)) != 0)
+			return false;
+		
+		_bufferRingSize = count * sizeof(io_uring_buf);
+		void* pBufferRing = mmap(nullptr, _bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(pBufferRing == MAP_FAILED)
+			return false;
+		
+		io_uring_buf_reg registration;
+		memset(&registration, 0, sizeof(registration));
+		registration.ring_addr 		= (uint64_t)(uintptr_t)pBufferRing;
+		registration.ring_entries 	= count;
+		registration.bgid 			= BUFFER_GROUP;
+		
+		if(syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+			munmap(pBufferRing, _bufferRingSize);
+			return false;
+		}
+		
+		_pBufferRing 	= (io_uring_buf_ring*)pBufferRing;
+		_bufferMask 	= count - 1;
+		_bufferSize 	= size;
+		_buffers.resize(count * size);
+		_bufferTail 	= 0;
+		
+		for(unsigned int id = 0; id < count; id++)
+			recycle((uint16_t)id);
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	// The buffer can be filled again
+	void recycle(const uint16_t id) {
+#ifdef IO_URING_AVAILABLE
+		// Not bufs[]: in C++, the flexible array of the kernel header is shifted by an empty struct
+		io_uring_buf& buffer = reinterpret_cast<io_uring_buf*>(_pBufferRing)[_bufferTail & _bufferMask];
+		buffer.addr = (uint64_t)(uintptr_t)&_buffers[id * _bufferSize];
+		buffer.len 	= (uint32_t)_bufferSize;
+		buffer.bid 	= id;
+		
+		_bufferTail++;
+		__atomic_store_n(&_pBufferRing->tail, _bufferTail, __ATOMIC_RELEASE);
+#endif
+	}
+	
+	// Multishot reception on the socket, in the buffers. False if the queue is full, or if the ring sends.
+	bool receive(const SOCKET idSocket, const uint64_t userData) {
+#ifdef IO_URING_AVAILABLE
+		if(_sending)
+			return false;
+		
+		io_uring_sqe* sqe = _sqe();
+		if(!sqe)
+			return false;
+		
+		_receiving = true;
+		sqe->opcode 	= IORING_OP_RECV;
+		sqe->fd 		= (int)idSocket;
+		sqe->ioprio 	= IORING_RECV_MULTISHOT;
+		sqe->flags 		= IOSQE_BUFFER_SELECT;
+		sqe->buf_group 	= BUFFER_GROUP;
+		sqe->user_data 	= userData & ~SEND_TAG;
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	// Queue a datagram, its buffers are borrowed until submitSends(), except those marked in 'copied' which are copied now.
+	// 'segmentSize' > 0 : cut by the kernel (UDP GSO). Without room, what is queued is sent first. False if the ring receives.
+	bool send(const SOCKET idSocket, const wlc::Datagram& datagram, const char* copied) {
+#ifdef IO_URING_AVAILABLE
+		if(_receiving)
+			return false;
+		
+		size_t bytesCopied = 0;
+		for(size_t i = 0; i < datagram.nBuffers; i++) {
+			if(copied[i])
+				bytesCopied += datagram.buffers[i].iov_len;
+		}
+		
+		if(datagram.nBuffers > _iovecs.size() || bytesCopied > _bytes.size())
+			return false;
+		if(!_hasRoom(datagram.nBuffers, bytesCopied) && (!submitSends() || !_hasRoom(datagram.nBuffers, bytesCopied)))
+			return false;
+		
+		// Copy of what the caller will reuse
+		iovec* buffers = &_iovecs[_nIovecs];
+		_nIovecs += datagram.nBuffers;
+		
+		for(size_t i = 0; i < datagram.nBuffers; i++) {
+			buffers[i] = datagram.buffers[i];
+			if(copied[i]) {
+				char* copy = &_bytes[_nBytes];
+				memcpy(copy, datagram.buffers[i].iov_base, datagram.buffers[i].iov_len);
+				_nBytes += datagram.buffers[i].iov_len;
+				buffers[i] = wlc::makeBuffer(copy, datagram.buffers[i].iov_len);
+			}
+		}
+		
+		io_uring_sqe* sqe = _sqe();
+		_Send& send = _sends[_nSends++];
+		_sending = true;
+		memset(&send.header, 0, sizeof(send.header));
+		
+		if(datagram.address) {
+			memcpy(&send.address, datagram.address, datagram.addressSize);
+			send.header.msg_name 	= &send.address;
+			send.header.msg_namelen = datagram.addressSize;
+		}
+		send.header.msg_iov 	= buffers;
+		send.header.msg_iovlen 	= datagram.nBuffers;
+
+#ifdef UDP_SEGMENT
+		if(datagram.segmentSize > 0) {
+			send.header.msg_control 	= send.control;
+			send.header.msg_controllen 	= sizeof(send.control);
+			
+			cmsghdr* control 	= CMSG_FIRSTHDR(&send.header);
+			control->cmsg_level = SOL_UDP;
+			control->cmsg_type 	= UDP_SEGMENT;
+			control->cmsg_len 	= CMSG_LEN(sizeof(uint16_t));
+			
+			uint16_t segmentSize = (uint16_t)datagram.segmentSize;
+			memcpy(CMSG_DATA(control), &segmentSize, sizeof(segmentSize));
+		}
+#endif
+		
+		// Never waits for room in the socket: completed by io_uring_enter, like a non blocking sendmmsg
+		sqe->opcode 	= IORING_OP_SENDMSG;
+		sqe->fd 		= (int)idSocket;
+		sqe->addr 		= (uint64_t)(uintptr_t)&send.header;
+		sqe->len 		= 1;
+		sqe->msg_flags 	= MSG_DONTWAIT;
+		sqe->user_data 	= SEND_TAG | (datagram.segmentSize > 0 ? SEGMENTED_TAG : 0);
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	// Give the queued sends to the kernel, and wait for their results: the payloads can be released.
+	// Segmentation refused once: segmentation() becomes false.
+	bool submitSends() {
+#ifdef IO_URING_AVAILABLE
+		if(!opened() || _receiving)
+			return false;
+		
+		_publish();
+		while(_sendsPending > 0 || _unsubmitted() > 0) {
+			if(_enter(_sendsPending, -1) < 0 && errno != EINTR && errno != EBUSY)
+				return false;
+			completions([](const Completion&) {}); // Only sends on this ring: nothing else is read here
+		}
+		
+		_nSends 	= 0;
+		_nIovecs 	= 0;
+		_nBytes 	= 0;
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	// Submit the queued requests, then wait for a result until the timeout (ms, < 0 : none, 0 : don't wait).
+	// Return false on error, true on timeout too.
+	bool submit(const int timeoutMs) {
+#ifdef IO_URING_AVAILABLE
+		if(!opened())
+			return false;
+		
+		_publish();
+		if(_enter(timeoutMs == 0 ? 0 : 1, timeoutMs) < 0)
+			return errno == ETIME || errno == EINTR || errno == EBUSY;
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	// Read the results, the data of a reception stays valid until its buffer is recycled. Return their number.
+	template <typename F>
+	size_t completions(const F& f) {
+		size_t count = 0;
+#ifdef IO_URING_AVAILABLE
+		unsigned int head = *_cqHead;
+		const unsigned int tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+		
+		for(; head != tail; head++, count++) {
+			const io_uring_cqe& cqe = _cqes[head & _cqMask];
+			
+			// Sends: only their errors matter
+			if(cqe.user_data & SEND_TAG) {
+				_sendsPending--;
+				if(cqe.res < 0 && (cqe.user_data & SEGMENTED_TAG) && cqe.res != -EAGAIN)
+					_segmentation = false;
+				continue;
+			}
+			
+			Completion completion;
+			completion.userData = cqe.user_data;
+			completion.result 	= cqe.res;
+			completion.data 	= (cqe.flags & IORING_CQE_F_BUFFER) ? &_buffers[(cqe.flags >> IORING_CQE_BUFFER_SHIFT) * _bufferSize] : nullptr;
+			completion.more 	= (cqe.flags & IORING_CQE_F_MORE) != 0;
+			
+			f(completion);
+		}
+		
+		__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+#endif
+		return count;
+	}
+	
+	// Getters
+	bool opened() const {
+		return _fd >= 0;
+	}
+	bool segmentation() const {
+		return _segmentation;
+	}
+	// Buffer of a reception, to recycle it
+	uint16_t bufferId(const Completion& completion) const {
+		return (uint16_t)((completion.data - _buffers.data()) / _bufferSize);
+	}
+
+private:
+	static const uint16_t BUFFER_GROUP 		= 0;
+	static const uint64_t SEND_TAG 			= 1ULL << 63;
+	static const uint64_t SEGMENTED_TAG 	= 1ULL << 62;
+	static const size_t SEND_BUFFERS 		= 8192; // iovec of the queued sends
+	static const size_t SEND_BYTES 			= 256 * 1024; // Copies of the headers
+
+#ifdef IO_URING_AVAILABLE
+	struct _Send {
+		msghdr header;
+		sockaddr_storage address;
+		char control[CMSG_SPACE(sizeof(uint16_t))];
+	};
+	
+	// Methods
+	io_uring_sqe* _sqe() {
+		if(_unsubmitted() >= _sqEntries)
+			return nullptr;
+		
+		const unsigned int index = _sqLocal & _sqMask;
+		io_uring_sqe* sqe = &_sqes[index];
+		memset(sqe, 0, sizeof(io_uring_sqe));
+		
+		_sqArray[index] = index;
+		_sqLocal++;
+		return sqe;
+	}
+	
+	bool _hasRoom(const size_t nBuffers, const size_t nBytes) const {
+		return _nSends < _sends.size() && _nIovecs + nBuffers <= _iovecs.size() && _nBytes + nBytes <= _bytes.size() && _unsubmitted() < _sqEntries;
+	}
+	
+	// The kernel can read the requests queued. The sends count as pending from now.
+	void _publish() {
+		for(unsigned int i = *_sqTail; i != _sqLocal; i++) {
+			if(_sqes[i & _sqMask].user_data & SEND_TAG)
+				_sendsPending++;
+		}
+		__atomic_store_n(_sqTail, _sqLocal, __ATOMIC_RELEASE);
+	}
+	unsigned int _unsubmitted() const {
+		return _sqLocal - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+	}
+	
+	// Submit the requests published, then wait for 'minComplete' results
+	int _enter(const unsigned int minComplete, const int timeoutMs) {
+		const unsigned int toSubmit = _unsubmitted();
+		unsigned int flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+		if(minComplete == 0 || timeoutMs < 0)
+			return (int)syscall(__NR_io_uring_enter, _fd, toSubmit, minComplete, flags, nullptr, 0);
+		
+		__kernel_timespec timeout;
+		timeout.tv_sec 	= timeoutMs / 1000;
+		timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+		
+		io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz 	= _NSIG / 8;
+		arg.ts 			= (uint64_t)(uintptr_t)&timeout;
+		
+		return (int)syscall(__NR_io_uring_enter, _fd, toSubmit, minComplete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+#endif
+	
+	// Members
+	int _fd 			= -1;
+	char* _pRing 		= nullptr;
+	size_t _ringSize 	= 0;
+	size_t _sqesSize 	= 0;
+	bool _segmentation 	= true;
+
+#ifdef IO_URING_AVAILABLE
+	// Requests
+	io_uring_sqe* _sqes 	= nullptr;
+	unsigned int* _sqHead 	= nullptr;
+	unsigned int* _sqTail 	= nullptr;
+	unsigned int* _sqArray 	= nullptr;
+	unsigned int _sqMask 	= 0;
+	unsigned int _sqEntries = 0;
+	unsigned int _sqLocal 	= 0; // Queued, published by _enter()
+	
+	// Results
+	io_uring_cqe* _cqes 	= nullptr;
+	unsigned int* _cqHead 	= nullptr;
+	unsigned int* _cqTail 	= nullptr;
+	unsigned int _cqMask 	= 0;
+	
+	// Receptions
+	io_uring_buf_ring* _pBufferRing = nullptr;
+	size_t _bufferRingSize 	= 0;
+	unsigned int _bufferMask = 0;
+	uint16_t _bufferTail 	= 0;
+	bool _receiving 		= false; // A reception asked: no send
+	
+	// Sends
+	std::vector<_Send> _sends;
+	size_t _nSends 			= 0;
+	std::vector<iovec> _iovecs;
+	size_t _nIovecs 		= 0;
+	std::vector<char> _bytes;
+	size_t _nBytes 			= 0;
+	unsigned int _sendsPending = 0; // Submitted, without result yet
+	bool _sending 			= false; // A send queued: no reception
+#else
+	void* _sqes 		= nullptr;
+	void* _pBufferRing 	= nullptr;
+#endif
+	size_t _bufferSize 	= 0;
+	std::vector<char> _buffers;
+};
@@ -6,9 +6,14 @@
 #include <vector>
 #include <iostream>
 #include <map>
+#include <deque>
+#include <atomic>
 #include <algorithm>
+#include <memory>
+#include <type_traits>
 
 #include "../Tool/Timer.hpp"
+#include "../Tool/BufferPool.hpp"
 
 class Message {
 public:
@@ -27,8 +32,20 @@ public:
 		
 		SOUND		= (1<<8),
 		VIDEO		= (1<<9),
+		
+		// Bits 10 to 14 : device frame type and size
+		KEY_FRAME	= (1<<15), // Video frame decodable alone
+		NACK		= (1<<16), // Fragments lost, to send again
+		REPORT		= (1<<17), // Reception seen by a client
+		BINARY		= (1<<18), // Payload in BinaryFormat, or asking for it
 	};
 	
+public:
+	// The payload is always at HEADROOM in the buffer, the header just before it:
+	// a header can be written after the payload without moving it.
+	static const size_t HEADROOM = 32;
+	static const size_t HEADER_LENGTH = 14;
+	
 public:
 	// - Constructors
 	// Serializator
@@ -47,11 +64,88 @@ public:
 		_unserialize(buffer, len);
 	}
 	
+	// Copied in a buffer of the pool, moved without copy
+	Message(const Message& other) : _code(other._code), _size(other._size), _time(other._time), _captureMus(other._captureMus), _receptionMus(other._receptionMus), _length(other._length) {
+		if(_length > 0) {
+			_buffer = PooledBuffer(HEADROOM + _length - HEADER_LENGTH);
+			memcpy(_header(), other._header(), _length);
+		}
+	}
+	Message(Message&& other) : _code(other._code), _size(other._size), _time(other._time), _captureMus(other._captureMus), _receptionMus(other._receptionMus), _length(other._length), _buffer(std::move(other._buffer)) {
+		other._length = 0;
+	}
+	Message& operator=(const Message& other) {
+		if(this == &other)
+			return *this;
+		
+		// Same buffer if big enough
+		if(other._length > 0 && _buffer.capacity() < HEADROOM + other._length - HEADER_LENGTH)
+			_buffer = PooledBuffer(HEADROOM + other._length - HEADER_LENGTH);
+		
+		_code 		= other._code;
+		_size 		= other._size;
+		_time 		= other._time;
+		_captureMus = other._captureMus;
+		_receptionMus = other._receptionMus;
+		_length 	= other._length;
+		if(_length > 0)
+			memcpy(_header(), other._header(), _length);
+		
+		return *this;
+	}
+	Message& operator=(Message&& other) {
+		if(this != &other) {
+			_code 		= other._code;
+			_size 		= other._size;
+			_time 		= other._time;
+			_captureMus = other._captureMus;
+			_receptionMus = other._receptionMus;
+			_length 	= other._length;
+			_buffer 	= std::move(other._buffer);
+			other._length = 0;
+		}
+		return *this;
+	}
+	
+	// Shared, the pointer taken from the pool too
+	template <typename... Args>
+	static std::shared_ptr<const Message> shared(Args&&... args) {
+		return std::allocate_shared<const Message>(PoolAllocator<Message>(), std::forward<Args>(args)...);
+	}
+	
 	// - Setters 
 	// Warning: if len != _size, the size information in the serialized data won't be changed
-	void appendData(char* buffer, unsigned int len) {
-		_dataSerialized.resize(14);
-		_dataSerialized.insert(_dataSerialized.end(), buffer, buffer+len);
+	void appendData(const char* buffer, unsigned int len) {
+		if(_buffer.capacity() < HEADROOM + len) {
+			PooledBuffer bigger(HEADROOM + len);
+			if(_length >= HEADER_LENGTH)
+				memcpy(bigger.data() + HEADROOM - HEADER_LENGTH, _header(), HEADER_LENGTH);
+			else
+				writeHeader(bigger.data() + HEADROOM - HEADER_LENGTH, _code, _size, _time);
+			_buffer = std::move(bigger);
+		}
+		
+		memcpy(_content(), buffer, len);
+		_length = HEADER_LENGTH + len;
+	}
+	
+	// Received with a v2 header
+	void setCaptureMus(const uint64_t captureMus) {
+		_captureMus = captureMus;
+	}
+	// Received on a socket with SocketOptions::receiveTimestamps
+	void setReceptionMus(const uint64_t receptionMus) {
+		_receptionMus = receptionMus;
+	}
+	
+	// Header written again, for a payload filled after: Message(code, nullptr, size) then content()
+	void setHeader(const unsigned int code, const uint64_t time = 0) {
+		_code = code;
+		if(time > 0)
+			_time = time;
+		
+		if(_length >= HEADER_LENGTH)
+			writeHeader(_header(), _code, _size, _time);
 	}
 	
 	// - Getters
@@ -64,18 +158,30 @@ public:
 	const uint64_t timestamp() const {
 		return _time;
 	}
+	const uint64_t captureMus() const { // Steady clock of the sender
+		return _captureMus;
+	}
+	const uint64_t receptionMus() const { // System clock of the kernel reception, 0 if unknown
+		return _receptionMus;
+	}
 	const unsigned int length() const {
 		return _size+14;
 	}
 	const char* content() const {
 		if(isValide())
-			return &_dataSerialized[14];
+			return _buffer.data() + HEADROOM;
+		else
+			return nullptr;
+	}
+	char* content() { // To fill a message created empty: Message(code, nullptr, size)
+		if(isValide())
+			return _content();
 		else
 			return nullptr;
 	}
 	const char* data() const {
 		if(isValide())
-			return &_dataSerialized[0];
+			return _header();
 		else
 			return nullptr;
 	}
@@ -83,138 +189,618 @@ public:
 		if(!isValide())
 			return "";
 		
-		return std::string(&_dataSerialized[14], _size);
+		return std::string(content(), _size);
 	}
 	
 	bool isValide() const {
 		// Message should be at least 14 to be valid
-		return (_dataSerialized.size() > 14);
+		return (_length > HEADER_LENGTH);
 	}
 	
-private:
-	// - Methods 
-	// Create a message [[CODE] [SIZE_MSG] [MSG]]
-	void _serialize(const unsigned int code, const size_t size, const char* pMessage) {
-		if(_time == 0)
-			_time = Timer::timestampMs();
-		
-		_code = code;
-		_size = static_cast<unsigned int>(size);
-		
+	// - Statics
+	// Write the 14 bytes [[CODE] [SIZE_MSG] [TIME]] in header
+	static void writeHeader(char* header, const unsigned int code, const unsigned int size, const uint64_t time) {
 		// Transform these to 4 bytes
 		unsigned char byteCode[4] = {
-			static_cast<unsigned char>((_code & 0x000000FF) >> 0),
-			static_cast<unsigned char>((_code & 0x0000FF00) >> 8), 
-			static_cast<unsigned char>((_code & 0x00FF0000) >> 16), 
-			static_cast<unsigned char>((_code & 0xFF000000) >> 24)
+			static_cast<unsigned char>((code & 0x000000FF) >> 0),
+			static_cast<unsigned char>((code & 0x0000FF00) >> 8), 
+			static_cast<unsigned char>((code & 0x00FF0000) >> 16), 
+			static_cast<unsigned char>((code & 0xFF000000) >> 24)
 		};
 		unsigned char byteSize[4] = {
-			static_cast<unsigned char>((_size & 0x000000FF) >> 0),
-			static_cast<unsigned char>((_size & 0x0000FF00) >> 8), 
-			static_cast<unsigned char>((_size & 0x00FF0000) >> 16), 
-			static_cast<unsigned char>((_size & 0xFF000000) >> 24)
+			static_cast<unsigned char>((size & 0x000000FF) >> 0),
+			static_cast<unsigned char>((size & 0x0000FF00) >> 8), 
+			static_cast<unsigned char>((size & 0x00FF0000) >> 16), 
+			static_cast<unsigned char>((size & 0xFF000000) >> 24)
 		};
 		unsigned char byteTime[6] = {
-			static_cast<unsigned char>((_time & 0x0000000000FF) >> 0),
-			static_cast<unsigned char>((_time & 0x00000000FF00) >> 8), 
-			static_cast<unsigned char>((_time & 0x000000FF0000) >> 16), 
-			static_cast<unsigned char>((_time & 0x0000FF000000) >> 24),
-			static_cast<unsigned char>((_time & 0x00FF00000000) >> 32),
-			static_cast<unsigned char>((_time & 0xFF0000000000) >> 40),
+			static_cast<unsigned char>((time & 0x0000000000FF) >> 0),
+			static_cast<unsigned char>((time & 0x00000000FF00) >> 8), 
+			static_cast<unsigned char>((time & 0x000000FF0000) >> 16), 
+			static_cast<unsigned char>((time & 0x0000FF000000) >> 24),
+			static_cast<unsigned char>((time & 0x00FF00000000) >> 32),
+			static_cast<unsigned char>((time & 0xFF0000000000) >> 40),
 		};
 		
-		// Create string
-		_dataSerialized.resize(static_cast<size_t>(14+_size), '\0');
-		
-		// Copy code 
-		memcpy(&_dataSerialized[0], byteCode, 4);
-		memcpy(&_dataSerialized[4], byteSize, 4);
-		memcpy(&_dataSerialized[8], byteTime, 6);
-		
-		if(pMessage)
-			memcpy(&_dataSerialized[14], pMessage, static_cast<size_t>(_size));
+		memcpy(&header[0], byteCode, 4);
+		memcpy(&header[4], byteSize, 4);
+		memcpy(&header[8], byteTime, 6);
 	}
 	
-	void _unserialize(const char* buffer, const size_t len) {
-		if(len < 14)
-			return;
-		
-		_code = 
+	// Read the 14 bytes header
+	static void readHeader(const char* buffer, unsigned int& code, unsigned int& size, uint64_t& time) {
+		code = 
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[0])) << 0)  +
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[1])) << 8)  +
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[2])) << 16)	+
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[3])) << 24);
 			
-		_size = 
+		size = 
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[4])) << 0)  +
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[5])) << 8)  +
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[6])) << 16)	+
 			(static_cast<unsigned int>(static_cast<unsigned char>(buffer[7])) << 24);
 			
-		_time = 
+		time = 
 			(static_cast<uint64_t>(static_cast<unsigned char>(buffer[8])) 	<< 0)  +
 			(static_cast<uint64_t>(static_cast<unsigned char>(buffer[9])) 	<< 8)  +
 			(static_cast<uint64_t>(static_cast<unsigned char>(buffer[10])) << 16) +
 			(static_cast<uint64_t>(static_cast<unsigned char>(buffer[11])) << 24) +
 			(static_cast<uint64_t>(static_cast<unsigned char>(buffer[12])) << 32) +
 			(static_cast<uint64_t>(static_cast<unsigned char>(buffer[13])) << 40);
+	}
+	
+private:
+	// - Methods 
+	// Create a message [[CODE] [SIZE_MSG] [MSG]]
+	void _serialize(const unsigned int code, const size_t size, const char* pMessage) {
+		if(_time == 0)
+			_time = Timer::timestampMs();
+		_captureMus = Timer::monotonicMus();
 		
-		_dataSerialized = std::vector<char>(buffer, buffer+len);
+		_code = code;
+		_size = static_cast<unsigned int>(size);
+		
+		// Without payload, nothing to keep: the message isn't valid
+		if(_size == 0)
+			return;
+		
+		// Take a buffer
+		_buffer = PooledBuffer(HEADROOM + _size);
+		_length = HEADER_LENGTH + _size;
+		
+		// Copy code 
+		writeHeader(_header(), _code, _size, _time);
+		
+		if(pMessage)
+			memcpy(_content(), pMessage, static_cast<size_t>(_size));
+		else
+			memset(_content(), 0, static_cast<size_t>(_size));
+	}
+	
+	void _unserialize(const char* buffer, const size_t len) {
+		if(len < HEADER_LENGTH)
+			return;
+		
+		readHeader(buffer, _code, _size, _time);
+		
+		_buffer = PooledBuffer(HEADROOM + len - HEADER_LENGTH);
+		_length = len;
+		memcpy(_header(), buffer, len);
+	}
+	
+	char* _header() const {
+		return _buffer.data() + HEADROOM - HEADER_LENGTH;
+	}
+	char* _content() {
+		return _buffer.data() + HEADROOM;
 	}
 	
 	// Members
 	unsigned int _code = 0;
 	unsigned int _size = 0;
 	uint64_t _time = 0;
-	std::vector<char> _dataSerialized;
+	uint64_t _captureMus = 0;
+	uint64_t _receptionMus = 0;
+	size_t _length = 0; // Header and payload
+	PooledBuffer _buffer;
 };
 
-// --------- Buffer helper ------------
-struct MessageBuffer {
-	MessageBuffer(unsigned int c = 0, uint64_t t = 0, unsigned int s = 0) : code(c), timestamp(t), sizeExpected(s) {
+// --------- View for sending ------------
+// Header serialized on the stack + borrowed payload: nothing is copied.
+// The payload must outlive the view.
+struct MessageView {
+	MessageView(const unsigned int c, const char* buffer, const size_t len, const uint64_t time = 0) : 
+		code(c), 
+		timestamp(time > 0 ? time : Timer::timestampMs()),
+		captureMus(Timer::monotonicMus()),
+		payload(buffer), 
+		size(static_cast<unsigned int>(len))
+	{
+		Message::writeHeader(header, code, size, timestamp);
+	}
+	MessageView(const Message& message) : 
+		code(message.code()), 
+		timestamp(message.timestamp()),
+		captureMus(message.captureMus()),
+		payload(message.content()), 
+		size(message.content() ? message.size() : 0)
+	{
+		Message::writeHeader(header, code, size, timestamp);
 	}
 	
 	// Members
 	unsigned int code;
 	uint64_t timestamp;
-	unsigned int sizeExpected;
+	uint64_t captureMus;
+	const char* payload;
+	unsigned int size;
+	char header[14];
+};
 
-	std::vector<std::vector<char>> packets;
+// --------- Fragments ------------
+// A fragment payload starts with [[FRAME ID] [INDEX] [COUNT] [OFFSET] [SIZE TOTAL] [PARITY COUNT] [FRAGMENT SIZE]] (20 bytes).
+// Data fragments have an index below count, then come the parity ones: XOR of the fragments (i % parityCount).
+struct FragmentHeader {
+	static const unsigned int LENGTH = 20;
 	
-	// Methods
-	const unsigned int packetSize() const {
-		unsigned int s = 0;
-		for(const auto& t : packets)
-			s += (unsigned int)t.size();
-		return s;
+	uint32_t frameId 		= 0;
+	uint16_t index 			= 0;
+	uint16_t count 			= 0;
+	uint32_t offset 		= 0;
+	uint32_t sizeTotal 		= 0;
+	uint16_t parityCount 	= 0;
+	uint16_t fragmentSize 	= 0; // All but the last one
+	
+	void write(char* buffer) const {
+		writeBytes(buffer + 0, 	frameId, 		4);
+		writeBytes(buffer + 4, 	index, 			2);
+		writeBytes(buffer + 6, 	count, 			2);
+		writeBytes(buffer + 8, 	offset, 		4);
+		writeBytes(buffer + 12, 	sizeTotal, 		4);
+		writeBytes(buffer + 16, 	parityCount, 	2);
+		writeBytes(buffer + 18, 	fragmentSize, 	2);
+	}
+	
+	// False if the fragment can't belong to a frame
+	bool read(const char* buffer, const size_t len) {
+		if(len < LENGTH)
+			return false;
+		
+		frameId 		= (uint32_t)readBytes(buffer + 0, 	4);
+		index 			= (uint16_t)readBytes(buffer + 4, 	2);
+		count 			= (uint16_t)readBytes(buffer + 6, 	2);
+		offset 			= (uint32_t)readBytes(buffer + 8, 	4);
+		sizeTotal 		= (uint32_t)readBytes(buffer + 12, 4);
+		parityCount 	= (uint16_t)readBytes(buffer + 16, 2);
+		fragmentSize 	= (uint16_t)readBytes(buffer + 18, 2);
+		
+		if(fragmentSize == 0 || (uint64_t)count * fragmentSize < sizeTotal)
+			return false;
+		
+		if(parity())
+			return index < count + parityCount && len - LENGTH == fragmentSize;
+		
+		return offset == (uint32_t)index * fragmentSize && (uint64_t)offset + (len - LENGTH) <= sizeTotal;
 	}
-	bool complete() const {
-		return packetSize() == sizeExpected;
+	
+	bool parity() const {
+		return index >= count;
+	}
+	
+	// Build the parity fragments (parityCount * fragmentSize bytes, zeroed) of the frame
+	static void xorParity(char* parities, const char* frame, const FragmentHeader& header) {
+		for(uint32_t i = 0, offset = 0; i < header.count; i++, offset += header.fragmentSize) {
+			const uint32_t len = std::min<uint32_t>(header.fragmentSize, header.sizeTotal - offset);
+			xorInto(parities + (size_t)(i % header.parityCount) * header.fragmentSize, frame + offset, len);
+		}
+	}
+	static void xorInto(char* dst, const char* src, const size_t len) {
+		for(size_t i = 0; i < len; i++)
+			dst[i] ^= src[i];
 	}
 	
-	bool compose(Message& msg) {
-		if(!complete() || packets.size() == 0)
+	// Little endian, as the message header
+	static void writeBytes(char* buffer, uint32_t value, int nBytes) {
+		for(int i = 0; i < nBytes; i++)
+			buffer[i] = static_cast<char>((value >> (8*i)) & 0xFF);
+	}
+	static uint32_t readBytes(const char* buffer, int nBytes) {
+		uint32_t value = 0;
+		for(int i = 0; i < nBytes; i++)
+			value |= static_cast<uint32_t>(static_cast<unsigned char>(buffer[i])) << (8*i);
+		return value;
+	}
+};
+
+// --------- Header v2 ------------
+// [[MARK] [FLAGS] [STREAM] [CODE] [SIZE] [SEQUENCE] [CAPTURE µs] [FRAGMENT INDEX] [FRAGMENT COUNT] [FRAME ID] [TIMESTAMP]] (40 bytes)
+// The first byte of a v1 header is the low byte of its code, where bit 0 is never used: a v2 one starts with it set.
+// Fields are aligned and little endian, as in memory on the hosts supported: read and written with one copy.
+struct HeaderV2 {
+	static const unsigned int LENGTH 	= 40;
+	static const uint8_t MARK 			= 0x05; // Version 2 and bit 0
+	
+	enum Flags : uint8_t {
+		KEY 		= (1<<0), // Decodable alone
+		FRAGMENTED 	= (1<<1), // Payload starts with a FragmentHeader
+		PARITY 		= (1<<2)
+	};
+	
+	// One sequence by stream, so the loss of one kind doesn't hide behind the others
+	enum Stream : uint16_t {
+		CONTROL = 0,
+		AUDIO 	= 1,
+		VIDEO 	= 2,
+		STREAMS = 3
+	};
+	
+	uint8_t mark 			= MARK;
+	uint8_t flags 			= 0;
+	uint16_t stream 		= CONTROL;
+	uint32_t code 			= 0;
+	uint32_t size 			= 0; // Payload after this header
+	uint32_t sequence 		= 0; // Datagrams of the stream, for one receiver
+	uint64_t captureMus 	= 0; // Steady clock of the sender
+	uint16_t fragmentIndex 	= 0;
+	uint16_t fragmentCount 	= 1;
+	uint32_t frameId 		= 0; // 0 if not fragmented
+	uint64_t timestamp 		= 0; // Of the application, as in a v1 header
+	
+	void write(char* buffer) const {
+		memcpy(buffer, this, LENGTH);
+	}
+	bool read(const char* buffer, const size_t len) {
+		if(!is(buffer, len))
 			return false;
 		
-		// Packet
-		std::sort(packets.begin(), packets.end(), [=](const std::vector<char>& pA, const std::vector<char>& pB) {
-			return pA.size() > pB.size();
-		});
+		memcpy(this, buffer, LENGTH);
+		return true;
+	}
+	
+	static bool is(const char* buffer, const size_t len) {
+		return len >= LENGTH && static_cast<uint8_t>(buffer[0]) == MARK;
+	}
+	static Stream streamOf(const unsigned int code) {
+		if(code & (Message::FORMAT | Message::PROPERTIES | Message::HANDSHAKE))
+			return CONTROL;
+		if(code & Message::SOUND)
+			return AUDIO;
+		if(code & (Message::VIDEO | Message::DEVICE))
+			return VIDEO;
+		return CONTROL;
+	}
+};
+static_assert(sizeof(HeaderV2) == HeaderV2::LENGTH, "HeaderV2 must have the layout of the wire");
+
+// Next sequence of each stream, for one receiver
+struct StreamSequences {
+	uint32_t next[HeaderV2::STREAMS] = { 0, 0, 0 };
+};
+
+// Sequences received on a stream: losses and reordering
+class SequenceTracker {
+public:
+	void add(const uint32_t sequence) {
+		if(!_started) {
+			_started 	= true;
+			_highest 	= sequence;
+			_received++;
+			return;
+		}
 		
-		// Buffer
-		std::vector<char> buffer = std::move(packets[0]);
+		const int32_t gap = (int32_t)(sequence - _highest); // Wraps
+		if(gap > 0) {
+			_lost += (uint64_t)(gap - 1);
+			_highest = sequence;
+		}
+		else { // Late: counted lost when its gap was seen
+			_reordered++;
+			if(_lost > 0)
+				_lost--;
+		}
+		_received++;
+	}
+	
+	// Getters
+	uint64_t received() const {
+		return _received;
+	}
+	uint64_t lost() const {
+		return _lost;
+	}
+	uint64_t reordered() const {
+		return _reordered;
+	}
+	
+private:
+	bool _started 		= false;
+	uint32_t _highest 	= 0;
+	uint64_t _received 	= 0;
+	uint64_t _lost 		= 0;
+	uint64_t _reordered = 0;
+};
+
+// Fragments missing in a frame: [[FRAME ID] [N RANGES] [[FIRST INDEX] [COUNT]] ...]
+struct FragmentNack {
+	uint32_t frameId = 0;
+	std::vector<std::pair<uint16_t, uint16_t>> ranges; // First index, count
+	
+	std::string str() const {
+		std::string buffer(6 + 4 * ranges.size(), '\0');
+		FragmentHeader::writeBytes(&buffer[0], frameId, 4);
+		FragmentHeader::writeBytes(&buffer[4], (uint32_t)ranges.size(), 2);
 		
-		for(size_t i = 1; i < packets.size(); i++) {
-			buffer.reserve(buffer.size() + packets[i].size());
-			std::move(std::begin(packets[i]), std::end(packets[i]), std::back_inserter(buffer));
-			packets[i].clear();
+		for(size_t i = 0; i < ranges.size(); i++) {
+			FragmentHeader::writeBytes(&buffer[6 + 4*i], ranges[i].first, 	2);
+			FragmentHeader::writeBytes(&buffer[8 + 4*i], ranges[i].second, 2);
 		}
-		packets.clear();
+		return buffer;
+	}
+	
+	bool read(const char* buffer, const size_t len) {
+		if(len < 6)
+			return false;
+		
+		frameId = FragmentHeader::readBytes(&buffer[0], 4);
+		const size_t nRanges = FragmentHeader::readBytes(&buffer[4], 2);
+		if(len < 6 + 4 * nRanges)
+			return false;
+		
+		ranges.clear();
+		for(size_t i = 0; i < nRanges; i++)
+			ranges.push_back(std::make_pair((uint16_t)FragmentHeader::readBytes(&buffer[6 + 4*i], 2), (uint16_t)FragmentHeader::readBytes(&buffer[8 + 4*i], 2)));
 		
-		// Create msg
-		msg = Message(code, buffer.data(), sizeExpected, timestamp);
 		return true;
 	}
+	
+	std::vector<uint16_t> indexes() const {
+		std::vector<uint16_t> list;
+		for(const auto& range : ranges) 
+			for(uint32_t i = range.first; i < (uint32_t)range.first + range.second && i <= 0xFFFF; i++)
+				list.push_back((uint16_t)i);
+		return list;
+	}
+};
+
+// Rebuild fragmented messages: each fragment is copied at its offset in the final message.
+// A fragment missing in its parity group is rebuilt from the others and the parity.
+// Frames not completed after the timeout are forgotten.
+// The sizes come from the network: a frame bigger than 'maxFrameSize' is refused, and beyond 'maxFrames' rebuilt at once the oldest is forgotten.
+class FrameAssembler {
+public:
+	static const size_t MAX_FRAME_SIZE 	= 32 * 1024 * 1024; // 4K uncompressed fits
+	static const size_t MAX_FRAMES 		= 16;
+	
+	explicit FrameAssembler(const uint64_t timeoutMs = 1000, const size_t maxFrameSize = MAX_FRAME_SIZE, const size_t maxFrames = MAX_FRAMES) : 
+		_timeout(timeoutMs), 
+		_maxFrameSize(maxFrameSize), 
+		_maxFrames(maxFrames), 
+		_nExpired(0), 
+		_nRecovered(0) 
+	{
+	}
+	
+	// Return true when the fragment completes its frame, then moved in 'message'
+	bool add(const unsigned int code, const uint64_t timestamp, const FragmentHeader& fragment, const char* data, const size_t len, Message& message) {
+		const uint64_t now = Timer::timestampMs();
+		
+		// Never allocated for a frame, or its parity, too big
+		if(fragment.sizeTotal > _maxFrameSize || (uint64_t)fragment.parityCount * fragment.fragmentSize > _maxFrameSize)
+			return false;
+		
+		// Late fragment (parity not needed, duplicate)
+		if(std::find(_completed.begin(), _completed.end(), fragment.frameId) != _completed.end())
+			return false;
+		
+		std::map<uint32_t, _Frame>::iterator itFrame = _frames.find(fragment.frameId);
+		if(itFrame == _frames.end()) {
+			collect(now);
+			if(_maxFrames == 0)
+				return false;
+			if(_frames.size() >= _maxFrames)
+				_forgetOldest();
+			
+			_Frame frame;
+			frame.header 		= fragment;
+			frame.message 		= Message(code, nullptr, fragment.sizeTotal, timestamp);
+			frame.received 		= std::vector<uint64_t>((fragment.count + fragment.parityCount + 63) / 64, 0);
+			frame.groupReceived = std::vector<uint16_t>(fragment.parityCount, 0);
+			
+			itFrame = _frames.insert(std::make_pair(fragment.frameId, std::move(frame))).first;
+		}
+		_Frame& frame = itFrame->second;
+		
+		// Not the same frame (id reused) or already received
+		if(frame.header.sizeTotal != fragment.sizeTotal || frame.header.count != fragment.count || 
+			frame.header.parityCount != fragment.parityCount || frame.header.fragmentSize != fragment.fragmentSize)
+		{
+			return false;
+		}
+		if(_isReceived(frame, fragment.index))
+			return false;
+		
+		_setReceived(frame, fragment.index);
+		frame.lastUpdate = now;
+		
+		// Copy at its place
+		if(fragment.parity()) {
+			if(frame.parities.empty())
+				frame.parities.resize((size_t)fragment.parityCount * fragment.fragmentSize, 0);
+			
+			const uint16_t group = fragment.index - fragment.count;
+			memcpy(&frame.parities[(size_t)group * fragment.fragmentSize], data, len);
+			_recover(frame, group);
+		}
+		else {
+			if(len > 0)
+				memcpy(frame.message.content() + fragment.offset, data, len);
+			
+			frame.nReceived++;
+			if(fragment.parityCount > 0) {
+				const uint16_t group = fragment.index % fragment.parityCount;
+				frame.groupReceived[group]++;
+				_recover(frame, group);
+			}
+		}
+		
+		if(frame.nReceived < frame.header.count)
+			return false;
+		
+		if(frame.recovered)
+			_nRecovered++;
+		
+		message = std::move(frame.message);
+		_frames.erase(itFrame);
+		
+		_completed.push_back(fragment.frameId);
+		if(_completed.size() > MAX_COMPLETED)
+			_completed.pop_front();
+		
+		return true;
+	}
+	
+	// Frames matching 'codeMask' without news for 'delayMs': list their missing fragments. 
+	// Each frame is asked at most 'maxNacks' times, 'delayMs' apart.
+	void missing(const unsigned int codeMask, const uint64_t delayMs, const int maxNacks, std::vector<FragmentNack>& nacks) {
+		const uint64_t now = Timer::timestampMs();
+		
+		for(auto& idFrame : _frames) {
+			_Frame& frame = idFrame.second;
+			if((frame.message.code() & codeMask) != codeMask || frame.nNacks >= maxNacks)
+				continue;
+			
+			if(now - std::max(frame.lastUpdate, frame.lastNack) < delayMs)
+				continue;
+			
+			FragmentNack nack;
+			nack.frameId = idFrame.first;
+			
+			for(uint32_t i = 0; i < frame.header.count; i++) {
+				if(_isReceived(frame, (uint16_t)i))
+					continue;
+				
+				if(!nack.ranges.empty() && nack.ranges.back().first + nack.ranges.back().second == i)
+					nack.ranges.back().second++;
+				else
+					nack.ranges.push_back(std::make_pair((uint16_t)i, (uint16_t)1));
+			}
+			
+			frame.nNacks++;
+			frame.lastNack = now;
+			nacks.push_back(nack);
+		}
+	}
+	
+	// Forget the frames without news since the timeout
+	void collect(const uint64_t now = Timer::timestampMs()) {
+		for(std::map<uint32_t, _Frame>::iterator itFrame = _frames.begin(); itFrame != _frames.end();) {
+			if(now - itFrame->second.lastUpdate > _timeout) {
+				itFrame = _frames.erase(itFrame);
+				_nExpired++;
+			}
+			else
+				++itFrame;
+		}
+	}
+	
+	// Setters
+	void setLimits(const size_t maxFrameSize, const size_t maxFrames) {
+		_maxFrameSize 	= maxFrameSize;
+		_maxFrames 		= maxFrames;
+	}
+	
+	// Getters
+	size_t pending() const {
+		return _frames.size();
+	}
+	uint64_t expired() const { // Unrecoverable
+		return _nExpired;
+	}
+	uint64_t recovered() const { // Completed thanks to parity
+		return _nRecovered;
+	}
+	
+private:
+	static const size_t MAX_COMPLETED = 64;
+	
+	struct _Frame {
+		FragmentHeader header;
+		Message message;
+		std::vector<uint64_t> received; // Bitmap of the fragments (parity included)
+		std::vector<uint16_t> groupReceived;
+		std::vector<char> parities;
+		uint16_t nReceived 	= 0;
+		bool recovered 		= false;
+		uint64_t lastUpdate = Timer::timestampMs();
+		uint64_t lastNack 	= 0;
+		int nNacks 			= 0;
+	};
+	
+	// Methods
+	static bool _isReceived(const _Frame& frame, const uint16_t index) {
+		return (frame.received[index / 64] >> (index % 64)) & 1;
+	}
+	static void _setReceived(_Frame& frame, const uint16_t index) {
+		frame.received[index / 64] |= (uint64_t)1 << (index % 64);
+	}
+	
+	// Room for a new frame: the one without news for the longest time is lost
+	void _forgetOldest() {
+		std::map<uint32_t, _Frame>::iterator itOldest = _frames.begin();
+		for(std::map<uint32_t, _Frame>::iterator itFrame = _frames.begin(); itFrame != _frames.end(); ++itFrame) {
+			if(itFrame->second.lastUpdate < itOldest->second.lastUpdate)
+				itOldest = itFrame;
+		}
+		
+		if(itOldest != _frames.end()) {
+			_frames.erase(itOldest);
+			_nExpired++;
+		}
+	}
+	
+	// Rebuild the fragment missing in the group when it is the only one
+	static void _recover(_Frame& frame, const uint16_t group) {
+		const FragmentHeader& header = frame.header;
+		if(!_isReceived(frame, header.count + group))
+			return;
+		
+		const uint16_t groupSize = (uint16_t)(header.count / header.parityCount + (group < header.count % header.parityCount ? 1 : 0));
+		if(frame.groupReceived[group] + 1 != groupSize)
+			return;
+		
+		// Missing one
+		uint16_t missing = group;
+		while(_isReceived(frame, missing))
+			missing += header.parityCount;
+		
+		// XOR of the parity and the others
+		char* parity = &frame.parities[(size_t)group * header.fragmentSize];
+		for(uint16_t i = group; i < header.count; i += header.parityCount) {
+			if(i == missing)
+				continue;
+			
+			const uint32_t offset = (uint32_t)i * header.fragmentSize;
+			FragmentHeader::xorInto(parity, frame.message.content() + offset, std::min<uint32_t>(header.fragmentSize, header.sizeTotal - offset));
+		}
+		
+		const uint32_t offset = (uint32_t)missing * header.fragmentSize;
+		memcpy(frame.message.content() + offset, parity, std::min<uint32_t>(header.fragmentSize, header.sizeTotal - offset));
+		
+		_setReceived(frame, missing);
+		frame.groupReceived[group]++;
+		frame.nReceived++;
+		frame.recovered = true;
+	}
+	
+	// Members
+	uint64_t _timeout;
+	size_t _maxFrameSize;
+	size_t _maxFrames;
+	std::atomic<uint64_t> _nExpired;
+	std::atomic<uint64_t> _nRecovered;
+	std::map<uint32_t, _Frame> _frames;
+	std::deque<uint32_t> _completed; // Recent frames, their late fragments are ignored
 };
 
 // --------- Error ------------
@@ -365,6 +951,176 @@ private:
 	std::map<std::string, std::string> _cache;
 };
 
+// ------------------- BinaryFormat : numeric keys and typed values -------------------
+// [[KEY] [TYPE] [VALUE]] ... : key on 2 bytes, type on 1, value on 0, 4 (int) or 8 bytes (double), little endian.
+// Read in place from the payload, without allocation.
+class BinaryFormat {
+public:
+	enum Type : unsigned char {
+		NONE 	= 0, // Key alone
+		INT 	= 1,
+		DOUBLE 	= 2
+	};
+	
+	// Constructors
+	// To write
+	BinaryFormat() : _data(nullptr), _len(0) {
+	}
+	// To read, the buffer must outlive the format
+	BinaryFormat(const char* data, const size_t len) : _data(data), _len(len) {
+	}
+	
+	// Methods
+	void add(const uint16_t key) {
+		_write(key, NONE, nullptr, 0);
+	}
+	template<typename T>
+	void add(const uint16_t key, T value) {
+		if(std::is_floating_point<T>::value) {
+			const double d = (double)value;
+			uint64_t bits = 0;
+			memcpy(&bits, &d, 8);
+			
+			char bytes[8];
+			for(int i = 0; i < 8; i++)
+				bytes[i] = static_cast<char>((bits >> (8*i)) & 0xFF);
+			_write(key, DOUBLE, bytes, 8);
+		}
+		else {
+			char bytes[4];
+			FragmentHeader::writeBytes(bytes, static_cast<uint32_t>(static_cast<int32_t>(value)), 4);
+			_write(key, INT, bytes, 4);
+		}
+	}
+	
+	template<typename T>
+	T valueOf(const uint16_t key, bool* pExist = nullptr) const {
+		Type type = NONE;
+		const char* value = _find(key, type);
+		if(pExist != nullptr)
+			*pExist = (value != nullptr);
+		
+		if(type == INT)
+			return (T)static_cast<int32_t>(FragmentHeader::readBytes(value, 4));
+		
+		if(type == DOUBLE) {
+			uint64_t bits = (uint64_t)FragmentHeader::readBytes(value, 4) | ((uint64_t)FragmentHeader::readBytes(value + 4, 4) << 32);
+			double d = 0.0;
+			memcpy(&d, &bits, 8);
+			return (T)d;
+		}
+		
+		return (T)0;
+	}
+	bool exists(const uint16_t key) const {
+		Type type = NONE;
+		return _find(key, type) != nullptr;
+	}
+	
+	// Every entry complete, with a known type
+	bool isValide() const {
+		size_t offset = 0;
+		while(offset < _size()) {
+			size_t len = 0;
+			if(!_entry(offset, len))
+				return false;
+			offset += 3 + len;
+		}
+		return true;
+	}
+	
+	// Getters
+	const char* data() const {
+		return _data ? _data : _written.data();
+	}
+	size_t size() const {
+		return _size();
+	}
+	
+private:
+	// Methods
+	void _write(const uint16_t key, const Type type, const char* value, const size_t len) {
+		char entry[3];
+		FragmentHeader::writeBytes(entry, key, 2);
+		entry[2] = static_cast<char>(type);
+		
+		_written.append(entry, 3);
+		_written.append(value, len);
+	}
+	
+	// Value of the key, nullptr if not found
+	const char* _find(const uint16_t key, Type& type) const {
+		const char* buffer = data();
+		
+		for(size_t offset = 0, len = 0; offset < _size(); offset += 3 + len) {
+			if(!_entry(offset, len))
+				return nullptr;
+			
+			if(FragmentHeader::readBytes(buffer + offset, 2) == key) {
+				type = static_cast<Type>(buffer[offset + 2]);
+				return buffer + offset + 3;
+			}
+		}
+		return nullptr;
+	}
+	
+	// Length of the value at 'offset', false if the entry is cut or unknown
+	bool _entry(const size_t offset, size_t& len) const {
+		if(offset + 3 > _size())
+			return false;
+		
+		switch(static_cast<Type>(data()[offset + 2])) {
+			case NONE: 		len = 0; break;
+			case INT: 		len = 4; break;
+			case DOUBLE: 	len = 8; break;
+			default: 		return false;
+		}
+		return offset + 3 + len <= _size();
+	}
+	
+	size_t _size() const {
+		return _data ? _len : _written.size();
+	}
+	
+	// Members
+	const char* _data;
+	size_t _len;
+	std::string _written;
+};
+
+// ------------------- ReceptionReport : what a client received lately -------------------
+// The one-way delay is measured above the lowest one seen: the clocks don't need to be synchronized.
+struct ReceptionReport {
+	double rate 	= 0.0; 	// Bytes per second
+	double loss 	= 0.0; 	// Part of the frames lost [0, 1]
+	int delay 		= 0; 	// ms spent in queues along the path
+	int delayTrend 	= 0;	// ms gained since the previous report
+	int jitter 		= 0; 	// µs, between the frames (v2 headers only)
+	
+	std::string str() const {
+		MessageFormat format;
+		format.add("rate", 	rate);
+		format.add("loss", 	loss);
+		format.add("delay", delay);
+		format.add("trend", delayTrend);
+		format.add("jitter", jitter);
+		return format.str();
+	}
+	
+	bool read(const std::string& msg) {
+		bool exist = false;
+		MessageFormat format(msg);
+		
+		rate 		= format.valueOf<double>("rate", &exist);
+		loss 		= format.valueOf<double>("loss");
+		delay 		= format.valueOf<int>("delay");
+		delayTrend 	= format.valueOf<int>("trend");
+		jitter 		= format.valueOf<int>("jitter");
+		
+		return exist;
+	}
+};
+
 // --------- Manager ------------
 class MessageManager {
 public:
@@ -394,4 +1150,84 @@ public:
 	}	
 };
 
+// ------------------- MessageStream : rebuild messages from a byte stream (TCP) -------------------
+// Bytes are received directly in the buffer, then complete messages are parsed in place.
+// A message cut by a read waits for the next ones, whatever its size.
+// Each message popped is copied once, in a buffer of the pool: it outlives the next reads, its callbacks run later.
+class MessageStream {
+public:
+	// Constructors
+	explicit MessageStream(const size_t minSpace = 65536) : _minSpace(minSpace), _begin(0), _end(0) {
+		_buffer.resize(_minSpace);
+	}
+	
+	// Methods
+	// Where to receive, 'space' is filled with the room available
+	char* reserve(size_t& space) {
+		// Move the unread bytes at front, only when there is not enough room behind them
+		const size_t unread = _end - _begin;
+		if(_begin > 0 && _buffer.size() - _end < _minSpace) {
+			if(unread > 0)
+				memmove(&_buffer[0], &_buffer[_begin], unread);
+			
+			_begin 	= 0;
+			_end 	= unread;
+		}
+		
+		// Grow for a big message, progressively: the size announced isn't trusted until received
+		if(_buffer.size() - _end < _minSpace) 
+			_buffer.resize(std::max(_buffer.size() * 2, _end + _minSpace));
+		
+		space = _buffer.size() - _end;
+		return &_buffer[_end];
+	}
+	
+	// 'len' bytes were written after reserve()
+	void commit(const size_t len) {
+		_end += len;
+	}
+	
+	// Read the next complete message, false if none. Its bytes are copied: the stream reuses the buffer.
+	bool pop(Message& message) {
+		if(_end - _begin < 14)
+			return false;
+		
+		const char* header = &_buffer[_begin];
+		const size_t size = 
+			(static_cast<size_t>(static_cast<unsigned char>(header[4])) << 0)  +
+			(static_cast<size_t>(static_cast<unsigned char>(header[5])) << 8)  +
+			(static_cast<size_t>(static_cast<unsigned char>(header[6])) << 16) +
+			(static_cast<size_t>(static_cast<unsigned char>(header[7])) << 24);
+		
+		if(_end - _begin < 14 + size)
+			return false;
+		
+		message = Message(header, 14 + size);
+		_begin += 14 + size;
+		
+		// Empty: start again from the front
+		if(_begin == _end) 
+			_begin = _end = 0;
+		
+		// Release the memory taken by a big message
+		if(_end == 0 && _buffer.size() > 4 * _minSpace) {
+			_buffer.resize(_minSpace);
+			_buffer.shrink_to_fit();
+		}
+		
+		return true;
+	}
+	
+	void clear() {
+		_begin = _end = 0;
+	}
+	
+private:
+	// Members
+	const size_t _minSpace;
+	
+	std::vector<char> _buffer;
+	size_t _begin; // First unread byte
+	size_t _end; 	// After the last received byte
+};
 
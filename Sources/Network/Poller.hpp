@@ -0,0 +1,165 @@
+#pragma once
+
+#include "WinLinConversion.hpp"
+#include "../Tool/Timer.hpp"
+
+#include <vector>
+#include <algorithm>
+
+// ------------------- Poller : watch many sockets from one thread -------------------
+// Linux uses epoll (level-triggered), others fall back on a pollfd set.
+class Poller {
+public:
+	enum Event : unsigned int {
+		In		= (1<<0),
+		Out		= (1<<1),
+		Closed	= (1<<2)
+	};
+
+	struct Ready {
+		SOCKET id;
+		unsigned int events;
+	};
+
+public:
+	// Constructors
+	Poller() : _fd(-1) {
+		// Wait for create()
+	}
+	~Poller() {
+		close();
+	}
+
+	Poller(const Poller&) = delete;
+	Poller& operator=(const Poller&) = delete;
+
+	// Methods
+	bool create() {
+#ifdef __linux__
+		if(_fd < 0)
+			_fd = epoll_create1(EPOLL_CLOEXEC);
+		return _fd >= 0;
+#else
+		_fd = 0;
+		return true;
+#endif
+	}
+	void close() {
+#ifdef __linux__
+		if(_fd >= 0)
+			::close(_fd);
+#endif
+		_fd = -1;
+		_fds.clear();
+	}
+
+	bool add(SOCKET id, unsigned int events = In) {
+#ifdef __linux__
+		epoll_event ev = {0};
+		ev.events	= _toNative(events);
+		ev.data.fd	= (int)id;
+		return epoll_ctl(_fd, EPOLL_CTL_ADD, (int)id, &ev) == 0;
+#else
+		pollfd fd = {0};
+		fd.fd 		= id;
+		fd.events 	= (short)_toNative(events);
+		_fds.push_back(fd);
+		return true;
+#endif
+	}
+	bool modify(SOCKET id, unsigned int events) {
+#ifdef __linux__
+		epoll_event ev = {0};
+		ev.events	= _toNative(events);
+		ev.data.fd	= (int)id;
+		return epoll_ctl(_fd, EPOLL_CTL_MOD, (int)id, &ev) == 0;
+#else
+		for(pollfd& fd : _fds) {
+			if(fd.fd == id) {
+				fd.events = (short)_toNative(events);
+				return true;
+			}
+		}
+		return false;
+#endif
+	}
+	bool remove(SOCKET id) {
+#ifdef __linux__
+		epoll_event ev = {0};
+		return epoll_ctl(_fd, EPOLL_CTL_DEL, (int)id, &ev) == 0;
+#else
+		auto itFd = std::remove_if(_fds.begin(), _fds.end(), [=](const pollfd& fd) {
+			return fd.fd == id;
+		});
+		bool found = itFd != _fds.end();
+		_fds.erase(itFd, _fds.end());
+		return found;
+#endif
+	}
+
+	// Fill 'ready' with the sockets having events. Return -1 on error, 0 on timeout.
+	int wait(std::vector<Ready>& ready, int timeoutMs) {
+		ready.clear();
+
+#ifdef __linux__
+		epoll_event events[MAX_EVENTS];
+
+		int nEvents = epoll_wait(_fd, events, MAX_EVENTS, timeoutMs);
+		if(nEvents < 0)
+			return (errno == EINTR) ? 0 : -1;
+
+		for(int i = 0; i < nEvents; i++)
+			ready.push_back(Ready{ (SOCKET)events[i].data.fd, _fromNative(events[i].events) });
+#else
+		if(_fds.empty()) {
+			Timer::wait(timeoutMs);
+			return 0;
+		}
+
+		int nEvents = wlc::polling(_fds.data(), (unsigned long)_fds.size(), timeoutMs);
+		if(nEvents <= 0)
+			return nEvents;
+
+		for(pollfd& fd : _fds) {
+			if(fd.revents != 0)
+				ready.push_back(Ready{ fd.fd, _fromNative(fd.revents) });
+			fd.revents = 0;
+		}
+#endif
+
+		return (int)ready.size();
+	}
+
+private:
+	// Methods
+	static unsigned int _toNative(unsigned int events) {
+		unsigned int native = 0;
+#ifdef __linux__
+		if(events & In)		native |= EPOLLIN;
+		if(events & Out)	native |= EPOLLOUT;
+#else
+		if(events & In)		native |= POLLIN;
+		if(events & Out)	native |= POLLOUT;
+#endif
+		return native;
+	}
+	static unsigned int _fromNative(unsigned int native) {
+		unsigned int events = 0;
+#ifdef __linux__
+		if(native & EPOLLIN) 				events |= In;
+		if(native & EPOLLOUT) 				events |= Out;
+		if(native & (EPOLLERR | EPOLLHUP)) 	events |= Closed;
+#else
+		if(native & POLLIN) 				events |= In;
+		if(native & POLLOUT) 				events |= Out;
+		if(native & (POLLERR | POLLHUP)) 	events |= Closed;
+#endif
+		return events;
+	}
+
+	// Members
+	static const int MAX_EVENTS = 64;
+
+	int _fd;
+	std::vector<pollfd> _fds;
+};
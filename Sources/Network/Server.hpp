@@ -4,18 +4,22 @@
 #include <memory>
 #include <string>
 #include <thread>
-#include <future>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <deque>
 #include <vector>
+#include <unordered_map>
 #include <algorithm>
 #include <functional>
 
 #include "WinLinConversion.hpp"
 #include "SocketTool.hpp"
+#include "Poller.hpp"
+#include "TokenBucket.hpp"
 #include "Message.hpp"
 #include "../Tool/Timer.hpp"
+#include "../Tool/Executor.hpp"
 
 class Server {
 	// -------------- Nested struct --------------
@@ -27,123 +31,405 @@ public:
 		SOCKET udpSockServerId; 	// <-- Server
 		Socket tcpSock;				// <-- Client
 		SocketAddress udpAddress; // <-- Client
+		int udpMtu = -1;			// Path MTU toward udpAddress, -1 if unknown
+		unsigned int headerVersion = 1; // Of the datagrams sent, 2 if the client asked for it
+		bool multicast = false;		// Receives broadcastData() from the group
 		
 		SOCKET id() const {
 			return tcpSock.get();
 		}
 	};
 	
-private:
-	class ConnectedClient {
-	public:
-		ConnectedClient(ClientInfo clientInfo) : info(clientInfo) {
-			
-		}
-		ConnectedClient(const ConnectedClient& cc) {
-			info = cc.info;
-		}
-		~ConnectedClient() {
-			killThread();
-		}
+	// Messages thrown away because a client can't follow
+	struct DropCounters {
+		uint64_t audio 		= 0;
+		uint64_t videoKey 	= 0; // Only with their whole GOP, when a newer key frame replaces it
+		uint64_t videoDelta = 0;
 		
-		void killThread() {
-			if(pThread) {
-				if(pThread->joinable()) {
-					pThread->join();
-				}
-				
-				pThread.reset();
-			}
-		}
-		void disconnect() {	
-			info.connected = false;
-			info.tcpSock.close();
+		DropCounters& operator+=(const DropCounters& counters) {
+			audio 		+= counters.audio;
+			videoKey 	+= counters.videoKey;
+			videoDelta 	+= counters.videoDelta;
+			return *this;
 		}
-		
-		ClientInfo info;
-		std::shared_ptr<std::thread> pThread;
+	};
+	
+private:
+	enum Priority {
+		Control, 	// Tcp and everything not media: never dropped
+		Audio,
+		VideoKey,
+		VideoDelta
 	};
 	
 	class SendingContainer {
 	public:
 		// -- Constructors
 		// Socket connected
-		SendingContainer(const Socket& emitter, const Message& msg) :
+		SendingContainer(const Socket& emitter, const std::shared_ptr<const Message>& pMsg) :
 			_proto(Proto_Tcp),
-			_msg(msg),
+			_pMsg(pMsg),
 			_emitter(emitter)
 		{	}
 		
 		// Socket not connected
-		SendingContainer(const Socket& emitter, const SocketAddress& address, const Message& msg) :
+		SendingContainer(const Socket& emitter, const SocketAddress& address, const std::shared_ptr<const Message>& pMsg, const Packetization& packetization = Packetization()) :
 			_proto(Proto_Udp),
-			_msg(msg),
+			_pMsg(pMsg),
 			_emitter(emitter),
-			_address(address)
+			_address(address),
+			_packetization(packetization)
 		{	}
 		
+		// Fragments of a frame already sent
+		SendingContainer(const SendingContainer& sent, const std::vector<uint16_t>& fragments) : 
+			SendingContainer(sent)
+		{
+			_fragments = fragments;
+		}
+		// Fragments of a frame sent to a group, for one of its receivers
+		SendingContainer(const SendingContainer& sent, const std::vector<uint16_t>& fragments, const SocketAddress& address) : 
+			SendingContainer(sent, fragments)
+		{
+			_address = address;
+		}
+		
 		// -- Methods
+		// Tcp : never waits, what the socket can't take now is sent by the next call (see finished())
 		bool send() {
 			switch(_proto) {
 			case Proto_Tcp:
-				return _emitter.send(_msg);
+				return _emitter.sendSome(*_pMsg, _streamSent);
 			case Proto_Udp:
-				return _emitter.sendTo(_msg, _address);
+				return _emitter.sendTo(*_pMsg, _address, _packetization);
 			}
 			return false;
 		}
+		// Udp : only add to the batch, which is sent later. The container must live until then.
+		bool send(DatagramBatch& batch, StreamSequences& sequences) {
+			if(_proto != Proto_Udp)
+				return send();
+			
+			if(_fragments.empty())
+				_frameId = batch.add(*_pMsg, _address, _packetization, &sequences);
+			else
+				batch.addFragments(*_pMsg, _address, _packetization, _frameId, _fragments, &sequences);
+			return true;
+		}
+		
+		// -- Getters
+		const Socket& emitter() const {
+			return _emitter;
+		}
+		unsigned int length() const {
+			return _pMsg->length();
+		}
+		unsigned int maxDatagram() const {
+			return _packetization.maxDatagram;
+		}
+		uint32_t frameId() const { // Once sent, if fragmented
+			return _frameId;
+		}
+		bool retransmission() const {
+			return !_fragments.empty();
+		}
+		bool stream() const {
+			return _proto == Proto_Tcp;
+		}
+		// Tcp : the whole message is in the socket
+		bool finished() const {
+			return _streamSent == 14 + (size_t)MessageView(*_pMsg).size;
+		}
+		Priority priority() const {
+			if(_proto == Proto_Tcp || retransmission())
+				return Control;
+			
+			const unsigned int code = _pMsg->code();
+			if(code & (Message::FORMAT | Message::PROPERTIES | Message::HANDSHAKE))
+				return Control;
+			if(code & Message::SOUND)
+				return Audio;
+			if(code & (Message::VIDEO | Message::DEVICE))
+				return (code & Message::KEY_FRAME) ? VideoKey : VideoDelta;
+			
+			return Control;
+		}
 		
 	private:
 		// -- Members
 		ProtoType _proto;
-		Message _msg;
-		const Socket& _emitter;
+		std::shared_ptr<const Message> _pMsg; // Shared between all the receivers
+		Socket _emitter;
 		SocketAddress _address;
+		Packetization _packetization;
+		uint32_t _frameId = 0;
+		std::vector<uint16_t> _fragments; // Retransmission only
+		size_t _streamSent = 0; // Tcp only, taken by the socket
+	};
+	typedef std::deque<SendingContainer, PoolAllocator<SendingContainer>> SendingQueue; // Nodes taken from the message pool
+	
+	
+	// Messages waiting for one client. Scheduled on a send worker when not empty.
+	// Under pressure, media is dropped by dependency: a delta frame never outlives the frames it needs.
+	class ClientQueue {
+	public:
+		explicit ClientQueue(size_t worker) : iWorker(worker), scheduled(false), _gopBroken(false) {
+			
+		}
+		
+		// Not thread safe: lock mut
+		void push(const SendingContainer& container) {
+			switch(container.priority()) {
+			case Control:
+				_control.push_back(container);
+				break;
+				
+			case Audio:
+				// Only the most recent sound is worth playing
+				if(_audio.size() >= MAX_AUDIO) {
+					_audio.pop_front();
+					drops.audio++;
+				}
+				_audio.push_back(container);
+				break;
+				
+			case VideoKey:
+				// Everything queued before can't be used anymore by a late client: restart from this frame
+				if(_video.size() >= MAX_VIDEO) {
+					for(const SendingContainer& video : _video) {
+						if(video.priority() == VideoKey)
+							drops.videoKey++;
+						else
+							drops.videoDelta++;
+					}
+					_video.clear();
+				}
+				_video.push_back(container);
+				_gopBroken = false;
+				break;
+				
+			case VideoDelta:
+				// Missing the previous delta: useless until the next key frame
+				if(_gopBroken || _video.size() >= MAX_VIDEO) {
+					_gopBroken = true;
+					drops.videoDelta++;
+					break;
+				}
+				_video.push_back(container);
+				break;
+			}
+		}
+		
+		// Not thread safe: lock mut. Move everything to 'sending' by priority.
+		void popAll(SendingQueue& sending) {
+			for(SendingQueue* pQueue : { &_control, &_audio, &_video }) {
+				std::move(pQueue->begin(), pQueue->end(), std::back_inserter(sending));
+				pQueue->clear();
+			}
+		}
+		// Not thread safe: lock mut. Only the control messages, the media stays.
+		void popControl(SendingQueue& sending) {
+			std::move(_control.begin(), _control.end(), std::back_inserter(sending));
+			_control.clear();
+		}
+		// Not thread safe: lock mut. Tcp messages the socket could not take yet: first of the next round, in their order.
+		void delay(const SendingQueue& messages) {
+			if(!closed)
+				_control.insert(_control.begin(), messages.begin(), messages.end());
+		}
+		bool empty() const {
+			return _control.empty() && _audio.empty() && _video.empty();
+		}
+		// Not thread safe: lock mut. Nothing will be sent anymore.
+		void close() {
+			closed = true;
+			_control.clear();
+			_audio.clear();
+			_video.clear();
+			sent.clear();
+		}
+		
+		// Members
+		const size_t iWorker;
+		
+		std::mutex mut;
+		bool scheduled; // Owned by its worker (ready or active list)
+		bool closed = false;
+		DropCounters drops;
+		SendingQueue sent; // Last fragmented frames, to retransmit
+		StreamSequences sequences; // Of the v2 headers, only used by the worker
+		
+		// Pacing, only used by the worker
+		struct Pacing {
+			TokenBucket bucket;
+			DatagramBatch batch; 						// Datagrams waiting for tokens
+			SendingQueue messages; 	// Keep the payloads of the batch alive
+			int64_t lastFrameMus 		= -1;
+			double frameIntervalMus 	= 0.0;
+		} pacing;
+		
+	private:
+		static const size_t MAX_AUDIO = 30;
+		static const size_t MAX_VIDEO = 30;
+		
+		bool _gopBroken;
+		SendingQueue _control;
+		SendingQueue _audio;
+		SendingQueue _video; // Keep the decoding order
+	};
+	
+	// Thread sending the messages of a shard of the clients
+	class SendWorker {
+	public:
+		std::mutex mut;
+		std::condition_variable cv;
+		std::vector<std::shared_ptr<ClientQueue>> ready;
+		bool woken = false; // Control message for an active client
+		std::shared_ptr<std::thread> pThread;
+	};
+	
+	// A change is a new copy in a new table: the queue, the stream and the last update are shared between copies
+	class ConnectedClient {
+	public:
+		ConnectedClient(ClientInfo clientInfo, size_t iWorker) :
+			info(clientInfo),
+			subscribed(false),
+			pQueue(std::make_shared<ClientQueue>(iWorker)),
+			pTcpStream(std::make_shared<MessageStream>()),
+			pLastUpdate(std::make_shared<std::atomic<clock_t>>(clientInfo.lastUpdate))
+		{
+		
+		}
+		
+		void disconnect() {
+			info.connected = false;
+			info.tcpSock.close();
+		}
+		
+		ClientInfo current() const {
+			ClientInfo clientInfo = info;
+			clientInfo.lastUpdate = *pLastUpdate;
+			return clientInfo;
+		}
+		
+		ClientInfo info;
+		bool subscribed; // Receive broadcasted data
+		std::shared_ptr<ClientQueue> pQueue;
+		std::shared_ptr<MessageStream> pTcpStream; // Only used by the event loop
+		std::shared_ptr<std::atomic<clock_t>> pLastUpdate;
 	};
 	
+	// Clients indexed by tcp socket and udp address (host and port).
+	// Never modified once published: readers use a table without lock, writers publish a modified copy.
+	class ClientTable {
+	public:
+		typedef std::shared_ptr<const ConnectedClient> ClientPtr;
+		
+		// Methods
+		void insert(const ClientPtr& pClient) {
+			const SOCKET id = pClient->info.id();
+			
+			ClientPtr& pIndexed = _byId[id];
+			if(pIndexed)
+				std::replace(_list.begin(), _list.end(), pIndexed, pClient);
+			else
+				_list.push_back(pClient);
+			pIndexed = pClient;
+			
+			if(pClient->info.connected)
+				_byAddress[pClient->info.udpAddress] = pClient;
+		}
+		void erase(const SOCKET id) {
+			std::unordered_map<SOCKET, ClientPtr>::iterator itClient = _byId.find(id);
+			if(itClient == _byId.end())
+				return;
+			
+			if(itClient->second->info.connected)
+				_byAddress.erase(itClient->second->info.udpAddress);
+			
+			_list.erase(std::remove(_list.begin(), _list.end(), itClient->second), _list.end());
+			_byId.erase(itClient);
+		}
+		
+		// Getters
+		ClientPtr find(const SOCKET id) const {
+			std::unordered_map<SOCKET, ClientPtr>::const_iterator itClient = _byId.find(id);
+			return itClient != _byId.end() ? itClient->second : nullptr;
+		}
+		ClientPtr find(const SocketAddress& udpAddress) const {
+			std::unordered_map<SocketAddress, ClientPtr, SocketAddress::Hash, SocketAddress::Equal>::const_iterator itClient = _byAddress.find(udpAddress);
+			return itClient != _byAddress.end() ? itClient->second : nullptr;
+		}
+		const std::vector<ClientPtr>& all() const {
+			return _list;
+		}
+	
+	private:
+		// Members
+		std::vector<ClientPtr> _list;
+		std::unordered_map<SOCKET, ClientPtr> _byId;
+		std::unordered_map<SocketAddress, ClientPtr, SocketAddress::Hash, SocketAddress::Equal> _byAddress; // Once the udp handshake is done
+	};
+
 	
 	// -------------- Main class --------------
 public:
-	Server() : _isConnected(false) { 
+	Server() : _isConnected(false), _mtu(0), _pacing(0.0), _parityGroup(0), _groupHops(1), _udpReceiver(32, 2048), _nSendWorkers(1), _ioBackend(Io_Poll), _pClients(std::make_shared<const ClientTable>()) { 
+		// Bursts of fragments for many clients, small replies not delayed
+		_udpOptions.sendBuffer 	= UDP_BUFFER_SIZE;
+		_tcpOptions.noDelay 	= true;
+		
 		// Wait for connectAt()
 	}
 	~Server() {
 		disconnect();
+		_dispatcher.wait(); // Callbacks may still use this server
 	}
 	
 	// Methods
 	bool disconnect() {
 		_isConnected = false;
 		
-		// Server disconnecting .. Send something ?	
-		if(_pSend && _pSend->joinable())
-			_pSend->join();
+		// After the event loop has joined : no client will be accepted, and no clients will be deleted.
+		if(_pEventLoop && _pEventLoop->joinable())
+			_pEventLoop->join();
 		
-		if(_pRecvUdp4 && _pRecvUdp4->joinable())
-			_pRecvUdp4->join();
+		// Nothing is queued anymore: the senders still holding a client stop before the workers go
+		std::lock_guard<std::mutex> lockClients(_mutClients);
+		for(const ClientTable::ClientPtr& pClient : _clients()->all()) {
+			std::lock_guard<std::mutex> lockQueue(pClient->pQueue->mut);
+			_dropsDisconnected += pClient->pQueue->drops;
+			pClient->pQueue->close();
+		}
 		
-		if(_pRecvUdp6 && _pRecvUdp6->joinable())
-			_pRecvUdp6->join();
-
-		if(_pHandleTcp4 && _pHandleTcp4->joinable())
-			_pHandleTcp4->join();
+		const std::shared_ptr<const ConnectedClient> pGroup = _group();
+		if(pGroup) {
+			std::lock_guard<std::mutex> lockQueue(pGroup->pQueue->mut);
+			_dropsDisconnected += pGroup->pQueue->drops;
+			pGroup->pQueue->close();
+		}
 		
-		if(_pHandleTcp6 && _pHandleTcp6->joinable())
-			_pHandleTcp6->join();
+		for(auto& pWorker : _sendWorkers) {
+			pWorker->mut.lock();
+			pWorker->cv.notify_all();
+			pWorker->mut.unlock();
+			
+			if(pWorker->pThread && pWorker->pThread->joinable())
+				pWorker->pThread->join();
+		}
+		_sendWorkers.clear();
 
 		_udpSock4.close();
 		_udpSock6.close();
 		_tcpSock4.close();
 		_tcpSock6.close();
 		
-		// After tcp has joined : no client will be accepted, and no clients will be deleted.
-		// Therefore, just wait for the threads to finish and then delete it. (Avoid mutex deadlock)
-		for(auto& client : _clients) {
-			client.killThread();
-			client.disconnect();
-		}
-		_clients.clear();
-		
+		for(const ClientTable::ClientPtr& pClient : _clients()->all())
+			ConnectedClient(*pClient).disconnect();
+		_publish(std::make_shared<ClientTable>());
+		std::atomic_store(&_pGroup, std::shared_ptr<const ConnectedClient>());
+
+		_poller.close();
 		wlc::uninitSockets();
 		
 		return false;
@@ -183,41 +469,104 @@ public:
 		if(!_tcpSock6.bind(address_v6, Proto_Tcp))
 			return disconnect();	
 		
+		// Tuning: before listening, the tcp buffers set the window scale of the clients accepted
+		for(Socket* pSock : { &_udpSock4, &_udpSock6 })
+			pSock->setOptions(_udpOptions);
+		for(Socket* pSock : { &_tcpSock4, &_tcpSock6 })
+			pSock->setOptions(_tcpOptions);
+		
+		// Multicast: sent by the udp socket of the group's family
+		if(_groupAddress.created() && !_createGroup())
+			return disconnect();
+		
+		// Listen
+		if(listen(_tcpSock4.get(), SOMAXCONN) == SOCKET_ERROR || listen(_tcpSock6.get(), SOMAXCONN) == SOCKET_ERROR)
+			return disconnect();
+		
+		// Every socket is watched by the same event loop
+		if(!_poller.create())
+			return disconnect();
+		
+		for(const Socket* pSock : { &_udpSock4, &_udpSock6, &_tcpSock4, &_tcpSock6 }) {
+			if(!_poller.add(pSock->get(), Poller::In))
+				return disconnect();
+		}
+		
 		// Create threads
 		_isConnected = true;
 		
-		_pSend 		= std::make_shared<std::thread>(&Server::_sendLoop, this);
-		_pRecvUdp4 	= std::make_shared<std::thread>(&Server::_recvUdp, this, std::ref(_udpSock4));
-		_pRecvUdp6 	= std::make_shared<std::thread>(&Server::_recvUdp, this, std::ref(_udpSock6));
-		_pHandleTcp4 = std::make_shared<std::thread>(&Server::_handleTcp, this, std::ref(_tcpSock4));
-		_pHandleTcp6 = std::make_shared<std::thread>(&Server::_handleTcp, this, std::ref(_tcpSock6));
+		for(size_t i = 0; i < _nSendWorkers; i++) {
+			_sendWorkers.push_back(std::unique_ptr<SendWorker>(new SendWorker()));
+			_sendWorkers.back()->pThread = std::make_shared<std::thread>(&Server::_sendLoop, this, std::ref(*_sendWorkers.back()));
+		}
+		_pEventLoop = std::make_shared<std::thread>(&Server::_eventLoop, this);
 		
 		return true;
 	}
 	
 	// Send message with UDP
 	void sendData(const ClientInfo& client, const Message& msg) {
+		ClientTable::ClientPtr pClient = _clients()->find(client.id());
+		if(!pClient)
+			return;
+		
 		const Socket& udpSock = client.udpSockServerId == _udpSock4.get() ? _udpSock4 : _udpSock6;
-		SendingContainer s(udpSock, client.udpAddress, msg);
+		_pushSend(*pClient, SendingContainer(udpSock, pClient->info.udpAddress, Message::shared(msg), _packetization(pClient->info)));
+	}
+	
+	// Send the same message with UDP to every subscribed client. The message is never copied.
+	// Once for all the clients in the multicast group.
+	void broadcastData(const std::shared_ptr<const Message>& pMsg) {
+		const std::shared_ptr<const ClientTable> pClients = _clients();
+		bool toGroup = false;
 		
-		_mutSendCtn.lock();
-		_pendingSend.push_back(s);
-		_pendingSendUpdated = true;
-		_mutSendCtn.unlock();
+		for(const ClientTable::ClientPtr& pClient : pClients->all()) {
+			const ConnectedClient& client = *pClient;
+			if(!client.info.connected || !client.subscribed)
+				continue;
+			
+			if(client.info.multicast) {
+				toGroup = true;
+				continue;
+			}
+			
+			const Socket& udpSock = client.info.udpSockServerId == _udpSock4.get() ? _udpSock4 : _udpSock6;
+			_pushSend(client, SendingContainer(udpSock, client.info.udpAddress, pMsg, _packetization(client.info)));
+		}
+		
+		const std::shared_ptr<const ConnectedClient> pGroup = _group();
+		if(toGroup && pGroup) {
+			const Socket& udpSock = pGroup->info.udpSockServerId == _udpSock4.get() ? _udpSock4 : _udpSock6;
+			_pushSend(*pGroup, SendingContainer(udpSock, pGroup->info.udpAddress, pMsg, _packetization(pGroup->info)));
+		}
+	}
+	void broadcastData(const unsigned int code, const char* buffer, const size_t len, const uint64_t time = 0) {
+		broadcastData(Message::shared(code, buffer, len, time));
 	}
 	
 	// Send message with TCP
 	void sendInfo(const ClientInfo& client, const Message& msg) {
-		std::vector<ConnectedClient>::const_iterator itClient = _findClientFromId(client.tcpSock.get());
-		if(itClient == _clients.end())
+		ClientTable::ClientPtr pClient = _clients()->find(client.id());
+		if(!pClient)
 			return;
 		
-		SendingContainer s(itClient->info.tcpSock, msg);
+		_pushSend(*pClient, SendingContainer(pClient->info.tcpSock, Message::shared(msg)));
+	}
+	
+	// Choose which clients receive broadcastData()
+	void subscribe(const ClientInfo& client, bool subscribed = true) {
+		std::lock_guard<std::mutex> lockClients(_mutClients);
+		
+		ClientTable::ClientPtr pClient = _clients()->find(client.id());
+		if(!pClient || pClient->subscribed == subscribed)
+			return;
+		
+		std::shared_ptr<ConnectedClient> pChanged = std::make_shared<ConnectedClient>(*pClient);
+		pChanged->subscribed = subscribed;
 		
-		_mutSendCtn.lock();
-		_pendingSend.push_back(s);
-		_pendingSendUpdated = true;
-		_mutSendCtn.unlock();
+		std::shared_ptr<ClientTable> pClients = std::make_shared<ClientTable>(*_clients());
+		pClients->insert(pChanged);
+		_publish(pClients);
 	}
 	
 	// Getters
@@ -227,17 +576,142 @@ public:
 	
 	std::vector<ClientInfo> getClients() const {
 		std::vector<ClientInfo> clients;
-	
-		_mutClients.lock();
-		for(const ConnectedClient& cc : _clients)
-			clients.push_back(cc.info);
 		
-		_mutClients.unlock();
+		const std::shared_ptr<const ClientTable> pClients = _clients();
+		for(const ClientTable::ClientPtr& pClient : pClients->all())
+			clients.push_back(pClient->current());
 		
 		return clients;
 	}
 	
+	DropCounters getDropCounters(const ClientInfo& client) const {
+		ClientTable::ClientPtr pClient = _clients()->find(client.id());
+		if(!pClient)
+			return DropCounters();
+		
+		DropCounters counters;
+		{
+			std::lock_guard<std::mutex> lockQueue(pClient->pQueue->mut);
+			counters = pClient->pQueue->drops;
+		}
+		
+		// Broadcasts are dropped for the whole group
+		const std::shared_ptr<const ConnectedClient> pGroup = _group();
+		if(pClient->info.multicast && pGroup) {
+			std::lock_guard<std::mutex> lockQueue(pGroup->pQueue->mut);
+			counters += pGroup->pQueue->drops;
+		}
+		
+		return counters;
+	}
+	// All the clients, disconnected ones included
+	DropCounters getDropCounters() const {
+		std::lock_guard<std::mutex> lockClients(_mutClients);
+		DropCounters counters = _dropsDisconnected;
+		
+		for(const ClientTable::ClientPtr& pClient : _clients()->all()) {
+			std::lock_guard<std::mutex> lockQueue(pClient->pQueue->mut);
+			counters += pClient->pQueue->drops;
+		}
+		
+		const std::shared_ptr<const ConnectedClient> pGroup = _group();
+		if(pGroup) {
+			std::lock_guard<std::mutex> lockQueue(pGroup->pQueue->mut);
+			counters += pGroup->pQueue->drops;
+		}
+		
+		return counters;
+	}
+	
+	// Datagrams dropped by the udp sockets of the server (queue full), when counted (SocketOptions::dropCounter)
+	uint64_t getSocketDrops() const {
+		return _udpReceiver.dropped();
+	}
+	
+	// Values used by the kernel for the ipv4 sockets of this protocol
+	SocketOptions getSocketOptions(const ProtoType proto) const {
+		return proto == Proto_Tcp ? _tcpSock4.options() : _udpSock4.options();
+	}
+	
+	// Datagrams sent with SocketOptions::sendTimestamps on the udp sockets:
+	// in the process, from the message created (or captured) to the kernel
+	PacketDelays getProcessDelays() const {
+		std::lock_guard<std::mutex> lockDelays(_mutDelays);
+		return _processDelays;
+	}
+	// in the kernel, from the send to the device
+	PacketDelays getKernelDelays() const {
+		std::lock_guard<std::mutex> lockDelays(_mutDelays);
+		return _kernelDelays;
+	}
+	
 	// Setters
+	// Send each frame over this fraction of the interval between frames, per client. 0 (default) to send at once.
+	void setPacing(double fraction) {
+		_pacing = fraction > 1.0 ? 1.0 : fraction;
+	}
+	
+	// Forward error correction: one parity datagram for 'groupSize' fragments, 0 for none.
+	// The client rebuilds up to one lost fragment in each group.
+	void setFec(unsigned int groupSize) {
+		_parityGroup = groupSize;
+	}
+	
+	// Force the MTU used to cut the UDP messages, 0 to use the path MTU discovered for each client
+	void setMtu(unsigned int mtu) {
+		_mtu = mtu;
+	}
+	
+	// Broadcast with IP multicast: each message is sent once to the group, the clients join it during the handshake.
+	// Clients which can't join still receive it by unicast. The group datagrams come back to this host too (loopback).
+	// 'interfaceIp' : address of the interface sending to the group, empty to let the system choose.
+	// 'hops' : routers crossed, 1 to stay on the LAN. Call before connectAt(), with an empty group to stop.
+	bool setMulticast(const std::string& groupIp, const int port, const std::string& interfaceIp = "", const int hops = 1) {
+		if(_isConnected)
+			return false;
+		
+		_groupAddress 	= SocketAddress();
+		_groupInterface = SocketAddress();
+		if(groupIp.empty())
+			return true;
+		
+		SocketAddress groupAddress;
+		if(!groupAddress.create(groupIp, port) || !groupAddress.isMulticast())
+			return false;
+		
+		SocketAddress groupInterface;
+		if(!interfaceIp.empty() && (!groupInterface.create(interfaceIp, port) || !groupInterface.ipDefined()))
+			return false;
+		
+		_groupAddress 	= groupAddress;
+		_groupInterface = groupInterface;
+		_groupHops 		= hops;
+		return true;
+	}
+	
+	// Number of threads sending messages, clients are shared between them. Call before connectAt().
+	void setSendThreads(size_t nThreads) {
+		if(!_isConnected && nThreads > 0)
+			_nSendWorkers = nThreads;
+	}
+	
+	// Tuning of the udp sockets, and of the tcp ones (clients accepted included). Call before connectAt().
+	// Best effort: check the values used with getSocketOptions().
+	void setSocketOptions(const SocketOptions& udpOptions, const SocketOptions& tcpOptions) {
+		if(_isConnected)
+			return;
+		
+		_udpOptions = udpOptions;
+		_tcpOptions = tcpOptions;
+	}
+	
+	// Io_Uring: each send thread gives the datagrams of all its clients to the kernel in one call per round.
+	// A thread without io_uring (kernel, permissions) keeps the poll path. Call before connectAt().
+	void setIoBackend(IoBackend backend) {
+		if(!_isConnected)
+			_ioBackend = backend;
+	}
+	
 	void onClientConnect(const std::function<void(const ClientInfo& client)>& cbkConnect) {
 		std::lock_guard<std::mutex> lockCbk(_mutCbk);
 		_cbkConnect = cbkConnect;
@@ -259,15 +733,41 @@ public:
 		_cbkError = cbkError;		
 	}
 	
+	// Where the callbacks run, Executor::shared() by default. The callbacks of a client keep their order.
+	void setExecutor(const std::shared_ptr<Executor>& pExecutor) {
+		_dispatcher.setExecutor(pExecutor);
+	}
+	
 	
 private:	
 	// Methods in threads
-	void _handleTcp(Socket& tcpSock) {		
-		// Listen
-		if(!_isConnected || listen(tcpSock.get(), SOMAXCONN) == SOCKET_ERROR)
-			return;
-
-		// Accept new clients
+	void _eventLoop() {
+		std::vector<Poller::Ready> ready;
+		const int TIMEOUT = 500; // 0.5 sec
+		
+		while(_isConnected) {
+			// Wait events on every socket
+			if(_poller.wait(ready, TIMEOUT) < 0) // failed
+				break;
+			
+			// Dispatch
+			for(const Poller::Ready& event : ready) {
+				if(event.id == _tcpSock4.get())
+					_acceptClients(_tcpSock4);
+				else if(event.id == _tcpSock6.get())
+					_acceptClients(_tcpSock6);
+				else if(event.id == _udpSock4.get())
+					_recvUdp(_udpSock4);
+				else if(event.id == _udpSock6.get())
+					_recvUdp(_udpSock6);
+				else
+					_recvTcp(event.id);
+			}
+		}
+	}
+	
+	// Methods called by the event loop
+	void _acceptClients(Socket& tcpSock) {
 		ClientInfo clientInfo;
 		
 		if(tcpSock.type() == Ip_v4)
@@ -275,254 +775,551 @@ private:
 		else if(tcpSock.type() == Ip_v6)
 			clientInfo.udpSockServerId = _udpSock6.get();
 		
-		// Loop accept() until the server is stopped
-		for(Timer timer; _isConnected; timer.wait(100)) {
-			// New client
-			if(tcpSock.accept(clientInfo.tcpSock)) {
-				// Update infos
-				clientInfo.lastUpdate = clock();
-				clientInfo.udpAddress.memset(0);
-				
-				std::lock_guard<std::mutex> lockCbk(_mutClients);		
-				_clients.push_back(ConnectedClient(clientInfo)); // Add to list
-				
-				ConnectedClient& client(_clients.back());																				// Need reference to the new client
-				sendInfo(client.info, Message(Message::HANDSHAKE, "udp?"));														// Ask for its udp address
-				client.pThread = std::make_shared<std::thread>(&Server::_clientTcp, this, std::ref(client.info)); 	// Start its thread
+		// Accept all pending connections at once
+		while(_isConnected && tcpSock.accept(clientInfo.tcpSock)) {
+			clientInfo.tcpSock.setOptions(_tcpOptions);
+			
+			// Update infos
+			clientInfo.lastUpdate = clock();
+			clientInfo.udpAddress.memset(0);
+			
+			if(!_poller.add(clientInfo.tcpSock.get(), Poller::In)) {
+				clientInfo.tcpSock.close();
+				continue;
 			}
-			else {
-				// Use this time to collect garbage
-				if(!_garbageItClients.empty()) {
-					std::lock_guard<std::mutex> lockCbk(_mutClients);
-					for(auto& it : _garbageItClients) 
-						_clients.erase(it);
-					
-					_garbageItClients.clear();
-				}
+			
+			std::shared_ptr<const ConnectedClient> pClient = std::make_shared<ConnectedClient>(clientInfo, (size_t)clientInfo.id() % _sendWorkers.size());
+			{
+				std::lock_guard<std::mutex> lockClients(_mutClients);
+				std::shared_ptr<ClientTable> pClients = std::make_shared<ClientTable>(*_clients()); // Add to list
+				pClients->insert(pClient);
+				_publish(pClients);
 			}
+			
+			// Ask for its udp address, the answer gives back the id to know which client it is.
+			// The id comes first, alone: older clients ignore it and answer a plain "udp?", they are found by their host.
+			_pushSend(*pClient, SendingContainer(clientInfo.tcpSock, Message::shared(Message::HANDSHAKE, "udp=" + std::to_string((uint64_t)clientInfo.id()))));
+			_pushSend(*pClient, SendingContainer(clientInfo.tcpSock, Message::shared(Message::HANDSHAKE, "udp?")));
+			
+			// Advertise the group of its family: the client answers once joined
+			if(_groupAddress.created() && _groupAddress.type() == tcpSock.type())
+				_pushSend(*pClient, SendingContainer(clientInfo.tcpSock, Message::shared(Message::HANDSHAKE, "group?" + _groupAddress.ip() + "," + std::to_string(_groupAddress.port()))));
 		}
 	}
 	
-	void _clientTcp(ClientInfo& client) {
-		// Loop Read 
-		const int BUFFER_SIZE = 2048;
-		char buf[BUFFER_SIZE] = {0};
+	void _recvTcp(const SOCKET clientId) {
+		// Find client
+		ClientTable::ClientPtr pClient = _clients()->find(clientId);
+		if(!pClient)
+			return;
+		
+		std::shared_ptr<MessageStream> pStream = pClient->pTcpStream;
+
+		// Read, after the bytes already received
+		size_t space = 0;
+		char* buf = pStream->reserve(space);
 		ssize_t recv_len = 0;
 		
-		// Init polling socket
-		const int TIMEOUT = 500; // 0.5 sec
-		pollfd fdRead 	= {0};
-		fdRead.fd 		= client.tcpSock.get();
-		fdRead.events 	= POLLIN;
-		
-		for(Timer timer; _isConnected; ) {
-			// Poll events
-			int pollResult = wlc::polling(&fdRead, 1, TIMEOUT);
-			if (pollResult < 0) 			// failed
-				break;
-			else if(pollResult == 0) {	// timeout
-				if(_isConnected)
-					continue;
-				else
-					break;
+		if((recv_len = recv(clientId, buf, (int)space, 0)) == SOCKET_ERROR) {
+			// What kind of error ?
+			int error = wlc::getError();
+			if(wlc::errorIs(wlc::WOULD_BLOCK, error)) // Temporarily unavailable
+				return;
+			
+			if(!wlc::errorIs(wlc::REFUSED_CONNECT, error)) { // Not forcibly closed
+				_dispatcher.post(clientId, _callback(_cbkError), Error(error, "TCP receive Error"));
 			}
-			if(!(fdRead.revents & POLLIN)) // unexpected
-				break;
+			
+			_closeClient(clientId);
+			return;
+		}
+		
+		// Stopped connection
+		if(recv_len == 0) {
+			_closeClient(clientId);
+			return;
+		}
+		pStream->commit((size_t)recv_len);
+		
+		if(_tcpOptions.quickAck) // Turned off by the kernel meanwhile
+			wlc::setOption(clientId, wlc::QUICK_ACK, 1);
+		
+		// Update client, maybe changed meanwhile
+		pClient = _clients()->find(clientId);
+		if(!pClient)
+			return;
+		
+		*pClient->pLastUpdate = clock();
+		const ClientInfo client = pClient->current();
+
+		// Read complete messages
+		Message message;
+		while(pStream->pop(message)) {
+			if(message.code() == Message::NACK) {
+				_retransmit(clientId, message);
+				continue;
+			}
+			if(message.code() == Message::HANDSHAKE) {
+				const std::string handshake = message.str();
 				
-			// Receive
-			memset(buf, 0, BUFFER_SIZE);
-			if((recv_len = recv(fdRead.fd, buf, BUFFER_SIZE, 0)) == SOCKET_ERROR) {
-				// What kind of error ?
-				int error = wlc::getError();
-				if(wlc::errorIs(wlc::WOULD_BLOCK, error)) { // Temporarily unavailable
-					timer.wait(100);
+				if(handshake == "v2") { // The client reads the v2 headers
+					_changeClient(clientId, [](ConnectedClient& changed) { changed.info.headerVersion = 2; });
 					continue;
 				}
-				else if(wlc::errorIs(wlc::REFUSED_CONNECT, error)) { // Forcibly close
-					break;
-				}
-				else {					
-					std::lock_guard<std::mutex> lockCbk(_mutCbk);
-					if(_cbkError) 
-						_futureError = std::async(std::launch::async, _cbkError, Error(error, "TCP receive Error"));
-					break;
+				if(handshake == "group.") { // The client joined the group: no more broadcast by unicast
+					_changeClient(clientId, [](ConnectedClient& changed) { changed.info.multicast = true; });
+					continue;
 				}
 			}
 			
-			// Stopped connection
-			if(recv_len == 0)
-				break;
+			_dispatcher.post(clientId, _callback(_cbkInfo), client, message);
+		}
+	}
+	
+	// Publish a modified copy of the client
+	template <typename F>
+	void _changeClient(const SOCKET clientId, const F& change) {
+		std::lock_guard<std::mutex> lockClients(_mutClients);
+		
+		ClientTable::ClientPtr pClient = _clients()->find(clientId);
+		if(!pClient)
+			return;
+		
+		std::shared_ptr<ConnectedClient> pChanged = std::make_shared<ConnectedClient>(*pClient);
+		change(*pChanged);
+		
+		std::shared_ptr<ClientTable> pClients = std::make_shared<ClientTable>(*_clients());
+		pClients->insert(pChanged);
+		_publish(pClients);
+	}
+	
+	void _closeClient(const SOCKET clientId) {
+		_poller.remove(clientId);
+		
+		ClientInfo client;
+		{
+			std::lock_guard<std::mutex> lockClients(_mutClients);
+			ClientTable::ClientPtr pClient = _clients()->find(clientId);
+			if(!pClient)
+				return;
 			
-			// Update client
-			_mutClients.lock();
-			client.lastUpdate = clock();
-			_mutClients.unlock();
+			client = pClient->current();
+			{
+				// A reader may still hold the client: nothing is queued anymore before its socket closes
+				std::lock_guard<std::mutex> lockQueue(pClient->pQueue->mut);
+				_dropsDisconnected += pClient->pQueue->drops;
+				pClient->pQueue->close();
+			}
+			ConnectedClient(*pClient).disconnect();
 			
-			// Read messages
-			if(recv_len < 14) // Bad message
-				continue;
+			std::shared_ptr<ClientTable> pClients = std::make_shared<ClientTable>(*_clients());
+			pClients->erase(clientId);
+			_publish(pClients);
+		}
+
+		_dispatcher.post(clientId, _callback(_cbkDisconnect), client);
+	}
+	
+	void _recvUdp(Socket& udpSock) {
+		// ----- Times of the datagrams sent: the kernel signals them as errors -----
+		if(SendTimestamps* pTimestamps = udpSock.sendTimestamps()) {
+			std::lock_guard<std::mutex> lockDelays(_mutDelays);
+			pTimestamps->collect(udpSock.get(), [this](const SendTimestamps::Send& send) {
+				_processDelays.add(send.processMus);
+				_kernelDelays.add(send.kernelDelayMus());
+			});
+		}
+		
+		// ----- Receive everything waiting -----
+		do {
+			clock_t time = clock();
+			if(_udpReceiver.receive(udpSock) == SOCKET_ERROR) {
+				// What kind of error ?
+				int error = wlc::getError();
+				if(wlc::errorIs(wlc::WOULD_BLOCK, error) || wlc::errorIs(wlc::NOT_CONNECT, error) || wlc::errorIs(wlc::REFUSED_CONNECT, error))
+					return;
+				
+				_dispatcher.post(0, _callback(_cbkError), Error(error, "UDP receive Error"));
+				return;
+			}
+			
+			for(const DatagramReceiver::Datagram& datagram : _udpReceiver.datagrams())
+				_readUdp(datagram.data, datagram.length, _udpReceiver.sender(datagram), time, datagram.kernelMus);
 			
-			for(const Message& message : MessageManager::readMessages(buf, recv_len)) {
-				std::lock_guard<std::mutex> lockCbk(_mutCbk);
-				if(_cbkInfo) 
-					_futureInfo = std::async(std::launch::async, _cbkInfo, client, message);
+		} while(_udpReceiver.full());
+	}
+	
+	void _readUdp(const char* buf, const size_t recv_len, const SocketAddress& clientSockAddress, const clock_t time, const uint64_t kernelMus) {
+		// ----- Read message -----
+		if(recv_len < 14) // Bad message
+			return;
+			
+		Message message(buf, recv_len);
+		message.setReceptionMus(kernelMus);
+
+		// Known udp address ?
+		ClientTable::ClientPtr pClient = _clients()->find(clientSockAddress);
+		bool handshake = false;
+		
+		if(!pClient) {
+			// First time
+			if(message.code() != Message::HANDSHAKE || message.str().compare(0, 4, "udp.") != 0)
+				return;
+			
+			pClient = _connectUdp(message.str().substr(4), clientSockAddress);
+			if(!pClient) { // Shakehand error
+				_dispatcher.post(0, _callback(_cbkError), Error(Error::BAD_CONNECTION, "Handshake Error"));
+				return;
 			}
+			
+			_pushSend(*pClient, SendingContainer(pClient->info.tcpSock, Message::shared(Message::HANDSHAKE, "ok.")));
+			handshake = true;
 		}
 		
-		// End
-		std::lock_guard<std::mutex> lockCbk(_mutCbk);
-		if(_cbkDisconnect) 
-			_futureDisconnect = std::async(std::launch::async, _cbkDisconnect, client);
+		*pClient->pLastUpdate = time;
+		const ClientInfo client = pClient->current();
+		
+		if(handshake)
+			_dispatcher.post(client.id(), _callback(_cbkConnect), client);
+		else // Read data message
+			_dispatcher.post(client.id(), _callback(_cbkData), client, message);
+	}
+	
+	// Udp handshake: the client sends back the id given by tcp. Without it, the first client of this host waiting for it.
+	ClientTable::ClientPtr _connectUdp(const std::string& idReceived, const SocketAddress& udpAddress) {
+		const int mtu = wlc::pathMtu(udpAddress.get(), udpAddress.size());
 		
 		std::lock_guard<std::mutex> lockClients(_mutClients);
-		std::vector<ConnectedClient>::iterator itClient = _findClientFromAddress(client.tcpSock.address());
+		const std::shared_ptr<const ClientTable> pClients = _clients();
 		
-		if(itClient != _clients.end()) {
-			itClient->disconnect();
-			_garbageItClients.push_back(itClient);
+		ClientTable::ClientPtr pClient;
+		if(!idReceived.empty()) {
+			char* end = nullptr;
+			const unsigned long long id = strtoull(idReceived.c_str(), &end, 10);
+			if(*end == '\0')
+				pClient = pClients->find((SOCKET)id);
+		}
+		else {
+			for(const ClientTable::ClientPtr& pPending : pClients->all()) {
+				if(!pPending->info.connected && SocketAddress::compareHost(pPending->info.tcpSock.address(), udpAddress)) {
+					pClient = pPending;
+					break;
+				}
+			}
 		}
+		
+		// Same host as the tcp connection, only once
+		if(!pClient || pClient->info.connected || !SocketAddress::compareHost(pClient->info.tcpSock.address(), udpAddress))
+			return nullptr;
+		
+		std::shared_ptr<ConnectedClient> pConnected = std::make_shared<ConnectedClient>(*pClient);
+		pConnected->info.connected 	= true;
+		pConnected->info.udpAddress = udpAddress;
+		pConnected->info.udpMtu 	= mtu;
+		
+		std::shared_ptr<ClientTable> pChanged = std::make_shared<ClientTable>(*pClients);
+		pChanged->insert(pConnected);
+		_publish(pChanged);
+		
+		return pConnected;
 	}
 	
-	void _recvUdp(Socket& udpSock) {
-		// Input
-		const int BUFFER_SIZE = 2048;
-		char buf[BUFFER_SIZE] = {0};
-		ssize_t recv_len = 0;
+	void _sendLoop(SendWorker& worker) {
+		const int64_t TIMEOUT = 500000; // 0.5 sec
+		const int64_t RETRY_MUS = 100;
+		const int64_t STREAM_RETRY_MUS = 1000; // Tcp socket full: a stalled client costs a call per ms
+		const unsigned int RING_ENTRIES = 256;
 		
-		SocketAddress clientSockAddress;
+		Timer clock;
+		std::vector<std::shared_ptr<ClientQueue>> active; // Clients with messages or paced datagrams
+		SendingQueue sending; 	// Keep the payloads of the round alive until they are sent
+		SendingQueue paced; 	// Same, for the paced batches finished
+		SendingQueue delayed; 	// Tcp messages of a client waiting for room in its socket
+		DatagramBatch batch4;
+		DatagramBatch batch6;
+		int64_t waitMus = TIMEOUT;
 		
-		// Init polling socket
-		const int TIMEOUT = 500; // 0.5 sec
-		pollfd fdRead 	= {0};
-		fdRead.fd 		= udpSock.get();
-		fdRead.events 	= POLLIN;
-
+		IoUring ring;
+		IoUring* pRing = _ioBackend == Io_Uring && ring.create(RING_ENTRIES) ? &ring : nullptr;
 		
-		for(Timer timer; _isConnected; ) {
-			// Poll events
-			int pollResult = wlc::polling(&fdRead, 1, TIMEOUT);
-			if (pollResult < 0) 			// failed
-				break;
-			else if(pollResult == 0) {	// timeout
-				if(_isConnected)
-					continue;
-				else
-					break;
+		while(_isConnected) {
+			// Wait for clients with messages, or tokens for the paced ones
+			{
+				std::unique_lock<std::mutex> lockWorker(worker.mut);
+				worker.cv.wait_for(lockWorker, std::chrono::microseconds(waitMus), [&]() {
+					return !worker.ready.empty() || worker.woken || !_isConnected;
+				});
+				
+				std::move(worker.ready.begin(), worker.ready.end(), std::back_inserter(active));
+				worker.ready.clear();
+				worker.woken = false;
 			}
-			if(!(fdRead.revents & POLLIN)) // unexpected
-				break;
 			
-			// ----- Receive -----
-			memset(buf, 0, BUFFER_SIZE);
+			const double pacing = _pacing;
+			waitMus = TIMEOUT;
 			
-			clock_t time = clock();
-			if(!udpSock.receiveFrom(recv_len, buf, BUFFER_SIZE, clientSockAddress)) {
-				// What kind of error ?
-				int error = wlc::getError();
-				if(wlc::errorIs(wlc::WOULD_BLOCK, error) || wlc::errorIs(wlc::NOT_CONNECT, error)) { // Timeout || Waiting for connection
-					timer.wait(100);
-					continue; 
-				}
-				else if(wlc::errorIs(wlc::REFUSED_CONNECT, error)) { // Forcibly close
-					break;
-				}
-				else {					
-					std::lock_guard<std::mutex> lockCbk(_mutCbk);
-					if(_cbkError) 
-						_futureError = std::async(std::launch::async, _cbkError, Error(error, "UDP receive Error"));
+			for(size_t i = 0; i < active.size(); ) {
+				ClientQueue& queue = *active[i];
+				
+				// Previous media first: the queue keeps the new one, and drops it if needed. Control messages never wait.
+				const size_t iFirst = sending.size();
+				const bool pacedDone = _sendPaced(queue, clock.clock_mus(), paced, pRing);
+				if(_takePending(queue, sending, pacedDone)) {
+					for(size_t iSending = iFirst; iSending < sending.size(); iSending++) {
+						SendingContainer& container = sending[iSending];
+						if(container.stream()) { // Tcp are sent now, as far as the socket takes them. Lost on error, with the connection.
+							if(delayed.empty() && (!container.send() || container.finished()))
+								continue;
+							delayed.push_back(container);
+						}
+						else if(container.priority() == Control || pacing <= 0.0) { // Udp datagrams of all the clients are batched by socket
+							container.send(container.emitter().get() == _udpSock4.get() ? batch4 : batch6, queue.sequences);
+							_keepSent(queue, container);
+						}
+						else 
+							_pace(queue, container, pacing, clock.clock_mus());
+					}
 					
-					timer.wait(100);
-					continue;
+					_sendPaced(queue, clock.clock_mus(), paced, pRing);
 				}
-			}
-			if(recv_len == 0) 
-				continue;
-			
-			// ----- Read message -----
-			if(recv_len < 14) // Bad message
-				continue;
 				
-			Message message(buf, recv_len);
-
-			// Update list
-			std::lock_guard<std::mutex> lockMut(_mutClients); // Free mutex when scope end
-			
-			std::vector<ConnectedClient>::iterator itClient = _findClientFromAddress(clientSockAddress);
-			if(itClient != _clients.end()) {
-				itClient->info.lastUpdate = time;
+				// Tcp socket full: the rest is tried again later, the other clients don't wait for it
+				const bool streamFull = !delayed.empty();
+				if(streamFull) {
+					std::lock_guard<std::mutex> lockQueue(queue.mut);
+					queue.delay(delayed);
+					delayed.clear();
+				}
 				
-				// First time ?
-				if(!itClient->info.connected) {
-					if(message.code() == Message::HANDSHAKE && message.str() == "udp.") {
-						itClient->info.connected = true;
-						itClient->info.udpAddress = clientSockAddress;
-						
-						sendInfo(itClient->info, Message(Message::HANDSHAKE, "ok."));	
-						
-						std::lock_guard<std::mutex> lockCbk(_mutCbk);
-						if(_cbkConnect) 
-							_futureConnect = std::async(std::launch::async, _cbkConnect, itClient->info);
-					}
-					else { // Shakehand error
-						std::lock_guard<std::mutex> lockCbk(_mutCbk);
-						if(_cbkError) 
-							_futureError = std::async(std::launch::async, _cbkError, Error(Error::BAD_CONNECTION, "Handshake Error"));
+				// Done with this client ?
+				if(queue.pacing.batch.empty()) {
+					std::lock_guard<std::mutex> lockQueue(queue.mut);
+					if(queue.empty()) {
+						queue.scheduled = false;
+						active[i] = active.back();
+						active.pop_back();
+						continue;
 					}
+					if(!streamFull)
+						waitMus = 0;
 				}
-				else { // Read data message
-					std::lock_guard<std::mutex> lockCbk(_mutCbk);
-					if(_cbkData) 
-						_futureData = std::async(std::launch::async, _cbkData, itClient->info, message);
-				}
-			}			
+				else 
+					waitMus = std::min(waitMus, std::max((int64_t)100, queue.pacing.bucket.waitMus(clock.clock_mus())));
+				if(streamFull)
+					waitMus = std::min(waitMus, STREAM_RETRY_MUS);
+				
+				i++;
+			}
 			
+			batch4.flush(_udpSock4, pRing);
+			batch6.flush(_udpSock6, pRing);
+			if(pRing)
+				pRing->submitSends();
+			
+			// Socket buffer full: the datagrams left, and their messages, wait for the next round
+			if(batch4.empty() && batch6.empty())
+				sending.clear();
+			else
+				waitMus = std::min(waitMus, RETRY_MUS);
+			paced.clear();
+		}
+		
+		// Release the messages
+		for(const std::shared_ptr<ClientQueue>& pQueue : active) {
+			pQueue->pacing.batch.clear();
+			pQueue->pacing.messages.clear();
 		}
 	}
 	
-	void _sendLoop() {
-		// FIFO
-		for(Timer timer; _isConnected; timer.waitMus(500)) {
-			if(!_pendingSendUpdated)
-				continue;
-			
-			std::lock_guard<std::mutex> lockCbk(_mutSendCtn);
-			if(_pendingSend.empty())
-				continue;
-			
-			// Send first and remove
-			_pendingSend.front().send();
-			_pendingSend.pop_front();
-			
-			// Limit
-			if(_pendingSend.size() > 30)
-				_pendingSend.clear();
-			
-			if(_pendingSend.empty())
-				_pendingSendUpdated = false;		
+	// Move the pending messages at the end of 'sending', only the control ones without 'media'. False if none.
+	bool _takePending(ClientQueue& queue, SendingQueue& sending, const bool media) {
+		const size_t nSending = sending.size();
+		
+		std::lock_guard<std::mutex> lockQueue(queue.mut);
+		if(media)
+			queue.popAll(sending);
+		else
+			queue.popControl(sending);
+		return sending.size() > nSending;
+	}
+	
+	// Add the datagrams of the message to the client's paced batch. 
+	// The rate spreads each frame over a fraction of the interval between frames.
+	void _pace(ClientQueue& queue, const SendingContainer& container, const double fraction, const int64_t nowMus) {
+		const double MIN_INTERVAL = 1000.0; 	// 1 ms
+		const double MAX_INTERVAL = 100000.0; 	// 100 ms: no more latency than 'fraction' of it
+		
+		ClientQueue::Pacing& pacing = queue.pacing;
+		
+		pacing.messages.push_back(container);
+		pacing.messages.back().send(pacing.batch, queue.sequences);
+		_keepSent(queue, pacing.messages.back());
+		
+		// Only frames (many datagrams) set the rate
+		if(container.length() <= container.maxDatagram())
+			return;
+		
+		if(pacing.lastFrameMus >= 0) {
+			double interval = std::min(MAX_INTERVAL, std::max(MIN_INTERVAL, (double)(nowMus - pacing.lastFrameMus)));
+			pacing.frameIntervalMus = pacing.frameIntervalMus > 0.0 ? 0.875 * pacing.frameIntervalMus + 0.125 * interval : interval;
+			pacing.bucket.setRate(1e6 * container.length() / (fraction * pacing.frameIntervalMus));
 		}
+		pacing.lastFrameMus = nowMus;
+	}
+	
+	// Remember the last fragmented frames: lost fragments can be asked again
+	void _keepSent(ClientQueue& queue, const SendingContainer& container) {
+		const size_t MAX_SENT = 16;
+		
+		if(container.frameId() == 0 || container.retransmission())
+			return;
+		
+		std::lock_guard<std::mutex> lockQueue(queue.mut);
+		queue.sent.push_back(container);
+		if(queue.sent.size() > MAX_SENT)
+			queue.sent.pop_front();
 	}
 	
-	// Search in the list. Not thread safe - Please use mutex before calling.
-	std::vector<ConnectedClient>::iterator _findClientFromAddress(const SocketAddress& address) {			
-		for(std::vector<ConnectedClient>::iterator itClient = _clients.begin(); itClient != _clients.end(); ++itClient) {
-			if(SocketAddress::compareHost(itClient->info.tcpSock.address(), address)) {
-				return itClient;
+	// Client asked some fragments again
+	void _retransmit(const SOCKET clientId, const Message& message) {
+		FragmentNack nack;
+		if(!nack.read(message.content(), message.size()))
+			return;
+		
+		ClientTable::ClientPtr pClient = _clients()->find(clientId);
+		if(!pClient)
+			return;
+		
+		std::shared_ptr<SendingContainer> pSent;
+		{
+			std::lock_guard<std::mutex> lockQueue(pClient->pQueue->mut);
+			for(const SendingContainer& sent : pClient->pQueue->sent) {
+				if(sent.frameId() == nack.frameId) {
+					pSent = std::make_shared<SendingContainer>(sent, nack.indexes());
+					break;
+				}
 			}
 		}
-				
-		return _clients.end(); // If not found
+		
+		// Sent to the group: only this client gets the fragments again
+		const std::shared_ptr<const ConnectedClient> pGroup = _group();
+		if(!pSent && pClient->info.multicast && pGroup) {
+			std::lock_guard<std::mutex> lockQueue(pGroup->pQueue->mut);
+			for(const SendingContainer& sent : pGroup->pQueue->sent) {
+				if(sent.frameId() == nack.frameId) {
+					pSent = std::make_shared<SendingContainer>(sent, nack.indexes(), pClient->info.udpAddress);
+					break;
+				}
+			}
+		}
+		
+		if(pSent)
+			_pushSend(*pClient, *pSent);
 	}
 	
-	std::vector<ConnectedClient>::const_iterator _findClientFromId(const SOCKET& socketId) const {			
-		for(std::vector<ConnectedClient>::const_iterator itClient = _clients.cbegin(); itClient != _clients.cend(); ++itClient) {
-			if(itClient->info.tcpSock.get() == socketId) {
-				return itClient;
-			}
+	// Send the datagrams allowed by the tokens. True when nothing is left: the messages go to 'done', until the end of the round.
+	bool _sendPaced(ClientQueue& queue, const int64_t nowMus, SendingQueue& done, IoUring* pRing) {
+		ClientQueue::Pacing& pacing = queue.pacing;
+		
+		const double available = pacing.bucket.available(nowMus);
+		if(!pacing.batch.empty() && available > 0.0) {
+			size_t sent = 0;
+			const Socket& emitter = pacing.messages.front().emitter();
+			pacing.batch.flush(emitter.get() == _udpSock4.get() ? _udpSock4 : _udpSock6, (size_t)available, sent, pRing);
+			pacing.bucket.consume(sent);
 		}
-				
-		return _clients.end(); // If not found
+		
+		if(!pacing.batch.empty())
+			return false;
+		
+		std::move(pacing.messages.begin(), pacing.messages.end(), std::back_inserter(done));
+		pacing.messages.clear();
+		return true;
+	}
+	
+	// Queue for the client and wake its worker. 
+	// The queue stays locked until the worker is told: disconnect() closes it before removing the workers.
+	void _pushSend(const ConnectedClient& client, const SendingContainer& container) {
+		ClientQueue& queue = *client.pQueue;
+		bool wake = false;
+		
+		std::lock_guard<std::mutex> lockQueue(queue.mut);
+		if(queue.closed || !_isConnected)
+			return;
+		
+		queue.push(container);
+		if(queue.scheduled) {
+			if(container.priority() != Control)
+				return;
+			
+			wake = true; // Maybe waiting for the tokens of its media
+		}
+		else
+			queue.scheduled = true;
+		
+		SendWorker& worker = *_sendWorkers[queue.iWorker];
+		std::lock_guard<std::mutex> lockWorker(worker.mut);
+		if(wake)
+			worker.woken = true;
+		else
+			worker.ready.push_back(client.pQueue);
+		worker.cv.notify_one();
 	}
 	
+	// Biggest datagram not fragmented by IP on the way to this client, and parity
+	Packetization _packetization(const ClientInfo& client) const {
+		Packetization packetization;
+		packetization.parityGroup 	= _parityGroup;
+		packetization.headerVersion = client.headerVersion;
+		
+		const int mtu = _mtu > 0 ? (int)_mtu : client.udpMtu;
+		if(mtu > 0) {
+			const int ipUdpHeaders = (client.udpAddress.type() == Ip_v6) ? 48 : 28;
+			packetization.maxDatagram = mtu > ipUdpHeaders ? (unsigned int)(mtu - ipUdpHeaders) : DatagramBatch::MIN_DATAGRAM;
+		}
+		
+		return packetization;
+	}
+	
+	// The group receives like one client, with its own queue. Always v2 headers: its clients asked for them.
+	bool _createGroup() {
+		const Socket& udpSock = _groupAddress.type() == Ip_v4 ? _udpSock4 : _udpSock6;
+		if(wlc::setMulticast(udpSock.get(), _groupInterface.created() ? _groupInterface.get() : nullptr, _groupHops, true) != 0)
+			return false;
+		
+		ClientInfo group;
+		group.connected 		= true;
+		group.udpSockServerId 	= udpSock.get();
+		group.udpAddress 		= _groupAddress;
+		group.headerVersion 	= 2;
+		
+		const int mtu 	= wlc::pathMtu(_groupAddress.get(), _groupAddress.size());
+		group.udpMtu 	= mtu > 0 ? mtu : (int)GROUP_MTU;
+		
+		std::atomic_store(&_pGroup, std::shared_ptr<const ConnectedClient>(std::make_shared<ConnectedClient>(group, 0)));
+		return true;
+	}
+	
+	// Copy of a callback, called out of the lock
+	template <typename F>
+	F _callback(const F& cbk) const {
+		std::lock_guard<std::mutex> lockCbk(_mutCbk);
+		return cbk;
+	}
+	
+	// Current clients, without lock
+	std::shared_ptr<const ClientTable> _clients() const {
+		return std::atomic_load(&_pClients);
+	}
+	// Replace the clients. Lock _mutClients: writers modify a copy of the last table.
+	void _publish(const std::shared_ptr<const ClientTable>& pClients) {
+		std::atomic_store(&_pClients, pClients);
+	}
+	// Multicast group, null if none
+	std::shared_ptr<const ConnectedClient> _group() const {
+		return std::atomic_load(&_pGroup);
+	}
+
 private:
 	// Members
 	std::atomic<bool> _isConnected;
@@ -540,27 +1337,41 @@ private:
 	std::function<void(const ClientInfo& client)> _cbkConnect;
 	std::function<void(const ClientInfo& client)> _cbkDisconnect;
 	
-	std::future<void> _futureError;
-	std::future<void> _futureInfo;
-	std::future<void> _futureData;
-	std::future<void> _futureConnect;
-	std::future<void> _futureDisconnect;
+	Dispatcher _dispatcher; // Ordered by client, 0 for the server itself
+	
+	// Udp packetization
+	std::atomic<unsigned int> _mtu;
+	std::atomic<double> _pacing;
+	std::atomic<unsigned int> _parityGroup;
+	
+	// Sockets
+	static const int UDP_BUFFER_SIZE = 4 * 1024 * 1024;
+	SocketOptions _udpOptions;
+	SocketOptions _tcpOptions;
+	
+	mutable std::mutex _mutDelays;
+	PacketDelays _processDelays; // Send timestamps
+	PacketDelays _kernelDelays;
+	
+	// Multicast
+	static const int GROUP_MTU = 1500; // Ethernet, when the route doesn't know it
+	SocketAddress _groupAddress; 	// Not created: unicast only
+	SocketAddress _groupInterface;
+	int _groupHops;
+	std::shared_ptr<const ConnectedClient> _pGroup; // Created by connectAt()
 	
 	// Threads
-	std::shared_ptr<std::thread> _pHandleTcp4;
-	std::shared_ptr<std::thread> _pHandleTcp6;
-	std::shared_ptr<std::thread> _pRecvUdp4;
-	std::shared_ptr<std::thread> _pRecvUdp6;
-	std::shared_ptr<std::thread> _pSend;
+	Poller _poller;
+	DatagramReceiver _udpReceiver;
+	std::shared_ptr<std::thread> _pEventLoop;
+	
+	size_t _nSendWorkers;
+	std::vector<std::unique_ptr<SendWorker>> _sendWorkers;
+	IoBackend _ioBackend;
 	
 	// Clients
-	mutable std::mutex _mutClients;
-	std::vector<ConnectedClient> _clients;
-	std::vector<std::vector<ConnectedClient>::iterator> _garbageItClients;
-	
-	// Messages sender
-	mutable std::mutex _mutSendCtn;
-	std::atomic<bool> _pendingSendUpdated;
-	std::deque<SendingContainer> _pendingSend;
+	mutable std::mutex _mutClients; // Writers only
+	std::shared_ptr<const ClientTable> _pClients;
+	DropCounters _dropsDisconnected;
 };
 
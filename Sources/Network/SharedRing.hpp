@@ -0,0 +1,342 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <new>
+
+#ifdef __linux__
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/syscall.h>
+	#include <linux/futex.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <ctime>
+#endif
+
+#include "../Tool/Timer.hpp"
+
+// ------------------- SharedRing : frames for the processes of this host -------------------
+// Fixed size slots in POSIX shared memory, written by one process, read by any number of others.
+// The writer never waits: a late reader jumps to the newest frame.
+// Each slot has a sequence (seqlock): a reader uses the frame in place, then checks it was not overwritten meanwhile.
+// Readers sleep on a futex of the shared header. Linux only, elsewhere create() and attach() fail.
+class SharedRing {
+public:
+	// View on a frame in its slot, until the writer comes back to it: check with valid()
+	struct Frame {
+		unsigned int code 	= 0;
+		const char* data 	= nullptr;
+		size_t length 		= 0;
+		uint64_t timestamp 	= 0; // ms
+		uint64_t captureMus = 0; // Timer::monotonicMus() of the writer
+		uint64_t index 		= 0;
+	};
+	
+	// Constructors
+	SharedRing() : _pMemory(nullptr), _size(0), _owner(false), _next(0), _dropped(0), _generation(0) {
+		// Wait for create() or attach()
+	}
+	~SharedRing() {
+		close();
+	}
+	
+	SharedRing(const SharedRing&) = delete;
+	SharedRing& operator=(const SharedRing&) = delete;
+	
+	// Methods
+	// [Writer] Name starting with '/', an old ring of this name is replaced. Readers need the token to attach.
+	bool create(const std::string& name, const uint64_t token, const size_t slots, const size_t slotSize) {
+#ifdef __linux__
+		if(opened() || slots == 0 || slotSize == 0 || slotSize > UINT32_MAX)
+			return false;
+		
+		const size_t size = _HEADER_SIZE + slots * _stride(slotSize);
+		
+		shm_unlink(name.c_str());
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if(fd < 0)
+			return false;
+		
+		void* pMemory = MAP_FAILED;
+		if(ftruncate(fd, (off_t)size) == 0)
+			pMemory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		
+		if(pMemory == MAP_FAILED) {
+			shm_unlink(name.c_str());
+			return false;
+		}
+		
+		_pMemory 	= (char*)pMemory;
+		_size 		= size;
+		_owner 		= true;
+		_name 		= name;
+		
+		// Zeroed by ftruncate: every slot is free (seq 0)
+		_Header* pHeader 	= new (_pMemory) _Header();
+		pHeader->token 		= token;
+		pHeader->slots 		= (uint32_t)slots;
+		pHeader->slotSize 	= (uint32_t)slotSize;
+		pHeader->magic.store(MAGIC, std::memory_order_release); // Last: the readers check it
+		
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	// [Reader] Attach to the ring created with this token, from its next frame
+	bool attach(const std::string& name, const uint64_t token) {
+#ifdef __linux__
+		if(opened())
+			return false;
+		
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if(fd < 0)
+			return false;
+		
+		struct stat status;
+		void* pMemory = MAP_FAILED;
+		if(fstat(fd, &status) == 0 && (size_t)status.st_size >= _HEADER_SIZE)
+			pMemory = mmap(nullptr, (size_t)status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		
+		if(pMemory == MAP_FAILED)
+			return false;
+		
+		_pMemory 	= (char*)pMemory;
+		_size 		= (size_t)status.st_size;
+		_owner 		= false;
+		_name 		= name;
+		
+		// Someone else's ring, or not complete
+		const _Header& header = _header();
+		if(header.magic.load(std::memory_order_acquire) != MAGIC || header.token != token || header.slots == 0 || _size < _HEADER_SIZE + header.slots * _stride(header.slotSize)) {
+			close();
+			return false;
+		}
+		
+		_next 		= header.written.load(std::memory_order_acquire);
+		_dropped 	= 0;
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	void close() {
+#ifdef __linux__
+		if(!opened())
+			return;
+		
+		munmap(_pMemory, _size);
+		if(_owner)
+			shm_unlink(_name.c_str());
+		
+		_pMemory 	= nullptr;
+		_size 		= 0;
+		_owner 		= false;
+#endif
+	}
+	
+	// [Writer] Copy the frame in the next slot, false if it is too big for a slot
+	bool publish(const unsigned int code, const char* data, const size_t length, const uint64_t timestamp, const uint64_t captureMus) {
+		if(!opened() || !_owner || length > _header().slotSize)
+			return false;
+		
+		_Header& header 	= _header();
+		const uint64_t index = header.written.load(std::memory_order_relaxed);
+		_Slot& slot 		= _slot(index);
+		
+		// Readers of this slot see it changing
+		slot.seq.store(2*index + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		
+		slot.code 		= code;
+		slot.length 	= (uint32_t)length;
+		slot.timestamp 	= timestamp;
+		slot.captureMus = captureMus;
+		if(length > 0)
+			memcpy(_payload(slot), data, length);
+		
+		slot.seq.store(2*index + 2, std::memory_order_release);
+		header.written.store(index + 1, std::memory_order_release);
+		
+		// Wake the readers
+		header.signal.fetch_add(1, std::memory_order_seq_cst);
+		if(header.sleepers.load(std::memory_order_seq_cst) > 0)
+			_futexWake(header.signal);
+		
+		return true;
+	}
+	
+	// [Reader] Next frame, sleeping until it comes. False after the timeout (< 0 : none) or a wake().
+	bool wait(Frame& frame, const int timeoutMs = -1) {
+		if(!opened())
+			return false;
+		
+		_Header& header 			= _header();
+		const uint64_t generation 	= _generation.load();
+		const uint64_t endMus 		= Timer::monotonicMus() + (uint64_t)(timeoutMs > 0 ? timeoutMs : 0) * 1000;
+		
+		for(;;) {
+			const uint32_t signal = header.signal.load(std::memory_order_seq_cst);
+			if(_read(frame))
+				return true;
+			
+			const uint64_t nowMus = Timer::monotonicMus();
+			if(_generation.load() != generation || (timeoutMs >= 0 && nowMus >= endMus))
+				return false;
+			
+			header.sleepers.fetch_add(1, std::memory_order_seq_cst);
+			_futexWait(header.signal, signal, timeoutMs < 0 ? -1 : (int64_t)(endMus - nowMus));
+			header.sleepers.fetch_sub(1, std::memory_order_seq_cst);
+		}
+	}
+	
+	// [Reader] The frame was not overwritten while it was used
+	bool valid(const Frame& frame) const {
+		if(!opened())
+			return false;
+		
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return _slot(frame.index).seq.load(std::memory_order_relaxed) == 2*frame.index + 2;
+	}
+	
+	// [Reader] Release the wait() of this process
+	void wake() {
+		_generation.fetch_add(1);
+		
+		if(opened()) {
+			_header().signal.fetch_add(1, std::memory_order_seq_cst);
+			_futexWake(_header().signal);
+		}
+	}
+	
+	// Getters
+	bool opened() const {
+		return _pMemory != nullptr;
+	}
+	const std::string& name() const {
+		return _name;
+	}
+	size_t slotSize() const {
+		return opened() ? _header().slotSize : 0;
+	}
+	// [Reader] Frames overwritten before being read
+	uint64_t dropped() const {
+		return _dropped;
+	}
+	
+	// Statics
+	static const uint64_t MAGIC = 0x50524f544f52494eULL; // "PROTORIN"
+
+private:
+	static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Shared between processes: the atomics must be lock free");
+	static const size_t CACHE_LINE = 64;
+	
+	struct _Header {
+		std::atomic<uint64_t> magic;
+		uint64_t token;
+		uint32_t slots;
+		uint32_t slotSize;
+		
+		alignas(CACHE_LINE) std::atomic<uint64_t> written; // Frames published
+		alignas(CACHE_LINE) std::atomic<uint32_t> signal; 	// Futex: changes with each frame
+		std::atomic<uint32_t> sleepers;
+	};
+	struct alignas(CACHE_LINE) _Slot {
+		std::atomic<uint64_t> seq; // 2*index + 1 while written, 2*index + 2 once readable
+		uint32_t code;
+		uint32_t length;
+		uint64_t timestamp;
+		uint64_t captureMus;
+		// Payload of slotSize bytes
+	};
+	static const size_t _HEADER_SIZE = (sizeof(_Header) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	
+	// Methods
+	// Next frame already there, in place
+	bool _read(Frame& frame) {
+		const _Header& header = _header();
+		
+		for(;;) {
+			const uint64_t written = header.written.load(std::memory_order_acquire);
+			if(_next >= written)
+				return false;
+			
+			// Too late: the newest one
+			if(written - _next > header.slots) {
+				_dropped += written - 1 - _next;
+				_next = written - 1;
+			}
+			
+			const _Slot& slot 	= _slot(_next);
+			const uint64_t seq 	= slot.seq.load(std::memory_order_acquire);
+			if(seq != 2*_next + 2) {
+				if(seq > 2*_next + 2) { // Overwritten meanwhile
+					_dropped++;
+					_next++;
+				}
+				continue;
+			}
+			
+			frame.code 			= slot.code;
+			frame.length 		= slot.length < header.slotSize ? slot.length : header.slotSize;
+			frame.timestamp 	= slot.timestamp;
+			frame.captureMus 	= slot.captureMus;
+			frame.data 			= _payload(slot);
+			frame.index 		= _next;
+			
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(slot.seq.load(std::memory_order_relaxed) != seq) // Fields maybe torn
+				continue;
+			
+			_next++;
+			return true;
+		}
+	}
+	
+	static size_t _stride(const size_t slotSize) {
+		return (sizeof(_Slot) + slotSize + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	}
+	_Header& _header() const {
+		return *reinterpret_cast<_Header*>(_pMemory);
+	}
+	_Slot& _slot(const uint64_t index) const {
+		const _Header& header = _header();
+		return *reinterpret_cast<_Slot*>(_pMemory + _HEADER_SIZE + (size_t)(index % header.slots) * _stride(header.slotSize));
+	}
+	static char* _payload(const _Slot& slot) {
+		return (char*)&slot + sizeof(_Slot);
+	}
+	
+	// Shared between processes: not FUTEX_PRIVATE
+	static void _futexWait(std::atomic<uint32_t>& word, const uint32_t expected, const int64_t timeoutMus) {
+#ifdef __linux__
+		timespec timeout;
+		timeout.tv_sec 	= (time_t)(timeoutMus / 1000000);
+		timeout.tv_nsec = (long)(timeoutMus % 1000000) * 1000;
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, timeoutMus < 0 ? nullptr : &timeout, nullptr, 0);
+#endif
+	}
+	static void _futexWake(std::atomic<uint32_t>& word) {
+#ifdef __linux__
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+	}
+	
+	// Members
+	char* _pMemory;
+	size_t _size;
+	bool _owner;
+	std::string _name;
+	
+	uint64_t _next; 	// Reader: index of the next frame
+	uint64_t _dropped;
+	std::atomic<uint64_t> _generation; // Changed by wake()
+};
@@ -2,7 +2,14 @@
 
 #include "WinLinConversion.hpp"
 #include "Message.hpp"
+#include "IoUring.hpp"
 
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -190,6 +197,40 @@ struct SocketAddress {
 		
 		return false;
 	}
+	// Host and port
+	static bool compare(const SocketAddress& addressA, const SocketAddress& addressB) {
+		return compareHost(addressA, addressB) && addressA._sockPort() == addressB._sockPort();
+	}
+	
+	// To index the addresses (host and port)
+	struct Hash {
+		size_t operator()(const SocketAddress& address) const {
+			// FNV-1a
+			const unsigned char* bytes = nullptr;
+			size_t len = 0;
+			
+			if(address._type == Ip_v4) {
+				bytes 	= reinterpret_cast<const unsigned char*>(&address._sockaddr4.sin_addr);
+				len 	= sizeof(address._sockaddr4.sin_addr);
+			}
+			else if(address._type == Ip_v6) {
+				bytes 	= reinterpret_cast<const unsigned char*>(&address._sockaddr6.sin6_addr);
+				len 	= sizeof(address._sockaddr6.sin6_addr);
+			}
+			
+			uint64_t hash = 14695981039346656037ULL;
+			for(size_t i = 0; i < len; i++)
+				hash = (hash ^ bytes[i]) * 1099511628211ULL;
+			hash = (hash ^ address._sockPort()) * 1099511628211ULL;
+			
+			return (size_t)hash;
+		}
+	};
+	struct Equal {
+		bool operator()(const SocketAddress& addressA, const SocketAddress& addressB) const {
+			return compare(addressA, addressB);
+		}
+	};
 	
 
 	// Getters
@@ -208,6 +249,19 @@ struct SocketAddress {
 	int port() const {
 		return _port;
 	}
+	const std::string& ip() const { // Given to create()
+		return _ip;
+	}
+	bool isMulticast() const {
+		if(!created())
+			return false;
+		else if(_type == Ip_v4)
+			return IN_MULTICAST(ntohl(_sockaddr4.sin_addr.s_addr));
+		else if(_type == Ip_v6)
+			return IN6_IS_ADDR_MULTICAST(&_sockaddr6.sin6_addr);
+		
+		return false;
+	}
 	const sockaddr * get() const {
 		 if(_type == Ip_error)
 			 return nullptr;
@@ -221,6 +275,16 @@ struct SocketAddress {
 
 private:
 	// Methods
+	// Port of the sockaddr, whoever filled it
+	unsigned short _sockPort() const {
+		if(_type == Ip_v4)
+			return ntohs(_sockaddr4.sin_port);
+		else if(_type == Ip_v6)
+			return ntohs(_sockaddr6.sin6_port);
+		
+		return 0;
+	}
+	
 	bool _create() {
 		// Already created
 		if(_sizeSockaddr > 0)
@@ -309,13 +373,388 @@ struct IAddress {
 };
 
 
+// ------------------------------ Batch ----------------------------
+struct Socket;
+
+// How a message is cut in datagrams
+struct Packetization {
+	unsigned int maxDatagram = 64000;	// Path MTU without IP and UDP headers avoids IP fragmentation
+	unsigned int parityGroup = 0; 		// FEC: one parity datagram for this many fragments, 0 for none
+	unsigned int headerVersion = 1;	// 2 : HeaderV2, when the receiver can read it
+	
+	unsigned int headerLength() const {
+		return headerVersion >= 2 ? HeaderV2::LENGTH : 14;
+	}
+};
+
+// Tuning of a socket, the defaults keep the values of the system
+struct SocketOptions {
+	int sendBuffer 		= 0; 		// Bytes, 0 : system default
+	int receiveBuffer 	= 0; 		// Bytes, room for the bursts of fragments
+	bool noDelay 		= false; 	// Tcp: small messages sent at once, without waiting to fill a segment (Nagle)
+	bool quickAck 		= false; 	// Tcp: each segment acknowledged at once (Linux)
+	int dscp 			= -1; 		// Class of the packets sent (34 : AF41 for video, 46 : EF), -1 : unchanged
+	int busyPollMus 	= 0; 		// Receptions poll the device queue before sleeping (Linux), 0 : never
+	bool dropCounter 	= false; 	// Udp: count the datagrams dropped by the socket (Linux)
+	bool receiveTimestamps 	= false; // Udp: time of the reception by the kernel, given with the messages (Linux)
+	bool sendTimestamps 	= false; // Udp: time each datagram left for the device, see SendTimestamps (Linux)
+};
+
+// Collect datagrams for many receivers, then send them with as few calls as possible.
+// Payloads are borrowed: they must live until flush(), or until the submitSends() of the ring given to flush().
+class DatagramBatch {
+public:
+	static const unsigned int MAX_DATAGRAM = 64000; // 64k is almost the limit (exactly it should be [65 535 - socketAddressSize] ~ 65 500 bytes)
+	static const unsigned int MIN_DATAGRAM = 548;	// Minimum IPv4 MTU (576) without IP and UDP headers
+	
+public:
+	DatagramBatch() : _segmentation(true), _firstEntry(0), _headerVersion(1), _pSequences(nullptr) {
+	}
+	
+	// Methods
+	// Add the message (cut in fragments if needed) for this receiver. Return the frame id of the fragments, 0 if not cut.
+	// 'pSequences' : sequences of the receiver, for v2 headers
+	uint32_t add(const MessageView& msg, const SocketAddress& receiverAddress, const Packetization& packetization = Packetization(), StreamSequences* pSequences = nullptr) {
+		_addresses.push_back(receiverAddress);
+		const size_t iAddress = _addresses.size() - 1;
+		_headerVersion 	= packetization.headerVersion;
+		_pSequences 	= pSequences;
+		
+		FragmentHeader fragment;
+		if(!_cut(msg, packetization, fragment)) {
+			_addDatagram(iAddress, msg, msg.code, msg.size, msg.payload, msg.size);
+			return 0;
+		}
+		fragment.frameId = _newFrameId();
+		
+		// - Parity: fragment i is in the group (i % parityCount), so a burst of losses hits different groups
+		if(fragment.parityCount > 0) {
+			_parities.push_back(std::vector<char>((size_t)fragment.parityCount * fragment.fragmentSize, 0));
+			FragmentHeader::xorParity(_parities.back().data(), msg.payload, fragment);
+		}
+		
+		for(; fragment.index < fragment.count; fragment.index++)
+			_addFragment(iAddress, msg, fragment);
+		
+		fragment.offset = 0;
+		for(unsigned int iParity = 0; iParity < fragment.parityCount; iParity++, fragment.index++)
+			_addDatagram(iAddress, msg, msg.code | Message::FRAGMENT, FragmentHeader::LENGTH + fragment.fragmentSize, _parities.back().data() + (size_t)iParity * fragment.fragmentSize, fragment.fragmentSize, &fragment);
+		
+		return fragment.frameId;
+	}
+	
+	// Add again some fragments of a message already sent (cut the same way) with this frame id
+	void addFragments(const MessageView& msg, const SocketAddress& receiverAddress, const Packetization& packetization, const uint32_t frameId, const std::vector<uint16_t>& indexes, StreamSequences* pSequences = nullptr) {
+		FragmentHeader fragment;
+		if(!_cut(msg, packetization, fragment))
+			return;
+		fragment.frameId = frameId;
+		
+		_addresses.push_back(receiverAddress);
+		const size_t iAddress = _addresses.size() - 1;
+		_headerVersion 	= packetization.headerVersion;
+		_pSequences 	= pSequences;
+		
+		for(uint16_t index : indexes) {
+			if(index >= fragment.count)
+				continue;
+			
+			fragment.index = index;
+			_addFragment(iAddress, msg, fragment);
+		}
+	}
+	
+	// Send everything added to the batch, then clear it.
+	// 'pRing' : only queued in the ring, sent by its submitSends() (the headers are copied, not the payloads).
+	bool flush(const Socket& emitter, IoUring* pRing = nullptr);
+	
+	// Send the next datagrams while they fit in 'maxBytes' (at least one), keep the others for the next call
+	bool flush(const Socket& emitter, const size_t maxBytes, size_t& sentBytes, IoUring* pRing = nullptr);
+	
+	// Both: false if some were not sent. Those refused by a full socket buffer, and the next ones, stay for the next call.
+	
+	void clear() {
+		_firstEntry = 0;
+		_headers.clear();
+		_buffers.clear();
+		_owned.clear();
+		_addresses.clear();
+		_entries.clear();
+		_datagrams.clear();
+		_datagramsEntry.clear();
+		_parities.clear();
+	}
+	
+	// Getters
+	bool empty() const {
+		return _firstEntry >= _entries.size();
+	}
+	
+private:
+	struct _Entry {
+		size_t iBuffer;
+		size_t nBuffers;
+		size_t iAddress;
+		unsigned int length;
+		bool fragment;
+		uint64_t captureMus;
+	};
+	
+	// Methods
+	// Fill the header common to the fragments of the message, false if it fits in one datagram
+	static bool _cut(const MessageView& msg, const Packetization& packetization, FragmentHeader& fragment) {
+		unsigned int maxDatagram = packetization.maxDatagram;
+		if(maxDatagram > MAX_DATAGRAM) 	maxDatagram = MAX_DATAGRAM;
+		if(maxDatagram < MIN_DATAGRAM) 	maxDatagram = MIN_DATAGRAM;
+		const unsigned int headerLength = packetization.headerLength();
+		if(headerLength + msg.size <= maxDatagram)
+			return false;
+		
+		// Fragments of the same size (but the last), each one knows its place in the frame
+		unsigned int fragmentSize = maxDatagram - headerLength - FragmentHeader::LENGTH;
+		if(msg.size / fragmentSize >= 0xFFFF / 2) // Too many fragments to be counted (parity included): bigger ones
+			fragmentSize = MAX_DATAGRAM - headerLength - FragmentHeader::LENGTH;
+		
+		fragment.count 			= (uint16_t)((msg.size + fragmentSize - 1) / fragmentSize);
+		fragment.sizeTotal 		= msg.size;
+		fragment.fragmentSize 	= (uint16_t)fragmentSize;
+		
+		if(packetization.parityGroup > 0 && fragment.count > 1)
+			fragment.parityCount = (uint16_t)((fragment.count + packetization.parityGroup - 1) / packetization.parityGroup);
+		
+		return true;
+	}
+	
+	void _addFragment(size_t iAddress, const MessageView& msg, FragmentHeader& fragment) {
+		fragment.offset = (uint32_t)fragment.index * fragment.fragmentSize;
+		unsigned int sizeToSend = std::min((unsigned int)fragment.fragmentSize, msg.size - fragment.offset);
+		_addDatagram(iAddress, msg, msg.code | Message::FRAGMENT, FragmentHeader::LENGTH + sizeToSend, msg.payload + fragment.offset, sizeToSend, &fragment);
+	}
+	
+	static uint32_t _newFrameId() {
+		static std::atomic<uint32_t> frameId(0);
+		return ++frameId;
+	}
+	
+	void _addDatagram(size_t iAddress, const MessageView& msg, unsigned int code, unsigned int size, const char* payload, size_t len, const FragmentHeader* pFragment = nullptr) {
+		const size_t messageHeaderLen 	= _headerVersion >= 2 ? HeaderV2::LENGTH : 14;
+		const size_t headerLen 			= pFragment ? messageHeaderLen + FragmentHeader::LENGTH : messageHeaderLen;
+		
+		_headers.push_back(std::array<char, HeaderV2::LENGTH + FragmentHeader::LENGTH>());
+		if(_headerVersion >= 2)
+			_headerV2(code, size, msg, pFragment).write(_headers.back().data());
+		else
+			Message::writeHeader(_headers.back().data(), code, size, msg.timestamp);
+		
+		if(pFragment)
+			pFragment->write(_headers.back().data() + messageHeaderLen);
+		
+		_entries.push_back(_Entry{ _buffers.size(), len > 0 ? (size_t)2 : (size_t)1, iAddress, (unsigned int)(headerLen + len), pFragment != nullptr, msg.captureMus });
+		
+		_buffers.push_back(wlc::makeBuffer(_headers.back().data(), headerLen));
+		_owned.push_back(1);
+		if(len > 0) {
+			_buffers.push_back(wlc::makeBuffer(payload, len));
+			_owned.push_back(pFragment && pFragment->parity() ? 1 : 0);
+		}
+	}
+	
+	HeaderV2 _headerV2(unsigned int code, unsigned int size, const MessageView& msg, const FragmentHeader* pFragment) {
+		HeaderV2 header;
+		header.code 		= code;
+		header.size 		= size;
+		header.stream 		= HeaderV2::streamOf(code);
+		header.sequence 	= _pSequences ? _pSequences->next[header.stream]++ : 0;
+		header.captureMus 	= msg.captureMus;
+		header.timestamp 	= msg.timestamp;
+		
+		if(code & Message::KEY_FRAME)
+			header.flags |= HeaderV2::KEY;
+		
+		if(pFragment) {
+			header.flags 			|= HeaderV2::FRAGMENTED;
+			header.fragmentIndex 	= pFragment->index;
+			header.fragmentCount 	= pFragment->count;
+			header.frameId 			= pFragment->frameId;
+			
+			if(pFragment->parity())
+				header.flags |= HeaderV2::PARITY;
+		}
+		return header;
+	}
+	
+	// Merge consecutive fragments for the same receiver when the kernel can segment them: 
+	// all of the same length but the last one.
+	void _group(size_t firstEntry, size_t endEntry, bool segment) {
+		const unsigned int MAX_SEGMENTS 	= 64;
+		const unsigned int MAX_SEGMENTED 	= 65000;
+		
+		_datagrams.clear();
+		_datagramsEntry.clear();
+		
+		for(size_t i = firstEntry; i < endEntry;) {
+			const _Entry& entry 			= _entries[i];
+			const SocketAddress& address 	= _addresses[entry.iAddress];
+			
+			wlc::Datagram datagram = { &_buffers[entry.iBuffer], entry.nBuffers, address.get(), address.size(), 0 };
+			_datagramsEntry.push_back(i);
+			
+			size_t j = i + 1;
+			if(segment && entry.fragment) {
+				unsigned int nSegments 	= 1;
+				unsigned int total 		= entry.length;
+				
+				for(; j < endEntry && nSegments < MAX_SEGMENTS; j++) {
+					const _Entry& next = _entries[j];
+					if(!next.fragment || next.iAddress != entry.iAddress || next.length > entry.length || total + next.length > MAX_SEGMENTED)
+						break;
+					
+					datagram.nBuffers += next.nBuffers;
+					total += next.length;
+					nSegments++;
+					
+					if(next.length < entry.length) { // Shorter segment is the last one
+						j++;
+						break;
+					}
+				}
+				
+				if(nSegments > 1)
+					datagram.segmentSize = entry.length;
+			}
+			
+			_datagrams.push_back(datagram);
+			i = j;
+		}
+	}
+	
+	bool _flush(const Socket& emitter, size_t endEntry, IoUring* pRing);
+	
+	// Members
+	bool _segmentation; // Turned off if the kernel refuses it once
+	size_t _firstEntry; // Entries before were already sent
+	
+	// Of the message being added
+	unsigned int _headerVersion;
+	StreamSequences* _pSequences;
+	
+	std::deque<std::array<char, HeaderV2::LENGTH + FragmentHeader::LENGTH>> _headers; // Deque: headers don't move when it grows
+	std::vector<iovec> _buffers;
+	std::vector<char> _owned; // Of each buffer: held by the batch, not borrowed
+	std::vector<SocketAddress> _addresses;
+	std::vector<_Entry> _entries;
+	std::deque<std::vector<char>> _parities; // Payloads of the parity datagrams
+	
+	std::vector<wlc::Datagram> _datagrams;
+	std::vector<size_t> _datagramsEntry;
+};
+
+
+// ------------------------------ Timestamps ----------------------------
+// Delays of many packets, in microseconds
+struct PacketDelays {
+	uint64_t count 	= 0;
+	double meanMus 	= 0.0;
+	uint64_t maxMus = 0;
+	
+	void add(const uint64_t delayMus) {
+		count++;
+		meanMus += ((double)delayMus - meanMus) / (double)count;
+		if(maxMus < delayMus)
+			maxMus = delayMus;
+	}
+};
+
+// The kernel numbers the datagrams sent by a socket (SocketOptions::sendTimestamps), then gives back the time each one left for the device.
+// The sends are numbered the same way: lock mutex() around the send, begin() just before it, and record() each datagram the kernel took.
+class SendTimestamps {
+public:
+	struct Send {
+		uint64_t processMus; 	// From the message created (or captured) to the kernel
+		uint64_t sendMus; 		// System clock: given to the kernel
+		uint64_t kernelMus; 	// System clock: left for the device
+		
+		uint64_t kernelDelayMus() const {
+			return kernelMus > sendMus ? kernelMus - sendMus : 0;
+		}
+	};
+	
+	SendTimestamps() : _nextId(0), _beginMus(0), _beginRealtimeMus(0) {
+	}
+	
+	// Methods
+	std::mutex& mutex() {
+		return _mut;
+	}
+	
+	// Lock mutex(): the datagrams are given to the kernel now
+	void begin() {
+		_beginMus 			= Timer::monotonicMus();
+		_beginRealtimeMus 	= Timer::realtimeMus();
+	}
+	
+	// Lock mutex(): the kernel took the next datagram, of a message with this steady clock capture time
+	void record(const uint64_t captureMus) {
+		const size_t MAX_PENDING = 4096; // Some are never sent (device queue full)
+		
+		_pending.push_back(_Pending{ _nextId++, _beginMus > captureMus ? _beginMus - captureMus : 0, _beginRealtimeMus });
+		if(_pending.size() > MAX_PENDING)
+			_pending.pop_front();
+	}
+	
+	// Read the times given back by the kernel for this socket, f(const Send&) for each datagram. Return their number.
+	template <typename F>
+	size_t collect(const SOCKET idSocket, const F& f) {
+		const size_t BATCH = 64;
+		
+		std::lock_guard<std::mutex> lock(_mut);
+		wlc::SendTimestamp timestamps[BATCH];
+		size_t count = 0;
+		
+		for(int nTimestamps = BATCH; nTimestamps == (int)BATCH; ) {
+			nTimestamps = wlc::receiveSendTimestamps(idSocket, timestamps, BATCH);
+			
+			for(int i = 0; i < nTimestamps; i++) {
+				// Almost always the oldest one
+				auto itPending = std::find_if(_pending.begin(), _pending.end(), [&](const _Pending& pending) {
+					return pending.id == timestamps[i].id;
+				});
+				if(itPending == _pending.end())
+					continue;
+				
+				f(Send{ itPending->processMus, itPending->sendMus, timestamps[i].kernelMus });
+				_pending.erase(itPending);
+				count++;
+			}
+		}
+		
+		return count;
+	}
+	
+private:
+	struct _Pending {
+		uint32_t id;
+		uint64_t processMus;
+		uint64_t sendMus;
+	};
+	
+	// Members
+	std::mutex _mut;
+	uint32_t _nextId;
+	std::deque<_Pending> _pending;
+	uint64_t _beginMus;
+	uint64_t _beginRealtimeMus;
+};
+
+
 // ------------------------------ Socket ----------------------------
 struct Socket {
 // Public:
 	Socket(SOCKET id = INVALID_SOCKET, ProtoType proto = Proto_error, SocketAddress add = SocketAddress()) :
 		_socket(id),
 		_protoType(proto),
-		_address(add)
+		_address(add),
+		_canSegment(false)
 	{
 
 	}
@@ -365,6 +804,15 @@ struct Socket {
 		if(!_createSocket(address, proto))
 			return false;
 		
+		// -- Options -- Before binding: a restarted server gets its tcp port back, despite the connections in TIME_WAIT.
+		// Not on udp, nor on Windows: another socket could take the same port.
+#ifndef _WIN32
+		if(proto == Proto_Tcp && wlc::setReusable(_socket, true) < 0) {
+			close();
+			return false;
+		}
+#endif
+		
 		// -- Bounding --
 		if(::bind(_socket, _address.get(), _address.size()) == SOCKET_ERROR) {
 			std::cout << wlc::getError() << std::endl;
@@ -372,8 +820,43 @@ struct Socket {
 			return false;
 		}
 		
-		// -- Options --
-		if(wlc::setNonBlocking(_socket, !blocking) < 0 || wlc::setReusable(_socket, true) < 0) {
+		if(wlc::setNonBlocking(_socket, !blocking) < 0) {
+			close();
+			return false;
+		}
+		
+		return true;
+	}
+	// Receive the datagrams sent to a group, on the interface having this address (not created: the system chooses).
+	// The port is shared: every socket of this host in the group receives them.
+	bool bindGroup(const SocketAddress& group, const SocketAddress& interfaceAddress = SocketAddress(), const bool blocking = false) {
+		if(initialized())
+			return true;
+		
+		// -- Creation --
+		if(!_createSocket(group, Proto_Udp))
+			return false;
+		
+		// -- Options -- Before binding, to share the port
+		if(wlc::setReusable(_socket, true) < 0) {
+			close();
+			return false;
+		}
+		
+		// -- Bounding -- Linux keeps only the datagrams of the group, Windows can't bind to a group address
+		SocketAddress local = group;
+#ifdef _WIN32
+		local = SocketAddress();
+		local.create(group.type(), group.port());
+#endif
+		
+		if(::bind(_socket, local.get(), local.size()) == SOCKET_ERROR) {
+			close();
+			return false;
+		}
+		
+		// -- Membership --
+		if(wlc::joinGroup(_socket, group.get(), interfaceAddress.created() ? interfaceAddress.get() : nullptr) != 0 || wlc::setNonBlocking(_socket, !blocking) < 0) {
 			close();
 			return false;
 		}
@@ -384,9 +867,9 @@ struct Socket {
 		if(_socket == INVALID_SOCKET || _protoType == Proto_error)
 			return false;
 		
-		sockaddr address;
-		socklen_t slen =  _address.size();
-		SOCKET socketId = ::accept(_socket, &address, &slen);
+		sockaddr_storage address; // Room for ipv6
+		socklen_t slen = sizeof(address);
+		SOCKET socketId = ::accept(_socket, (sockaddr*)&address, &slen);
 		
 		if(socketId == SOCKET_ERROR) {
 			if (!wlc::errorIs(wlc::WOULD_BLOCK, wlc::getError())) {
@@ -396,7 +879,7 @@ struct Socket {
 		}		
 		
 		// Create socket | address
-		socketAccepted = Socket(socketId, _protoType, SocketAddress(_address.type(), address, slen));
+		socketAccepted = Socket(socketId, _protoType, SocketAddress(_address.type(), *(sockaddr*)&address, slen));
 		wlc::setReusable(socketId, true);
 		wlc::setNonBlocking(socketId, true);
 
@@ -427,49 +910,114 @@ struct Socket {
 		
 		return false;
 	}
-	bool sendTo(const Message& msg, const SocketAddress& receiverAddress) const {
-		bool error = false;
-		const int bufferSize = (int)msg.length();
-		const char* buffer = msg.data();
+	// Header and payload are gathered by the kernel: the payload is never copied.
+	bool sendTo(const MessageView& msg, const SocketAddress& receiverAddress, const Packetization& packetization = Packetization()) const {
+		if(packetization.headerVersion < 2 && 14 + msg.size <= packetization.maxDatagram && 14 + msg.size <= DatagramBatch::MAX_DATAGRAM) {
+			// Send header + content, numbered in the kernel's order
+			std::unique_lock<std::mutex> lockTimestamps;
+			if(_pSendTimestamps) {
+				lockTimestamps = std::unique_lock<std::mutex>(_pSendTimestamps->mutex());
+				_pSendTimestamps->begin();
+			}
+			
+			iovec buffers[2] = { wlc::makeBuffer(msg.header, 14), wlc::makeBuffer(msg.payload, msg.size) };
+			int sent = wlc::sendBuffers(_socket, buffers, msg.size > 0 ? 2 : 1, receiverAddress.get(), receiverAddress.size());
+			if(sent != SOCKET_ERROR && _pSendTimestamps)
+				_pSendTimestamps->record(msg.captureMus);
+			
+			return sent == 14 + (int)msg.size;
+		}
 		
-		if(bufferSize < 64000) { // 64k is almost the limit (exactly it should be [65 535 - socketAddressSize] ~ 65 500 bytes)
-			// Send header + content
-			if(sendto(_socket, msg.data(), bufferSize, 0, receiverAddress.get(), receiverAddress.size()) != bufferSize)
-				return false;
+		// Fragments are sent together
+		DatagramBatch batch;
+		batch.add(msg, receiverAddress, packetization);
+		return batch.flush(*this);
+	}
+	bool send(const MessageView& msg) const {
+		const int TIMEOUT = 1000; // 1 sec without progress
+		
+		// Udp: numbered in the kernel's order
+		std::unique_lock<std::mutex> lockTimestamps;
+		if(_pSendTimestamps) {
+			lockTimestamps = std::unique_lock<std::mutex>(_pSendTimestamps->mutex());
+			_pSendTimestamps->begin();
 		}
-		else {		
-			unsigned int codeFrag	= msg.code() | Message::FRAGMENT;
-			uint64_t timestampMsg	= msg.timestamp();
-			
-			// - Create header
-			Message msgHeader(codeFrag | Message::HEADER, nullptr, msg.size(), timestampMsg);
-			if(sendto(_socket, msgHeader.data(), 14, 0, receiverAddress.get(), receiverAddress.size()) != 14)
+		
+		// The stream may take only a part of a big message: continue where it stopped
+		for(size_t sent = 0; ; ) {
+			const size_t before = sent;
+			if(!sendSome(msg, sent))
 				return false;
 			
-			// - Cut in messages fragment
-			int offset 					= 0;
-			int limitFragmentSize 	= 60000;
-			int totalLengthSend 		= (int)msg.size();
+			if(sent > before && _pSendTimestamps)
+				_pSendTimestamps->record(msg.captureMus);
+			if(sent == 14 + (size_t)msg.size)
+				return true;
 			
-			do {
-				int sizeToSend = totalLengthSend > limitFragmentSize ? limitFragmentSize : totalLengthSend;
-				
-				Message msgFrag(codeFrag, buffer+14+offset, (size_t)sizeToSend, timestampMsg);
-				
-				if(sendto(_socket, msgFrag.data(), 14+sizeToSend, 0, receiverAddress.get(), receiverAddress.size()) != 14+sizeToSend)
-					return false;
-				
-				offset += sizeToSend;
-				totalLengthSend -= sizeToSend;
-				limitFragmentSize--; // Avoid to get packets of the same size
-				
-			} while(totalLengthSend > 0);	
+			pollfd fdWrite 	= {0};
+			fdWrite.fd 		= _socket;
+			fdWrite.events 	= POLLOUT;
+			if(wlc::polling(&fdWrite, 1, TIMEOUT) <= 0)
+				return false;
+		}
+	}
+	// Never waits: what the socket takes now, after the 'sent' bytes already taken. Whole once 'sent' is 14 + msg.size.
+	// False on error only, a full socket is not one.
+	bool sendSome(const MessageView& msg, size_t& sent) const {
+		iovec buffers[2] = { wlc::makeBuffer(msg.header, 14), wlc::makeBuffer(msg.payload, msg.size) };
+		iovec* pBuffers = buffers;
+		size_t nBuffers = msg.size > 0 ? 2 : 1;
+		wlc::consumeBuffers(pBuffers, nBuffers, sent);
+		
+		while(nBuffers > 0) {
+			int sentNow = wlc::sendBuffers(_socket, pBuffers, nBuffers);
+			if(sentNow == SOCKET_ERROR)
+				return wlc::errorIs(wlc::WOULD_BLOCK, wlc::getError());
+			
+			sent += (size_t)sentNow;
+			wlc::consumeBuffers(pBuffers, nBuffers, (size_t)sentNow);
 		}
 		
 		return true;
 	}
-	bool send(const Message& msg) const {
-		return (::send(_socket, msg.data(), (int)msg.length(), 0) == (int)msg.length());
+	
+	// Best effort: false if an option was refused, the others are set anyway. Read the values used with options().
+	bool setOptions(const SocketOptions& options) {
+		if(!_valid())
+			return false;
+		
+		bool done = true;
+		if(options.sendBuffer > 0)
+			done &= wlc::setOption(_socket, wlc::SEND_BUFFER, options.sendBuffer) == 0;
+		if(options.receiveBuffer > 0)
+			done &= wlc::setOption(_socket, wlc::RECEIVE_BUFFER, options.receiveBuffer) == 0;
+		if(options.dscp >= 0)
+			done &= wlc::setOption(_socket, wlc::DSCP, options.dscp) == 0;
+		if(options.busyPollMus > 0)
+			done &= wlc::setOption(_socket, wlc::BUSY_POLL, options.busyPollMus) == 0;
+		
+		if(_protoType == Proto_Tcp) {
+			if(options.noDelay)
+				done &= wlc::setOption(_socket, wlc::NO_DELAY, 1) == 0;
+			if(options.quickAck)
+				done &= wlc::setOption(_socket, wlc::QUICK_ACK, 1) == 0;
+		}
+		else if(_protoType == Proto_Udp) {
+			if(options.dropCounter)
+				done &= wlc::setOption(_socket, wlc::DROP_COUNTER, 1) == 0;
+			if(options.receiveTimestamps)
+				done &= wlc::setOption(_socket, wlc::RECEIVE_TIMESTAMPS, 1) == 0;
+			
+			// Shared by the copies of this socket: they all send in the same numbering
+			if(options.sendTimestamps && !_pSendTimestamps) {
+				if(wlc::setOption(_socket, wlc::SEND_TIMESTAMPS, 1) == 0)
+					_pSendTimestamps = std::make_shared<SendTimestamps>();
+				else
+					done = false;
+			}
+		}
+		
+		return done;
 	}
 	
 	void close() {
@@ -479,6 +1027,7 @@ struct Socket {
 		wlc::closeSocket(_socket);
 		
 		_socket = INVALID_SOCKET;
+		_pSendTimestamps.reset();
 	}
 	
 	// Getters
@@ -498,9 +1047,44 @@ struct Socket {
 	SOCKET get() const {
 		return _socket;
 	}
+	bool canSegment() const {
+		return _canSegment;
+	}
+	// Numbering of the datagrams sent, nullptr without SocketOptions::sendTimestamps
+	SendTimestamps* sendTimestamps() const {
+		return _pSendTimestamps.get();
+	}
+	// Values used by the kernel: buffers doubled by Linux, or capped by the system (net.core.rmem_max, wmem_max)
+	SocketOptions options() const {
+		SocketOptions options;
+		if(!_valid())
+			return options;
+		
+		options.sendBuffer 		= std::max(0, wlc::getOption(_socket, wlc::SEND_BUFFER));
+		options.receiveBuffer 	= std::max(0, wlc::getOption(_socket, wlc::RECEIVE_BUFFER));
+		options.dscp 			= wlc::getOption(_socket, wlc::DSCP);
+		options.busyPollMus 	= std::max(0, wlc::getOption(_socket, wlc::BUSY_POLL));
+		
+		if(_protoType == Proto_Tcp) {
+			options.noDelay 	= wlc::getOption(_socket, wlc::NO_DELAY) > 0;
+			options.quickAck 	= wlc::getOption(_socket, wlc::QUICK_ACK) > 0;
+		}
+		else if(_protoType == Proto_Udp) {
+			options.dropCounter 		= wlc::getOption(_socket, wlc::DROP_COUNTER) > 0;
+			options.receiveTimestamps 	= wlc::getOption(_socket, wlc::RECEIVE_TIMESTAMPS) > 0;
+			options.sendTimestamps 		= wlc::getOption(_socket, wlc::SEND_TIMESTAMPS) > 0;
+		}
+		
+		return options;
+	}
 	
 private:
 	// Methods
+	// SOCKET is unsigned, INVALID_SOCKET is -1 on Linux
+	bool _valid() const {
+		return _socket != (SOCKET)INVALID_SOCKET;
+	}
+	
 	bool _createSocket(const SocketAddress& address, const ProtoType proto) {
 		_address 	= address; 
 		_protoType 	= proto;
@@ -522,6 +1106,9 @@ private:
 		else if(proto == Proto_Udp)
 			_socket = socket(family, SOCK_DGRAM , IPPROTO_UDP);		
 		
+		// -- Offload --
+		_canSegment = (proto == Proto_Udp) && wlc::canSegment(_socket);
+		
 		return true;
 	}
 	
@@ -529,5 +1116,204 @@ private:
 	SOCKET 			_socket;
 	ProtoType 		_protoType;
 	SocketAddress 	_address;
+	bool			_canSegment;
+	std::shared_ptr<SendTimestamps> _pSendTimestamps;
 };
 
+// ------------------------------ Batch ----------------------------
+inline bool DatagramBatch::flush(const Socket& emitter, IoUring* pRing) {
+	return _flush(emitter, _entries.size(), pRing);
+}
+
+inline bool DatagramBatch::flush(const Socket& emitter, const size_t maxBytes, size_t& sentBytes, IoUring* pRing) {
+	sentBytes = 0;
+	
+	size_t endEntry = _firstEntry;
+	while(endEntry < _entries.size() && (endEntry == _firstEntry || sentBytes + _entries[endEntry].length <= maxBytes))
+		sentBytes += _entries[endEntry++].length;
+	
+	const size_t firstEntry = _firstEntry;
+	const bool sent = _flush(emitter, endEntry, pRing);
+	
+	// Stopped by a full socket buffer: only what left
+	if(!empty()) {
+		sentBytes = 0;
+		for(size_t i = firstEntry; i < _firstEntry; i++)
+			sentBytes += _entries[i].length;
+	}
+	return sent;
+}
+
+inline bool DatagramBatch::_flush(const Socket& emitter, const size_t endEntry, IoUring* pRing) {
+	bool segment = _segmentation && emitter.canSegment();
+	
+	// Queued: the ring knows if the kernel refused the segmentation. Not with timestamps: the order of the sends would be unknown.
+	SendTimestamps* pTimestamps = emitter.sendTimestamps();
+	if(pRing && !pTimestamps) {
+		_group(_firstEntry, endEntry, segment && pRing->segmentation());
+		
+		for(size_t i = 0; i < _datagrams.size(); i++) {
+			const wlc::Datagram& datagram = _datagrams[i];
+			if(!pRing->send(emitter.get(), datagram, &_owned[datagram.buffers - _buffers.data()])) { // Ring full: the rest waits
+				_firstEntry = _datagramsEntry[i];
+				return false;
+			}
+		}
+		
+		_firstEntry = endEntry;
+		if(empty())
+			clear();
+		
+		return true;
+	}
+	
+	bool sentAll = true;
+	for(size_t firstEntry = _firstEntry; firstEntry < endEntry; ) {
+		_group(firstEntry, endEntry, segment);
+		
+		std::unique_lock<std::mutex> lockTimestamps;
+		if(pTimestamps) {
+			lockTimestamps = std::unique_lock<std::mutex>(pTimestamps->mutex());
+			pTimestamps->begin();
+		}
+		
+		int nSent = wlc::sendDatagrams(emitter.get(), _datagrams.data(), _datagrams.size());
+		for(int i = 0; pTimestamps && i < nSent; i++) // One number for each datagram given, segmented or not
+			pTimestamps->record(_entries[_datagramsEntry[i]].captureMus);
+		
+		if(nSent == (int)_datagrams.size())
+			break;
+		
+		// Stopped before the end without error: try the rest, to know why
+		if(nSent > 0) {
+			firstEntry = _datagramsEntry[nSent];
+			continue;
+		}
+		
+		// Refused at the first one
+		const int error = wlc::getError();
+		if(wlc::errorIs(wlc::WOULD_BLOCK, error)) { // Socket buffer full: keep everything left
+			_firstEntry = firstEntry;
+			return false;
+		}
+		if(_datagrams[0].segmentSize > 0 && (wlc::errorIs(wlc::IO_FAILED, error) || wlc::errorIs(wlc::INVALID_ARG, error))) {
+			// Segmentation refused (no checksum offload ?) : send the rest one by one
+			_segmentation 	= false;
+			segment 		= false;
+			continue;
+		}
+		
+		// Can't be sent (too big, ...): skip it
+		sentAll 	= false;
+		firstEntry 	= _datagramsEntry.size() > 1 ? _datagramsEntry[1] : endEntry;
+	}
+	
+	_firstEntry = endEntry;
+	if(empty())
+		clear();
+	
+	return sentAll;
+}
+
+
+
+// ------------------------------ Receiver ----------------------------
+// Pre-posted buffers, filled with all the datagrams waiting on a socket in one call.
+class DatagramReceiver {
+public:
+	struct Datagram {
+		const char* data;
+		size_t length;
+		size_t iSender;
+		uint64_t kernelMus; // System clock of the reception (SocketOptions::receiveTimestamps), 0 if unknown
+	};
+	
+public:
+	explicit DatagramReceiver(size_t nBuffers = 16, size_t bufferSize = 65536) :
+		_memory(nBuffers * bufferSize),
+		_datagramsIn(nBuffers),
+		_dropped(0)
+	{
+		for(size_t i = 0; i < nBuffers; i++) {
+			_datagramsIn[i].buffer 		= &_memory[i * bufferSize];
+			_datagramsIn[i].bufferSize 	= bufferSize;
+		}
+	}
+	
+	// Methods
+	// Let the kernel coalesce datagrams (UDP GRO), they are cut again in receive().
+	bool coalesce(const Socket& socket) {
+		return wlc::setCoalescing(socket.get(), true) == 0;
+	}
+	
+	// Read what is waiting, without blocking. Return the number of datagrams, SOCKET_ERROR on error.
+	int receive(const Socket& socket) {
+		_datagrams.clear();
+		
+		int nReceived = wlc::receiveDatagrams(socket.get(), _datagramsIn.data(), _datagramsIn.size());
+		if(nReceived == SOCKET_ERROR)
+			return SOCKET_ERROR;
+		
+		for(size_t i = 0; i < (size_t)nReceived; i++) {
+			const wlc::DatagramIn& datagramIn = _datagramsIn[i];
+			if(datagramIn.drops > 0)
+				_countDrops(socket, datagramIn.drops);
+			
+			size_t segmentSize = datagramIn.segmentSize > 0 ? datagramIn.segmentSize : datagramIn.length;
+			
+			for(size_t offset = 0; offset < datagramIn.length; offset += segmentSize)
+				_datagrams.push_back(Datagram{ datagramIn.buffer + offset, std::min(segmentSize, datagramIn.length - offset), i, datagramIn.kernelMus });
+		}
+		
+		return (int)_datagrams.size();
+	}
+	
+	// Getters
+	bool full() const { // Last receive() used every buffer: more could be waiting
+		return !_datagrams.empty() && _datagrams.back().iSender + 1 == _datagramsIn.size();
+	}
+	const std::vector<Datagram>& datagrams() const {
+		return _datagrams;
+	}
+	// Datagrams dropped by the sockets (full queue), once their counter is on (SocketOptions::dropCounter)
+	uint64_t dropped() const {
+		return _dropped;
+	}
+	SocketAddress sender(const Datagram& datagram) const {
+		const wlc::DatagramIn& datagramIn = _datagramsIn[datagram.iSender];
+		
+		if(datagramIn.address.ss_family == AF_INET)
+			return SocketAddress(Ip_v4, reinterpret_cast<const sockaddr&>(datagramIn.address), datagramIn.addressSize);
+		if(datagramIn.address.ss_family == AF_INET6)
+			return SocketAddress(Ip_v6, reinterpret_cast<const sockaddr&>(datagramIn.address), datagramIn.addressSize);
+		
+		return SocketAddress();
+	}
+	
+private:
+	// Methods
+	// The kernel gives the total of the socket: keep the last one of each socket
+	void _countDrops(const Socket& socket, const uint32_t drops) {
+		for(std::pair<SOCKET, uint32_t>& socketDrops : _socketDrops) {
+			if(socketDrops.first != socket.get())
+				continue;
+			
+			if(drops > socketDrops.second) {
+				_dropped += drops - socketDrops.second;
+				socketDrops.second = drops;
+			}
+			return;
+		}
+		
+		_socketDrops.push_back(std::make_pair(socket.get(), drops));
+		_dropped += drops;
+	}
+	
+	// Members
+	std::vector<char> _memory;
+	std::vector<wlc::DatagramIn> _datagramsIn;
+	std::vector<Datagram> _datagrams;
+	
+	std::vector<std::pair<SOCKET, uint32_t>> _socketDrops;
+	std::atomic<uint64_t> _dropped;
+};
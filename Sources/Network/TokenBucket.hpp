@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// ------------------- TokenBucket : limit a flow of bytes -------------------
+// Tokens (bytes) come back at 'rate' per second, up to 'burst'.
+// Sending may take more than available: the debt is paid before the next send.
+class TokenBucket {
+public:
+	// Constructors
+	explicit TokenBucket(const double burst = 64000.0) :
+		_rate(0.0),
+		_burst(burst),
+		_tokens(burst),
+		_lastMus(0)
+	{
+
+	}
+
+	// Methods
+	// Bytes which can be sent now
+	double available(const int64_t nowMus) {
+		_refill(nowMus);
+		return _tokens;
+	}
+
+	void consume(const size_t bytes) {
+		if(_rate > 0.0)
+			_tokens -= (double)bytes;
+	}
+
+	// Time before tokens are available again
+	int64_t waitMus(const int64_t nowMus) {
+		_refill(nowMus);
+
+		if(_tokens > 0.0 || _rate <= 0.0)
+			return 0;
+
+		return (int64_t)(1e6 * (1.0 - _tokens) / _rate);
+	}
+
+	// Setters
+	// Bytes per second, 0 for no limit
+	void setRate(const double rate) {
+		_rate = rate;
+		if(_rate <= 0.0)
+			_tokens = _burst;
+	}
+
+	// Getters
+	double rate() const {
+		return _rate;
+	}
+
+private:
+	// Methods
+	void _refill(const int64_t nowMus) {
+		if(_rate <= 0.0) {
+			_tokens = _burst;
+		}
+		else if(nowMus > _lastMus) {
+			_tokens += _rate * (double)(nowMus - _lastMus) / 1e6;
+			if(_tokens > _burst)
+				_tokens = _burst;
+		}
+
+		_lastMus = nowMus;
+	}
+
+	// Members
+	double _rate;
+	double _burst;
+	double _tokens;
+	int64_t _lastMus;
+};
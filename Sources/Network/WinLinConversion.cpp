@@ -37,7 +37,7 @@ bool wlc::errorIs(const ErrorCode& eCode, const int error) {
 #ifdef _WIN32 	
 		return (error == WSAEWOULDBLOCK) || (error == EAGAIN);
 #elif __linux__	
-		return (error == EWOULDBLOCK) || (error == EAGAIN);
+		return (error == EWOULDBLOCK) || (error == EAGAIN) || (error == EINPROGRESS);
 #endif
 		break;
 
@@ -73,6 +73,14 @@ bool wlc::errorIs(const ErrorCode& eCode, const int error) {
 #endif
 		break;
 
+	case IO_FAILED:
+#ifdef _WIN32 	
+		return false;
+#elif __linux__		
+		return (error == EIO);
+#endif
+		break;
+
 	}
 	return false;
 }
@@ -98,6 +106,208 @@ int wlc::setReusable(SOCKET idSocket, bool reusable) {
 	return setsockopt(idSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
 }
 
+int wlc::setReceiveBuffer(SOCKET idSocket, int size) {
+	return setsockopt(idSocket, SOL_SOCKET, SO_RCVBUF, (char *)&size, sizeof(size)); // Limited by the system maximum
+}
+
+// --- Tuning ---
+static bool optionName(SOCKET idSocket, wlc::SocketOption option, int& level, int& name) {
+	switch(option) {
+	case wlc::SEND_BUFFER:
+		level = SOL_SOCKET;
+		name = SO_SNDBUF;
+		return true;
+		
+	case wlc::RECEIVE_BUFFER:
+		level = SOL_SOCKET;
+		name = SO_RCVBUF;
+		return true;
+		
+	case wlc::NO_DELAY:
+		level = IPPROTO_TCP;
+		name = TCP_NODELAY;
+		return true;
+		
+	case wlc::DSCP: { // Depends on the family
+		sockaddr_storage local;
+		socklen_t len = sizeof(local);
+		if(getsockname(idSocket, (sockaddr*)&local, &len) != 0)
+			return false;
+		
+		if(local.ss_family == AF_INET6) {
+#ifdef IPV6_TCLASS
+			level = IPPROTO_IPV6;
+			name = IPV6_TCLASS;
+			return true;
+#else
+			return false;
+#endif
+		}
+		level = IPPROTO_IP;
+		name = IP_TOS; // Ignored by Windows without its QoS API
+		return true;
+	}
+	
+#ifdef __linux__
+	case wlc::QUICK_ACK:
+		level = IPPROTO_TCP;
+		name = TCP_QUICKACK;
+		return true;
+		
+#ifdef SO_BUSY_POLL
+	case wlc::BUSY_POLL:
+		level = SOL_SOCKET;
+		name = SO_BUSY_POLL;
+		return true;
+#endif
+		
+	case wlc::DROP_COUNTER:
+		level = SOL_SOCKET;
+		name = SO_RXQ_OVFL;
+		return true;
+		
+	case wlc::RECEIVE_TIMESTAMPS:
+	case wlc::SEND_TIMESTAMPS:
+		level = SOL_SOCKET;
+		name = SO_TIMESTAMPING;
+		return true;
+#endif
+		
+	default:
+		return false;
+	}
+}
+
+#ifdef __linux__
+// Both timestamps share the flags of SO_TIMESTAMPING: software ones, the send ones numbered (id) and without the packet
+static int timestampFlags(wlc::SocketOption option) {
+	if(option == wlc::RECEIVE_TIMESTAMPS)
+		return SOF_TIMESTAMPING_RX_SOFTWARE;
+	if(option == wlc::SEND_TIMESTAMPS)
+		return SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	return 0;
+}
+#endif
+
+int wlc::setOption(SOCKET idSocket, SocketOption option, int value) {
+	int level = 0, name = 0;
+	if(!optionName(idSocket, option, level, name))
+		return -1;
+	
+	if(option == DSCP)
+		value <<= 2; // Under the 2 bits of ECN
+	
+#ifdef __linux__
+	if(option == RECEIVE_TIMESTAMPS || option == SEND_TIMESTAMPS) {
+		int flags = 0;
+		socklen_t len = sizeof(flags);
+		if(getsockopt(idSocket, level, name, (char *)&flags, &len) != 0)
+			return -1;
+		
+		flags = value ? flags | timestampFlags(option) : flags & ~timestampFlags(option);
+		if(flags & (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE))
+			flags |= SOF_TIMESTAMPING_SOFTWARE; // Reported
+		else
+			flags = 0;
+		value = flags;
+	}
+#endif
+	
+	return setsockopt(idSocket, level, name, (char *)&value, sizeof(value)) == 0 ? 0 : -1;
+}
+
+int wlc::getOption(SOCKET idSocket, SocketOption option) {
+	int level = 0, name = 0;
+	if(!optionName(idSocket, option, level, name))
+		return -1;
+	
+	int value = 0;
+	socklen_t len = sizeof(value);
+	if(getsockopt(idSocket, level, name, (char *)&value, &len) != 0)
+		return -1;
+	
+#ifdef __linux__
+	if(option == RECEIVE_TIMESTAMPS || option == SEND_TIMESTAMPS)
+		return (value & timestampFlags(option)) == timestampFlags(option) ? 1 : 0;
+#endif
+	
+	return option == DSCP ? (value >> 2) & 0x3F : value;
+}
+
+// --- Path MTU ---
+int wlc::pathMtu(const sockaddr* address, socklen_t addressSize) {
+#ifdef __linux__
+	const bool v6 = address->sa_family == AF_INET6;
+	
+	int idSocket = socket(address->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	if(idSocket < 0)
+		return -1;
+	
+	// Don't fragment: the route gives the real path MTU
+	int mtu 		= -1;
+	int discover 	= v6 ? IPV6_PMTUDISC_DO : IP_PMTUDISC_DO;
+	socklen_t len 	= sizeof(mtu);
+	
+	if(setsockopt(idSocket, v6 ? IPPROTO_IPV6 : IPPROTO_IP, v6 ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER, (char *)&discover, sizeof(discover)) != 0 ||
+		connect(idSocket, address, addressSize) != 0 ||
+		getsockopt(idSocket, v6 ? IPPROTO_IPV6 : IPPROTO_IP, v6 ? IPV6_MTU : IP_MTU, (char *)&mtu, &len) != 0)
+	{
+		mtu = -1;
+	}
+	
+	close(idSocket);
+	return mtu;
+#else
+	return -1; // No equivalent: use the override
+#endif
+}
+
+// --- Multicast ---
+int wlc::joinGroup(SOCKET idSocket, const sockaddr* group, const sockaddr* interfaceAddress) {
+	if(group->sa_family == AF_INET6) {
+		ipv6_mreq request;
+		memset(&request, 0, sizeof(request));
+		request.ipv6mr_multiaddr = ((const sockaddr_in6*)group)->sin6_addr;
+		request.ipv6mr_interface = 0;
+		
+		return setsockopt(idSocket, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char *)&request, sizeof(request));
+	}
+	
+	ip_mreq request;
+	memset(&request, 0, sizeof(request));
+	request.imr_multiaddr 			= ((const sockaddr_in*)group)->sin_addr;
+	request.imr_interface.s_addr 	= htonl(INADDR_ANY);
+	if(interfaceAddress && interfaceAddress->sa_family == AF_INET)
+		request.imr_interface = ((const sockaddr_in*)interfaceAddress)->sin_addr;
+	
+	return setsockopt(idSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&request, sizeof(request));
+}
+
+int wlc::setMulticast(SOCKET idSocket, const sockaddr* interfaceAddress, int hops, bool loop) {
+	int on = loop ? 1 : 0;
+	
+	// Family of the socket
+	sockaddr_storage address;
+	socklen_t len = sizeof(address);
+	if(getsockname(idSocket, (sockaddr*)&address, &len) != 0)
+		return SOCKET_ERROR;
+	
+	if(address.ss_family == AF_INET6) {
+		if(setsockopt(idSocket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char *)&hops, sizeof(hops)) != 0)
+			return SOCKET_ERROR;
+		return setsockopt(idSocket, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (char *)&on, sizeof(on));
+	}
+	
+	if(interfaceAddress && interfaceAddress->sa_family == AF_INET) {
+		in_addr interfaceIp = ((const sockaddr_in*)interfaceAddress)->sin_addr;
+		if(setsockopt(idSocket, IPPROTO_IP, IP_MULTICAST_IF, (char *)&interfaceIp, sizeof(interfaceIp)) != 0)
+			return SOCKET_ERROR;
+	}
+	if(setsockopt(idSocket, IPPROTO_IP, IP_MULTICAST_TTL, (char *)&hops, sizeof(hops)) != 0)
+		return SOCKET_ERROR;
+	return setsockopt(idSocket, IPPROTO_IP, IP_MULTICAST_LOOP, (char *)&on, sizeof(on));
+}
+
 // --- Non blocking ---
 int wlc::polling(pollfd* pfds, unsigned long nfds, int timeout) {
 #ifdef _WIN32 
@@ -107,6 +317,264 @@ int wlc::polling(pollfd* pfds, unsigned long nfds, int timeout) {
 #endif		
 }
 
+// --- Scatter-gather ---
+iovec wlc::makeBuffer(const char* data, size_t len) {
+	iovec buffer;
+#ifdef _WIN32 
+	buffer.buf = const_cast<char*>(data);
+	buffer.len = (ULONG)len;
+#elif __linux__
+	buffer.iov_base = const_cast<char*>(data);
+	buffer.iov_len 	= len;
+#endif
+	return buffer;
+}
+
+void wlc::consumeBuffers(iovec*& buffers, size_t& nBuffers, size_t len) {
+	while(nBuffers > 0) {
+#ifdef _WIN32 
+		size_t bufferLen = buffers->len;
+		if(len < bufferLen) {
+			buffers->buf += len;
+			buffers->len -= (ULONG)len;
+			return;
+		}
+#elif __linux__
+		size_t bufferLen = buffers->iov_len;
+		if(len < bufferLen) {
+			buffers->iov_base = static_cast<char*>(buffers->iov_base) + len;
+			buffers->iov_len -= len;
+			return;
+		}
+#endif
+		len -= bufferLen;
+		buffers++;
+		nBuffers--;
+	}
+}
+
+int wlc::sendBuffers(SOCKET idSocket, iovec* buffers, size_t nBuffers, const sockaddr* address, socklen_t addressSize) {
+#ifdef _WIN32 
+	DWORD sent = 0;
+	if(WSASendTo(idSocket, buffers, (DWORD)nBuffers, &sent, 0, address, address ? addressSize : 0, NULL, NULL) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	return (int)sent;
+#elif __linux__
+	msghdr header = {0};
+	header.msg_name 	= const_cast<sockaddr*>(address);
+	header.msg_namelen 	= address ? addressSize : 0;
+	header.msg_iov 		= buffers;
+	header.msg_iovlen 	= nBuffers;
+	return (int)sendmsg(idSocket, &header, 0);
+#endif
+}
+
+// --- Batch of datagrams ---
+int wlc::sendDatagrams(SOCKET idSocket, Datagram* datagrams, size_t nDatagrams) {
+#ifdef __linux__
+	const size_t MAX_BATCH = 64;
+	
+	mmsghdr headers[MAX_BATCH];
+	char controls[MAX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+	
+	size_t nSent = 0;
+	while(nSent < nDatagrams) {
+		size_t nBatch = std::min(MAX_BATCH, nDatagrams - nSent);
+		memset(headers, 0, nBatch*sizeof(mmsghdr));
+		
+		for(size_t i = 0; i < nBatch; i++) {
+			Datagram& datagram 	= datagrams[nSent + i];
+			msghdr& header 		= headers[i].msg_hdr;
+			
+			header.msg_name 	= const_cast<sockaddr*>(datagram.address);
+			header.msg_namelen 	= datagram.address ? datagram.addressSize : 0;
+			header.msg_iov 		= datagram.buffers;
+			header.msg_iovlen 	= datagram.nBuffers;
+			
+#ifdef UDP_SEGMENT
+			if(datagram.segmentSize > 0) {
+				header.msg_control 		= controls[i];
+				header.msg_controllen 	= sizeof(controls[i]);
+				
+				cmsghdr* control 	= CMSG_FIRSTHDR(&header);
+				control->cmsg_level = SOL_UDP;
+				control->cmsg_type 	= UDP_SEGMENT;
+				control->cmsg_len 	= CMSG_LEN(sizeof(uint16_t));
+				
+				uint16_t segmentSize = (uint16_t)datagram.segmentSize;
+				memcpy(CMSG_DATA(control), &segmentSize, sizeof(segmentSize));
+			}
+#endif
+		}
+		
+		int result = sendmmsg(idSocket, headers, (unsigned int)nBatch, 0);
+		if(result <= 0)
+			return nSent > 0 ? (int)nSent : SOCKET_ERROR;
+		
+		nSent += (size_t)result;
+	}
+	
+	return (int)nSent;
+#else
+	// One call per datagram
+	size_t nSent = 0;
+	for(; nSent < nDatagrams; nSent++) {
+		Datagram& datagram = datagrams[nSent];
+		if(sendBuffers(idSocket, datagram.buffers, datagram.nBuffers, datagram.address, datagram.addressSize) == SOCKET_ERROR)
+			break;
+	}
+	return nSent > 0 ? (int)nSent : SOCKET_ERROR;
+#endif
+}
+
+bool wlc::canSegment(SOCKET idSocket) {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+	int segmentSize = 0; // Only a probe: 0 disables the default segmentation
+	return setsockopt(idSocket, SOL_UDP, UDP_SEGMENT, (char *)&segmentSize, sizeof(segmentSize)) == 0;
+#else
+	return false;
+#endif
+}
+
+// --- Batch reception ---
+int wlc::receiveDatagrams(SOCKET idSocket, DatagramIn* datagrams, size_t nDatagrams) {
+#ifdef __linux__
+	const size_t MAX_BATCH = 64;
+	
+	mmsghdr headers[MAX_BATCH];
+	iovec buffers[MAX_BATCH];
+	char controls[MAX_BATCH][CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(scm_timestamping))]; // UDP_GRO, SO_RXQ_OVFL, SO_TIMESTAMPING
+	
+	size_t nBatch = std::min(MAX_BATCH, nDatagrams);
+	memset(headers, 0, nBatch*sizeof(mmsghdr));
+	
+	for(size_t i = 0; i < nBatch; i++) {
+		buffers[i] = makeBuffer(datagrams[i].buffer, datagrams[i].bufferSize);
+		
+		msghdr& header 		= headers[i].msg_hdr;
+		header.msg_name 	= &datagrams[i].address;
+		header.msg_namelen 	= sizeof(sockaddr_storage);
+		header.msg_iov 		= &buffers[i];
+		header.msg_iovlen 	= 1;
+		header.msg_control 		= controls[i];
+		header.msg_controllen 	= sizeof(controls[i]);
+	}
+	
+	int result = recvmmsg(idSocket, headers, (unsigned int)nBatch, MSG_DONTWAIT, nullptr);
+	if(result <= 0)
+		return SOCKET_ERROR;
+	
+	for(int i = 0; i < result; i++) {
+		msghdr& header = headers[i].msg_hdr;
+		
+		datagrams[i].addressSize 	= header.msg_namelen;
+		datagrams[i].length 		= headers[i].msg_len;
+		datagrams[i].segmentSize 	= 0;
+		datagrams[i].drops 			= 0;
+		datagrams[i].kernelMus 		= 0;
+		
+		for(cmsghdr* control = CMSG_FIRSTHDR(&header); control != nullptr; control = CMSG_NXTHDR(&header, control)) {
+#ifdef UDP_GRO
+			if(control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO) {
+				int segmentSize = 0;
+				memcpy(&segmentSize, CMSG_DATA(control), sizeof(segmentSize));
+				datagrams[i].segmentSize = (unsigned int)segmentSize;
+			}
+#endif
+			if(control->cmsg_level == SOL_SOCKET && control->cmsg_type == SO_RXQ_OVFL) // Only when some were dropped
+				memcpy(&datagrams[i].drops, CMSG_DATA(control), sizeof(uint32_t));
+			
+			if(control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMPING) {
+				scm_timestamping timestamps;
+				memcpy(&timestamps, CMSG_DATA(control), sizeof(timestamps));
+				datagrams[i].kernelMus = (uint64_t)timestamps.ts[0].tv_sec * 1000000 + (uint64_t)timestamps.ts[0].tv_nsec / 1000; // Software
+			}
+		}
+	}
+	
+	return result;
+#else
+	// One call per datagram
+	size_t nReceived = 0;
+	for(; nReceived < nDatagrams; nReceived++) {
+		DatagramIn& datagram = datagrams[nReceived];
+		
+		datagram.addressSize = sizeof(sockaddr_storage);
+		int len = recvfrom(idSocket, datagram.buffer, (int)datagram.bufferSize, 0, (sockaddr*)&datagram.address, &datagram.addressSize);
+		if(len == SOCKET_ERROR)
+			break;
+		
+		datagram.length 		= (size_t)len;
+		datagram.segmentSize 	= 0;
+		datagram.drops 			= 0;
+		datagram.kernelMus 		= 0;
+	}
+	return nReceived > 0 ? (int)nReceived : SOCKET_ERROR;
+#endif
+}
+
+int wlc::setCoalescing(SOCKET idSocket, bool coalescing) {
+#if defined(__linux__) && defined(UDP_GRO)
+	int on = coalescing ? 1 : 0; // Parameter for UDP_GRO
+	return setsockopt(idSocket, SOL_UDP, UDP_GRO, (char *)&on, sizeof(on));
+#else
+	return -1;
+#endif
+}
+
+// --- Send timestamps ---
+int wlc::receiveSendTimestamps(SOCKET idSocket, SendTimestamp* timestamps, size_t nTimestamps) {
+#ifdef __linux__
+	const size_t MAX_BATCH = 64;
+	
+	mmsghdr headers[MAX_BATCH];
+	char controls[MAX_BATCH][CMSG_SPACE(sizeof(scm_timestamping)) + CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+	
+	size_t nBatch = std::min(MAX_BATCH, nTimestamps);
+	memset(headers, 0, nBatch*sizeof(mmsghdr));
+	
+	for(size_t i = 0; i < nBatch; i++) { // Only the control messages (OPT_TSONLY)
+		headers[i].msg_hdr.msg_control 		= controls[i];
+		headers[i].msg_hdr.msg_controllen 	= sizeof(controls[i]);
+	}
+	
+	int result = recvmmsg(idSocket, headers, (unsigned int)nBatch, MSG_ERRQUEUE | MSG_DONTWAIT, nullptr);
+	if(result <= 0)
+		return SOCKET_ERROR;
+	
+	size_t nFilled = 0;
+	for(int i = 0; i < result; i++) {
+		msghdr& header 	= headers[i].msg_hdr;
+		bool hasTime 	= false;
+		bool hasId 		= false;
+		
+		for(cmsghdr* control = CMSG_FIRSTHDR(&header); control != nullptr; control = CMSG_NXTHDR(&header, control)) {
+			if(control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMPING) {
+				scm_timestamping time;
+				memcpy(&time, CMSG_DATA(control), sizeof(time));
+				timestamps[nFilled].kernelMus = (uint64_t)time.ts[0].tv_sec * 1000000 + (uint64_t)time.ts[0].tv_nsec / 1000;
+				hasTime = true;
+			}
+			else if((control->cmsg_level == SOL_IP && control->cmsg_type == IP_RECVERR) || (control->cmsg_level == SOL_IPV6 && control->cmsg_type == IPV6_RECVERR)) {
+				sock_extended_err error;
+				memcpy(&error, CMSG_DATA(control), sizeof(error));
+				if(error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+					timestamps[nFilled].id = error.ee_data;
+					hasId = true;
+				}
+			}
+		}
+		
+		if(hasTime && hasId)
+			nFilled++;
+	}
+	
+	return (int)nFilled;
+#else
+	return SOCKET_ERROR;
+#endif
+}
+
 // --- Closing sockets ---
 void wlc::closeSocket(SOCKET idSocket) {
 	if (idSocket < 0)
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <iostream>
+#include <cstring>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <thread>
@@ -17,8 +19,14 @@
 	#include <sys/select.h>
 	#include <sys/socket.h>
 	#include <sys/types.h>
+	#include <sys/uio.h>
 	#include <sys/poll.h>
+	#include <sys/epoll.h>
 	#include <netinet/in.h>	
+	#include <netinet/udp.h>
+	#include <netinet/tcp.h>
+	#include <linux/net_tstamp.h>
+	#include <linux/errqueue.h>
 	#include <arpa/inet.h>
 	#include <fcntl.h>
 	#include <errno.h>
@@ -47,6 +55,7 @@
 	typedef int socklen_t;
 	typedef int ssize_t;
 	typedef WSAPOLLFD pollfd;
+	typedef WSABUF iovec;
 
 #endif
 
@@ -66,7 +75,8 @@ namespace wlc {
 		INVALID_ARG, 
 		NOT_CONNECT, 
 		REFUSED_CONNECT, 
-		MSG_SIZE
+		MSG_SIZE,
+		IO_FAILED
 	};
 	
 	bool errorIs(const ErrorCode& eCode, const int error);
@@ -76,9 +86,95 @@ namespace wlc {
 	
 	int setReusable(SOCKET idSocket, bool reusable);
 	
+	int setReceiveBuffer(SOCKET idSocket, int size);
+	
+	// --- Tuning ---
+	enum SocketOption {
+		SEND_BUFFER, 	// Bytes
+		RECEIVE_BUFFER, // Bytes
+		NO_DELAY, 		// Tcp: no Nagle algorithm
+		QUICK_ACK, 		// Tcp: acknowledge at once (Linux), the kernel turns it off now and then
+		DSCP, 			// Class of the packets sent (0 to 63), in the IPv4 TOS or the IPv6 traffic class
+		BUSY_POLL, 		// Microseconds the receptions poll the device queue before sleeping (Linux)
+		DROP_COUNTER, 	// Datagrams dropped by the socket, given with the receptions (Linux)
+		RECEIVE_TIMESTAMPS, // Time the kernel received each datagram, given with it (Linux)
+		SEND_TIMESTAMPS 	// Time each datagram sent left for the device, in the error queue (Linux)
+	};
+	
+	// Return 0, or -1 if refused or unknown on this system
+	int setOption(SOCKET idSocket, SocketOption option, int value);
+	
+	// Value used by the kernel (Linux doubles the buffer sizes asked), -1 if unknown
+	int getOption(SOCKET idSocket, SocketOption option);
+	
+	// --- Path MTU ---
+	// MTU known by the kernel toward this address (IP_MTU on a connected probe socket), -1 if unknown
+	int pathMtu(const sockaddr* address, socklen_t addressSize);
+	
+	// --- Multicast ---
+	// Receive the datagrams sent to the group, on the interface having this address (nullptr: the system chooses).
+	// IPv6 groups: always the interface chosen by the system.
+	int joinGroup(SOCKET idSocket, const sockaddr* group, const sockaddr* interfaceAddress);
+	
+	// Datagrams sent to a group leave by the interface having this address (nullptr: the system chooses),
+	// cross at most 'hops' routers, and are delivered to this host too when 'loop'.
+	int setMulticast(SOCKET idSocket, const sockaddr* interfaceAddress, int hops, bool loop);
+	
 	// --- Non blocking ---
 	int polling(pollfd* pfds, unsigned long nfds, int timeout);
 	
+	// --- Scatter-gather ---
+	iovec makeBuffer(const char* data, size_t len);
+	
+	// Skip the first 'len' bytes, after a partial send on a stream
+	void consumeBuffers(iovec*& buffers, size_t& nBuffers, size_t len);
+	
+	// Send the buffers as one message. Use address only on unconnected sockets.
+	int sendBuffers(SOCKET idSocket, iovec* buffers, size_t nBuffers, const sockaddr* address = nullptr, socklen_t addressSize = 0);
+	
+	// --- Batch of datagrams ---
+	struct Datagram {
+		iovec* buffers;
+		size_t nBuffers;
+		const sockaddr* address;
+		socklen_t addressSize;
+		unsigned int segmentSize; // > 0 : kernel cuts the buffers in datagrams of this size (UDP GSO)
+	};
+	
+	// Return the number of datagrams sent, SOCKET_ERROR if none.
+	int sendDatagrams(SOCKET idSocket, Datagram* datagrams, size_t nDatagrams);
+	
+	// Can the kernel segment datagrams of this socket? (UDP_SEGMENT)
+	bool canSegment(SOCKET idSocket);
+	
+	// --- Batch reception ---
+	struct DatagramIn {
+		char* buffer;
+		size_t bufferSize;
+		
+		sockaddr_storage address;
+		socklen_t addressSize;
+		size_t length;
+		unsigned int segmentSize; // > 0 : several datagrams of this size were coalesced (UDP GRO)
+		uint32_t drops; 			// Dropped by the socket before this one, when counted (DROP_COUNTER)
+		uint64_t kernelMus; 		// System clock of the reception by the kernel (RECEIVE_TIMESTAMPS), 0 if unknown
+	};
+	
+	// Receive without blocking. Return the number of datagrams filled, SOCKET_ERROR if none.
+	int receiveDatagrams(SOCKET idSocket, DatagramIn* datagrams, size_t nDatagrams);
+	
+	// Let the kernel coalesce datagrams of the same flow (UDP_GRO)
+	int setCoalescing(SOCKET idSocket, bool coalescing);
+	
+	// --- Send timestamps ---
+	struct SendTimestamp {
+		uint32_t id; 		// The kernel numbers the datagrams of the socket, from 0 when SEND_TIMESTAMPS is set
+		uint64_t kernelMus; // System clock: left for the device
+	};
+	
+	// Read the error queue without blocking. Return the number of timestamps filled, SOCKET_ERROR if none.
+	int receiveSendTimestamps(SOCKET idSocket, SendTimestamp* timestamps, size_t nTimestamps);
+	
 	// --- Closing sockets ---
 	void closeSocket(SOCKET idSocket);
 }
@@ -1,13 +1,16 @@
 #pragma once
 
 #include "../Network/Client.hpp"
+#include "../Network/SharedRing.hpp"
 #include "../Device/DeviceMt.hpp"
 #include "../Tool/Timer.hpp"
 #include "../Tool/Decoder.hpp"
 #include "../Tool/Buffers.hpp"
+#include "DeviceCommand.hpp"
 
 #include <map>
 #include <string>
+#include <vector>
 #include <memory>
 #include <mutex>
 #include <atomic>
@@ -20,18 +23,24 @@ public:
 	// -- Constructors --
 	explicit ClientDevice(const IAddress& address) :
 		_running(false),
+		_binary(false),
+		_local(true),
+		_leaveRing(false),
 		_port(address.port),
 		_pathDest(address.ip),
 		_format({640, 480, Device::MJPG}),
+		_buffer(BUFFER_FRAMES),
 		_errCount(0)
 	{
-		// client
+		// client: the server adapts the encoding to what is received
+		_client.setReportPeriod(REPORT_PERIOD);
 		_decoderH264.setup();
 		_decoderJpg.setup();
 	}
 	
 	~ClientDevice() {
 		close();
+		_dispatcher.wait();
 		_decoderH264.cleanup();
 		_decoderJpg.cleanup();
 	}
@@ -54,12 +63,15 @@ public:
 	}
 	bool close() {
 		_running = false;
+		_buffer.wake();
+		_ring.wake();
 		
 		if(_pThreadBuffer && _pThreadBuffer->joinable())
 			_pThreadBuffer->join();
 		_pThreadBuffer.reset();
 		
 		_client.disconnect();
+		_ring.close();
 		
 		return true;
 	}
@@ -72,6 +84,10 @@ public:
 	bool isOpen() const {
 		return _running;
 	}
+	// Frames read in the shared memory of the server
+	bool isLocal() const {
+		return _ring.opened();
+	}
 	
 	double get(Device::Param code, bool* success = nullptr) {
 		const int64_t TIMEOUT_MUS = 500*1000; // 500ms
@@ -102,9 +118,9 @@ public:
 		});
 		
 		// Launch command
-		MessageFormat command;
-		command.add("code?", code);
-		_client.sendInfo(Message(Message::DEVICE | Message::PROPERTIES, command.str()));
+		DeviceCommand command(_binary);
+		command.add(DeviceCommand::CodeQuery, code);
+		_client.sendInfo(command.message(Message::DEVICE | Message::PROPERTIES));
 		
 		// Finally return
 		value = futureParam.get();
@@ -136,8 +152,7 @@ public:
 		});
 		
 		// Launch command
-		MessageFormat command;
-		_client.sendInfo(Message(Message::DEVICE | Message::FORMAT, "?"));
+		_client.sendInfo(Message(Message::DEVICE | Message::FORMAT | Message::BINARY, "?"));
 		
 		// Finally return
 		futureParam.get();
@@ -146,25 +161,25 @@ public:
 	
 	// -- Setters --
 	bool set(Device::Param code, double value) {
-		MessageFormat command;
-		command.add("code", 	code);
-		command.add("value", 	value);
+		DeviceCommand command(_binary);
+		command.add(DeviceCommand::Code, 	code);
+		command.add(DeviceCommand::Value, 	value);
 			
-		return _client.sendInfo(Message(Message::DEVICE | Message::PROPERTIES, command.str()));
+		return _client.sendInfo(command.message(Message::DEVICE | Message::PROPERTIES));
 	}
 	bool setFormat(int width, int height, Device::PixelFormat formatPix) {
-		MessageFormat command;
-		command.add("width", 	width);
-		command.add("height", 	height);
-		command.add("pixel", 	formatPix);
+		DeviceCommand command(_binary);
+		command.add(DeviceCommand::Width, 	width);
+		command.add(DeviceCommand::Height, 	height);
+		command.add(DeviceCommand::Pixel, 	formatPix);
 			
-		return _client.sendInfo(Message(Message::DEVICE | Message::FORMAT, command.str()));
+		return _client.sendInfo(command.message(Message::DEVICE | Message::FORMAT));
 	}
 	bool setFrameType(Gb::FrameType ftype) {
-		MessageFormat command;
-		command.add("type", ftype);
+		DeviceCommand command(_binary);
+		command.add(DeviceCommand::Type, ftype);
 		
-		return _client.sendInfo(Message(Message::DEVICE | Message::FORMAT, command.str()));
+		return _client.sendInfo(command.message(Message::DEVICE | Message::FORMAT));
 	}
 	
 	// -- Events --
@@ -181,6 +196,17 @@ public:
 		_cbkError = cbkError;
 	}
 	
+	// Read the frames in the shared memory of a server on this host, instead of the network. Call before open().
+	void setLocal(bool local) {
+		_local = local;
+	}
+	
+	// Where the callbacks run, of the network too
+	void setExecutor(const std::shared_ptr<Executor>& pExecutor) {
+		_dispatcher.setExecutor(pExecutor);
+		_client.setExecutor(pExecutor);
+	}
+	
 	void onGetParam(Device::Param code, const std::function<void(double)>& cbkParam) {
 		std::lock_guard<std::mutex> lockCbk(_mutCbk);
 		_mapCbkParam[code] = cbkParam;
@@ -208,51 +234,81 @@ private:
 	}
 	
 	void _bufferRead() {
-		Gb::Frame frame;
-		
+		Gb::Frame frameEmit;
 		Message messageFrame;
-		bool emitFrame = false;
-		bool success = false;
+		SharedRing::Frame localFrame;
+		std::vector<unsigned char> localCopy;
+		uint64_t nextIndex 	= 0;
+		bool keyNeeded 		= true; // H264 from the shared memory: the decoder needs all the frames since a key one
 		
-		for(;_running; Timer::wait(2)) {
-			emitFrame = false;
+		while(_running) {
+			bool success = false;
 			
-			// -- Get frame --
-			_buffer.lock();
-			if(_buffer.update(messageFrame)) {
-				unsigned int frameTypeCode = (messageFrame.code() >> 10) & ((1 << 0) | (1 << 1) | (1 << 2)); 	// Decode frame type 3 bits : 10 - 11 - 12
-				unsigned int frameSizeCode = (messageFrame.code() >> 13) & ((1 << 0) | (1 << 1)); 				// Decode frame size 2 bits : 13 - 14
+			// Frames too big for the shared memory: back to the network
+			if(_leaveRing.exchange(false) && _ring.opened()) {
+				_ring.close();
+				_client.sendInfo(Message(Message::HANDSHAKE, "Start"));
+				refresh(); // The broadcast starts anywhere in the stream
+			}
+			
+			// -- Get frame, decoded where it is --
+			if(_ring.opened()) {
+				if(!_ring.wait(localFrame, WAIT_FRAME))
+					continue;
 				
-				Gb::Size sizeDecode = (frameSizeCode == 0) ? Gb::Size(_format.width, _format.height) : Gb::Size((Gb::SizeType)frameSizeCode);
-
-				frame = Gb::Frame(
-					(unsigned char*)messageFrame.content(), 
-					(unsigned long)(messageFrame.size()), 
-					frameSizeCode == 0 ? Gb::Size(_format.width, _format.height) : Gb::Size((Gb::SizeType)frameSizeCode), 	
-					(Gb::FrameType)(frameTypeCode)	
-				);
-				emitFrame = true;
+				// Frames skipped by a late reader
+				const bool skipped 	= localFrame.index != nextIndex;
+				nextIndex 			= localFrame.index + 1;
+				
+				if(_isH264(localFrame.code)) {
+					// Until a key frame, the references are missing: ask for one
+					if(skipped && !keyNeeded) {
+						keyNeeded = true;
+						refresh();
+					}
+					if(keyNeeded && !(localFrame.code & Message::KEY_FRAME))
+						continue;
+					
+					// Checked before the decoding: a torn frame would corrupt its references
+					localCopy.assign(localFrame.data, localFrame.data + localFrame.length);
+					if(!_ring.valid(localFrame)) {
+						keyNeeded = true;
+						refresh();
+						continue;
+					}
+					
+					keyNeeded = false;
+					success = _treatFrame(localFrame.code, localCopy.data(), localCopy.size(), frameEmit);
+				}
+				else {
+					success = _treatFrame(localFrame.code, reinterpret_cast<const unsigned char*>(localFrame.data), localFrame.length, frameEmit);
+					if(!_ring.valid(localFrame)) // Overwritten meanwhile: the next one is already there
+						continue;
+				}
+			}
+			else {
+				if(!_buffer.wait(messageFrame, WAIT_FRAME) || messageFrame.size() == 0)
+					continue;
+				
+				success = _treatFrame(messageFrame.code(), reinterpret_cast<const unsigned char*>(messageFrame.content()), messageFrame.size(), frameEmit);
 			}
-			_buffer.unlock();
 			
 			// -- Emit --
-			if(emitFrame) {	
-				Gb::Frame frameEmit;
+			if(success) {
+				_errCount = 0;
 				
-				// Treat
-				if(_treatFrame(frame, frameEmit)) {	
-					_errCount = 0;
-					
-					// Call cbk
+				// Call cbk
+				std::function<void(const Gb::Frame&)> cbkFrame;
+				{
 					std::lock_guard<std::mutex> lockCbk(_mutCbkFrame);
-					if(_cbkFrame)
-						_futureOpen = std::async(std::launch::async, _cbkFrame, frameEmit);
+					cbkFrame = _cbkFrame;
 				}
-				else {
-					if(_errCount ++> 10) {
-						refresh();
-						_errCount = 0;
-					}
+				_dispatcher.post(0, cbkFrame, frameEmit);
+			}
+			else {
+				if(_errCount ++> 10) {
+					refresh();
+					_errCount = 0;
 				}
 			} // !Emit
 			
@@ -263,48 +319,54 @@ private:
 		_running = true;
 		_pThreadBuffer = std::make_shared<std::thread>(&ClientDevice::_bufferRead, this);
 		
-		std::lock_guard<std::mutex> lockCbk(_mutCbk);
-		if(_cbkOpen) 
-			_futureOpen = std::async(std::launch::async, _cbkOpen);
+		_dispatcher.post(0, _callback(_cbkOpen));
 		
-		_client.sendInfo(Message(Message::HANDSHAKE, "Start"));
+		// Frames sent by the network, unless read in the shared memory
+		if(!_ring.opened())
+			_client.sendInfo(Message(Message::HANDSHAKE, "Start"));
 		
 		return true;
 	}
 	
 	// Events
 	void _onConnect() {
-		_client.sendInfo(Message(Message::DEVICE | Message::FORMAT, "?"));
+		if(_local)
+			_client.sendInfo(Message(Message::DEVICE | Message::TEXT, "local?")); // Answered before the format
+		
+		_client.sendInfo(Message(Message::DEVICE | Message::FORMAT | Message::BINARY, "?")); // Binary answers if the server can
 	}	
 	void _onClientInfo(const Message& message) {
+		// The server answers in binary only if it knows it
+		if(message.code() & (Message::FORMAT | Message::PROPERTIES))
+			_binary = (message.code() & Message::BINARY) != 0;
+		
 		if(message.code() & Message::FORMAT)
 			_treatDeviceFormat(message);
 		
 		if(message.code() & Message::PROPERTIES)
 			_treatDeviceProperties(message);
+		
+		if(message.code() & Message::TEXT)
+			_treatDeviceText(message.str());
 	}	
 	void _onClientData(const Message& message) {
 		// Store frame's data
 		if(message.code() & Message::DEVICE) {
-			_buffer.lock();
-			_buffer.push(message, message.timestamp());
-			_buffer.unlock();
+			_buffer.push(message); // The oldest is lost if the decoding is late
 		}
 	}
 	
 	// Treat
 	void _treatDeviceFormat(const Message& message) {
 		bool exist = false;
-		MessageFormat command(message.str());
+		DeviceCommand command(message);
 		
-		int width 	= command.valueOf<int>("width");
-		int height 	= command.valueOf<int>("height");
+		int width 	= command.valueOf<int>(DeviceCommand::Width);
+		int height 	= command.valueOf<int>(DeviceCommand::Height);
 		
 		if(width > 0 && height > 0) {
 			// Should clear buffer : data size are wrong
-			_buffer.lock();
 			_buffer.clear();
-			_buffer.unlock();
 			
 			// Change format
 			_mutFormat.lock();
@@ -322,37 +384,71 @@ private:
 	}
 	void _treatDeviceProperties(const Message& message) {
 		bool exist = false;
-		MessageFormat command(message.str());
+		DeviceCommand command(message);
 		
-		Device::Param code = command.valueOf<Device::Param>("code", &exist);
+		Device::Param code = command.valueOf<Device::Param>(DeviceCommand::Code, &exist);
 		if(!exist)
 			return;
-		double value = command.valueOf<double>("value");
+		double value = command.valueOf<double>(DeviceCommand::Value);
 		
+		std::function<void(double)> cbkParam;
+		{
+			std::lock_guard<std::mutex> lockCbk(_mutCbk);
+			if(_mapCbkParam.find(code) != _mapCbkParam.end()) 
+				cbkParam = _mapCbkParam[code];
+		}
+		_dispatcher.post(1, cbkParam, value); // Not behind the frames
+	}
+	void _treatDeviceText(const std::string& msg) {
+		// Server on this host: "local=<name>,<token>" of its shared memory
+		if(msg.compare(0, 6, "local=") == 0 && !_running && !_ring.opened()) {
+			const size_t comma = msg.rfind(',');
+			if(comma != std::string::npos && comma > 6)
+				_ring.attach(msg.substr(6, comma - 6), strtoull(msg.c_str() + comma + 1, nullptr, 10));
+		}
+		// Shared memory stopped by the server: the reading thread goes back to the network
+		else if(msg == "local-") {
+			_leaveRing = true;
+			_ring.wake();
+		}
+	}
+	// Copy of a callback, called out of the lock
+	template <typename F>
+	F _callback(const F& cbk) const {
 		std::lock_guard<std::mutex> lockCbk(_mutCbk);
-		if(_mapCbkParam.find(code) != _mapCbkParam.end()) 
-			_futureParam = std::async(std::launch::async, _mapCbkParam[code], value);		
+		return cbk;
+	}
+	
+	static bool _isH264(const unsigned int code) {
+		return (Gb::FrameType)((code >> 10) & 0x7) == Gb::FrameType::H264; // Frame type 3 bits : 10 - 11 - 12
 	}
-	bool _treatFrame(Gb::Frame& frameIn, Gb::Frame& frameOut) {
-		bool success = false;
+	
+	// Decoded from where the frame is: the network message, the shared memory
+	bool _treatFrame(const unsigned int code, const unsigned char* data, const size_t length, Gb::Frame& frameOut) {
+		unsigned int frameTypeCode = (code >> 10) & ((1 << 0) | (1 << 1) | (1 << 2)); 	// Decode frame type 3 bits : 10 - 11 - 12
+		unsigned int frameSizeCode = (code >> 13) & ((1 << 0) | (1 << 1)); 				// Decode frame size 2 bits : 13 - 14
+		
+		Gb::Size size 		= (frameSizeCode == 0) ? Gb::Size(_format.width, _format.height) : Gb::Size((Gb::SizeType)frameSizeCode);
+		Gb::FrameType type 	= (Gb::FrameType)(frameTypeCode);
+		bool success 		= false;
 		
 		// Decode 
-		if(frameIn.type == Gb::FrameType::H264) {
-			success = _decoderH264.decode(frameIn.buffer, frameOut.buffer, &frameIn.size.width, &frameIn.size.height);
-			_format.width = frameIn.size.width;
-			_format.height = frameIn.size.height;
+		if(type == Gb::FrameType::H264) {
+			success = _decoderH264.decode(data, length, frameOut.buffer, &size.width, &size.height);
+			_format.width = size.width;
+			_format.height = size.height;
 		}
-		else if(frameIn.type == Gb::FrameType::Jpg422 || frameIn.type == Gb::FrameType::Jpg420) {
-			success = _decoderJpg.decode2bgr24(frameIn.buffer, frameOut.buffer, frameIn.size.width, frameIn.size.height);
+		else if(type == Gb::FrameType::Jpg422 || type == Gb::FrameType::Jpg420) {
+			success = _decoderJpg.decode2bgr24(data, length, frameOut.buffer, size.width, size.height);
 		}
-		else if(frameIn.type == Gb::FrameType::Bgr24) {
-			frameOut.buffer = frameIn.buffer;
+		else if(type == Gb::FrameType::Bgr24) {
+			frameOut.buffer.assign(data, data + length);
 			success = true;
 		}
 		
 		// Add info
 		if(success) {
-			frameOut.size = frameIn.size;
+			frameOut.size = size;
 			frameOut.type = Gb::FrameType::Bgr24;
 		}
 		
@@ -360,7 +456,13 @@ private:
 	}
 	
 	// -- Members --
+	static const int REPORT_PERIOD = 500; // ms
+	static const int WAIT_FRAME = 100; // ms, to see _running
+	static const size_t BUFFER_FRAMES = 8;
 	std::atomic<bool> _running;
+	std::atomic<bool> _binary; // Commands in binary, known from the server's answers
+	std::atomic<bool> _local;
+	std::atomic<bool> _leaveRing; // "local-" received
 	
 	int _port;
 	std::string _pathDest;
@@ -370,6 +472,7 @@ private:
 	
 	std::shared_ptr<std::thread> _pThreadBuffer;
 	MsgBuffer _buffer;
+	SharedRing _ring; // Server on this host
 	int _errCount;
 	
 	DecoderH264 _decoderH264;
@@ -385,8 +488,6 @@ private:
 	std::function<void(const Error& error)> _cbkError;	
 	std::map<Device::Param, std::function<void(double)>> _mapCbkParam;
 	
-	std::future<void> _futureOpen;
-	std::future<void> _futureFrame;
-	std::future<void> _futureParam;
+	Dispatcher _dispatcher;
 };
 
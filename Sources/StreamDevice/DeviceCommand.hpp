@@ -0,0 +1,95 @@
+#pragma once
+
+#include "../Network/Message.hpp"
+#include "../Device/Device.hpp"
+
+#include <string>
+
+// ------------------- DeviceCommand : content of the DEVICE_FORMAT and DEVICE_PROPERTIES messages -------------------
+// Written in binary for a peer which asked for it (Message::BINARY), in text for the others.
+// The query "?" stays in text: an old peer answers it in text, a new one in binary when the bit is set.
+class DeviceCommand {
+public:
+	// Schema: keys of the binary format, with their names in text
+	enum Key : uint16_t {
+		Width = 1, Height, Pixel, Type,
+		Code = 16, CodeQuery, Value,
+		Param = 32 // + Device::Param
+	};
+	
+	// Constructors
+	// To write
+	explicit DeviceCommand(const bool binary) : _binary(binary) {
+	}
+	// To read, the message must outlive the command
+	explicit DeviceCommand(const Message& message) :
+		_binary((message.code() & Message::BINARY) != 0),
+		_binaryFormat(message.content(), message.content() ? message.size() : 0)
+	{
+		if(!_binary)
+			_textFormat = MessageFormat(message.str());
+	}
+	
+	// Methods
+	template<typename T>
+	void add(const uint16_t key, T value) {
+		if(_binary)
+			_binaryFormat.add(key, value);
+		else
+			_textFormat.add(name(key), value);
+	}
+	
+	template<typename T>
+	T valueOf(const uint16_t key, bool* pExist = nullptr) {
+		if(_binary)
+			return _binaryFormat.valueOf<T>(key, pExist);
+		else
+			return _textFormat.valueOf<T>(name(key), pExist);
+	}
+	
+	Message message(const unsigned int code) const {
+		if(_binary)
+			return Message(code | Message::BINARY, _binaryFormat.data(), _binaryFormat.size());
+		else
+			return Message(code, _textFormat.str());
+	}
+	
+	// Statics
+	static uint16_t param(const Device::Param code) {
+		return (uint16_t)(Param + code);
+	}
+	static std::string name(const uint16_t key) {
+		switch(key) {
+			case Width: 		return "width";
+			case Height: 		return "height";
+			case Pixel: 		return "pixel";
+			case Type: 			return "type";
+			case Code: 			return "code";
+			case CodeQuery: 	return "code?";
+			case Value: 		return "value";
+		}
+		
+		switch(key - Param) {
+			case Device::Saturation: 	return "saturation";
+			case Device::Brightness: 	return "brightness";
+			case Device::Hue: 			return "hue";
+			case Device::Contrast: 		return "contrast";
+			case Device::Whiteness: 	return "whiteness";
+			case Device::Exposure: 		return "exposure";
+			case Device::AutoExposure: 	return "auto_exposure";
+			case Device::Gamma: 		return "gamma";
+		}
+		return std::to_string(key);
+	}
+	
+	// Getters
+	bool binary() const {
+		return _binary;
+	}
+
+private:
+	// Members
+	bool _binary;
+	BinaryFormat _binaryFormat;
+	MessageFormat _textFormat;
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "../Network/Message.hpp"
+#include "../Device/structures.hpp"
+
+#include <map>
+#include <cstdint>
+
+// ------------------- RateController : encoding following the clients' reception -------------------
+// Each client has its own bitrate estimation: increased slowly while it receives well,
+// cut under its receive rate when it loses frames, sees its delay growing,
+// or when the server has to drop frames from its queue.
+// The encoding is shared: it follows the worst client.
+class RateController {
+public:
+	// Constructors
+	explicit RateController(const Gb::Encoding& lowest = Gb::Encoding(100000, 5.0f, 10), const Gb::Encoding& highest = Gb::Encoding(4000000, 30.0f, 80)) :
+		_lowest(lowest),
+		_highest(highest),
+		_current(Gb::Encoding())
+	{
+	}
+
+	// Methods
+	// 'drops' : frames the server dropped for this client since its previous report
+	void update(uint64_t clientId, const ReceptionReport& report, uint64_t drops) {
+		std::map<uint64_t, double>::iterator itClient = _estimations.find(clientId);
+		if(itClient == _estimations.end())
+			itClient = _estimations.insert(std::make_pair(clientId, (double)_current.bitrate)).first;
+
+		double& estimation = itClient->second;
+		const double received = 8.0 * report.rate;
+
+		const bool congested = drops > 0 || report.loss > MAX_LOSS || report.delayTrend > MAX_DELAY_TREND || report.delay > MAX_DELAY;
+		const bool clear 	 = report.loss < MAX_LOSS / 4 && report.delayTrend <= MAX_DELAY_TREND / 4;
+
+		if(congested) {
+			// Below what goes through
+			const double base = (received > 0.0 && received < estimation) ? received : estimation;
+			estimation = DECREASE * base;
+		}
+		else if(clear) {
+			// Not much above what is really used
+			estimation = estimation * INCREASE + STEP;
+			if(received > 0.0 && estimation > 2.0 * received + STEP)
+				estimation = 2.0 * received + STEP;
+		}
+
+		if(estimation < _lowest.bitrate)
+			estimation = _lowest.bitrate;
+		if(estimation > _highest.bitrate)
+			estimation = _highest.bitrate;
+	}
+	void forget(uint64_t clientId) {
+		_estimations.erase(clientId);
+	}
+
+	// Return true when the encoding has to change
+	bool target(Gb::Encoding& encoding) {
+		if(_estimations.empty())
+			return false;
+
+		double bitrate = _highest.bitrate;
+		for(const auto& estimation : _estimations)
+			if(bitrate > estimation.second)
+				bitrate = estimation.second;
+
+		// Fewer frames for a low bitrate, the jpg quality follows the bitrate
+		const double part = (bitrate - _lowest.bitrate) / (double)(_highest.bitrate - _lowest.bitrate);
+
+		Gb::Encoding next;
+		next.bitrate 	= (int)bitrate;
+		next.frameRate 	= bitrate < LOW_BITRATE ? _lowest.frameRate + (float)(bitrate / LOW_BITRATE) * (_highest.frameRate - _lowest.frameRate) : _highest.frameRate;
+		next.jpgQuality = _lowest.jpgQuality + (int)(part * (_highest.jpgQuality - _lowest.jpgQuality));
+
+		// Skip the small changes
+		const double change = (next.bitrate - _current.bitrate) / (double)_current.bitrate;
+		if((change < MIN_CHANGE && change > -MIN_CHANGE) && next.frameRate == _current.frameRate && next.jpgQuality == _current.jpgQuality)
+			return false;
+
+		_current = next;
+		encoding = next;
+		return true;
+	}
+
+	// Getters
+	const Gb::Encoding& current() const {
+		return _current;
+	}
+
+private:
+	// Constants
+	static constexpr double MAX_LOSS 		= 0.02;
+	static constexpr int MAX_DELAY 			= 200; 		// ms
+	static constexpr int MAX_DELAY_TREND 	= 20; 		// ms
+	static constexpr double DECREASE 		= 0.85;
+	static constexpr double INCREASE 		= 1.05;
+	static constexpr double STEP 			= 20000.0; 	// bit/s
+	static constexpr double LOW_BITRATE 	= 400000.0; // bit/s, below the frame rate is reduced
+	static constexpr double MIN_CHANGE 		= 0.02;
+
+	// Members
+	Gb::Encoding _lowest;
+	Gb::Encoding _highest;
+	Gb::Encoding _current;
+	std::map<uint64_t, double> _estimations; // Bitrate by client id
+};
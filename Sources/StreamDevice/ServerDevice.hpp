@@ -2,12 +2,17 @@
 
 #include "../Tool/Timer.hpp"
 #include "../Network/Server.hpp"
+#include "../Network/SharedRing.hpp"
 #include "../Device/DeviceMt.hpp"
+#include "RateController.hpp"
+#include "DeviceCommand.hpp"
 
 #include <map>
 #include <mutex>
+#include <atomic>
 #include <string>
-#include <future>
+#include <vector>
+#include <random>
 #include <functional>
 
 class ServerDevice {
@@ -15,13 +20,19 @@ public:
 	// -- Constructors --
 	explicit ServerDevice(const std::string& pathCamera, const int port = 8888) :
 		_port(port),
-		_pathDest(pathCamera)
+		_pathDest(pathCamera),
+		_adaptive(true),
+		_localSharing(false),
+		_localSlots(LOCAL_SLOTS),
+		_localSlotSize(LOCAL_SLOT_SIZE),
+		_localToken(0)
 	{
 		// server
 	}
 	
 	~ServerDevice() {
 		close();
+		_dispatcher.wait();
 	}
 	
 	// -- Methods --
@@ -44,6 +55,10 @@ public:
 		_device.release();
 		_server.disconnect();
 		
+		std::lock_guard<std::mutex> lockLocal(_mutLocal);
+		_local.close();
+		_localClients.clear();
+		
 		return true;
 	}
 	void refresh() {
@@ -71,6 +86,26 @@ public:
 	bool setFrameType(Gb::FrameType ftype) {
 		return _device.setFrameType(ftype);
 	}
+	bool setEncoding(const Gb::Encoding& encoding) {
+		return _device.setEncoding(encoding);
+	}
+	// Where the callbacks run, of the network and the device too
+	void setExecutor(const std::shared_ptr<Executor>& pExecutor) {
+		_dispatcher.setExecutor(pExecutor);
+		_server.setExecutor(pExecutor);
+		_device.setExecutor(pExecutor);
+	}
+	// Encoding adjusted to the clients' reports
+	void setAdaptive(bool adaptive) {
+		_adaptive = adaptive;
+	}
+	// Frames also written in shared memory: the ClientDevices of this host read them there, not from the network.
+	// 'slotSize' : bytes of the biggest frame shared. Call before open().
+	void setLocalSharing(bool sharing, size_t slots = LOCAL_SLOTS, size_t slotSize = LOCAL_SLOT_SIZE) {
+		_localSharing 	= sharing;
+		_localSlots 	= slots;
+		_localSlotSize 	= slotSize;
+	}
 	
 	// -- Events --
 	void onOpen(const std::function<void(void)>& cbkOpen) {
@@ -109,38 +144,68 @@ private:
 			this->_onDeviceFrame(frame);
 		});
 		
+		// Shared memory: its name and token are only given by tcp
+		if(_localSharing) {
+			std::random_device random;
+			const uint64_t token 	= ((uint64_t)random() << 32) | random();
+			const std::string name 	= "/protocole-" + std::to_string(_port) + "-" + std::to_string(random());
+			
+			std::lock_guard<std::mutex> lockLocal(_mutLocal);
+			if(_local.create(name, token, _localSlots, _localSlotSize))
+				_localToken = token;
+			else
+				_dispatcher.post(0, _callback(_cbkError), Error(Error::NO_CODE, "Shared memory Error"));
+		}
+		
 		
 		// Callback
-		std::lock_guard<std::mutex> lockCbk(_mutCbk);
-		if(_cbkOpen)
-			_futureOpen = std::async(std::launch::async, _cbkOpen);
+		_dispatcher.post(0, _callback(_cbkOpen));
 		
 		return true;
 	}
 	
 	// Events
 	void _onClientConnect(const Server::ClientInfo& client) {
-		_clientPlayer[client.id()] = false;
 		refresh();
 	}
 	void _onClientDisconnect(const Server::ClientInfo& client) {
-		_clientPlayer[client.id()] = false;
+		// Server forgets its subscription
+		{
+			std::lock_guard<std::mutex> lockRate(_mutRate);
+			_rateController.forget((uint64_t)client.id());
+			_drops.erase((uint64_t)client.id());
+		}
+		
+		std::lock_guard<std::mutex> lockLocal(_mutLocal);
+		_localClients.erase(client.id());
 	}
 	
 	void _onDeviceFrame(const Gb::Frame& frame) {
 		unsigned int code = Message::DEVICE | ((( ((unsigned int)frame.size.type() << 3) | (unsigned int)frame.type)) << 10);
+		if(_isKeyFrame(frame))
+			code |= Message::KEY_FRAME;
 		
-		// Broadcast frame
-		for(auto& client: _server.getClients()) {
-			if(client.connected && _clientPlayer[client.id()]) {
-				_server.sendData(client, Message(code, reinterpret_cast<const char*>(frame.start()), frame.length()));
+		// Local players read it in place. Bigger than a slot: the sharing stops, they go back to the network.
+		std::vector<Server::ClientInfo> localClients;
+		{
+			std::lock_guard<std::mutex> lockLocal(_mutLocal);
+			if(_local.opened() && !_local.publish(code, reinterpret_cast<const char*>(frame.start()), frame.length(), Timer::timestampMs(), Timer::monotonicMus())) {
+				_local.close();
+				for(const auto& localClient : _localClients)
+					localClients.push_back(localClient.second);
+				_localClients.clear();
+				
+				_dispatcher.post(0, _callback(_cbkError), Error(Error::NO_CODE, "Frame bigger than the shared memory slots: local sharing stopped"));
 			}
 		}
+		for(const Server::ClientInfo& client : localClients)
+			_server.sendInfo(client, Message(Message::DEVICE | Message::TEXT, "local-")); // Answered by "Start": the next frames are broadcast to it
+		
+		// Broadcast frame : serialized once for all the players
+		_server.broadcastData(code, reinterpret_cast<const char*>(frame.start()), frame.length());
 		
 		// Callback
-		std::lock_guard<std::mutex> lockCbk(_mutCbk);
-		if(_cbkFrame)
-			_futureFrame = std::async(std::launch::async, _cbkFrame, frame);
+		_dispatcher.post(0, _callback(_cbkFrame), frame);
 	}
 	
 	void _onServerInfo(const Server::ClientInfo& client, const Message& message) {
@@ -148,93 +213,96 @@ private:
 		std::string msg = message.str();
 		
 		if(message.code() & Message::FORMAT)
-			_treatFormat(client, msg);
+			_treatFormat(client, message);
 		
 		if(message.code() & Message::PROPERTIES)
-			_treatProperties(client, msg);
+			_treatProperties(client, message);
 		
 		if(message.code() & Message::TEXT)
 			_treatTextMessage(client, msg);
 		
 		if(message.code() & Message::HANDSHAKE)
-			_clientPlayer[client.id()] = (msg == "Start");
+			_server.subscribe(client, msg == "Start");
+		
+		if(message.code() & Message::REPORT)
+			_treatReport(client, msg);
 	}
 	
 	// Treat
-	void _treatFormat(const Server::ClientInfo& client, const std::string& msg) {
-		if(msg == "?") {
+	// Answered in binary to the clients asking for it
+	void _treatFormat(const Server::ClientInfo& client, const Message& message) {
+		const bool binary = (message.code() & Message::BINARY) != 0;
+		
+		if(_isQuery(message)) {
 			// --- get ---
 			Device::FrameFormat fmt = isOpen() ? _device.getFormat() : Device::FrameFormat{640,480,Device::MJPG};
 			
-			MessageFormat command;
-			command.add("width", 	fmt.width);
-			command.add("height", 	fmt.height);
-			command.add("pixel", 	fmt.format);
+			DeviceCommand command(binary);
+			command.add(DeviceCommand::Width, 	fmt.width);
+			command.add(DeviceCommand::Height, 	fmt.height);
+			command.add(DeviceCommand::Pixel, 	fmt.format);
 			
-			_server.sendInfo(client, Message(Message::DEVICE | Message::FORMAT, command.str()));
+			_server.sendInfo(client, command.message(Message::DEVICE | Message::FORMAT));
 		}
 		else {
 			// --- set ---
 			bool exist = false;
-			MessageFormat command(msg);
+			DeviceCommand command(message);
 			
 			// Frame type ?
-			Gb::FrameType fType = command.valueOf<Gb::FrameType>("type", &exist);
+			Gb::FrameType fType = command.valueOf<Gb::FrameType>(DeviceCommand::Type, &exist);
 			if(exist)
 				setFrameType(fType);
 			
 			// Frame size ?
-			Device::PixelFormat pixFmt 	= command.valueOf<Device::PixelFormat>("pixel", &exist);
+			Device::PixelFormat pixFmt 	= command.valueOf<Device::PixelFormat>(DeviceCommand::Pixel, &exist);
 			if(!exist)
 				return;
 			
-			int width 							= command.valueOf<int>("width");
-			int height 							= command.valueOf<int>("height");
+			int width 							= command.valueOf<int>(DeviceCommand::Width);
+			int height 							= command.valueOf<int>(DeviceCommand::Height);
 			
 			if(exist && width > 0 && height > 0) {
 				setFormat(width, height, pixFmt);
 				
 				// Confirm change
-				_server.sendInfo(client, Message(Message::DEVICE | Message::FORMAT, msg));
+				_server.sendInfo(client, message);
 			}
 		}		
 	}
-	void _treatProperties(const Server::ClientInfo& client, const std::string& msg) {
+	void _treatProperties(const Server::ClientInfo& client, const Message& message) {
+		const bool binary = (message.code() & Message::BINARY) != 0;
+		
 		// --- get all ---
-		if(msg == "?") {
-			MessageFormat command;
-			command.add("saturation", 	get(Device::Saturation));
-			command.add("brightness", 	get(Device::Brightness));
-			command.add("hue", 				get(Device::Hue));
-			command.add("contrast", 		get(Device::Contrast));
-			command.add("whiteness", 		get(Device::Whiteness));
-			command.add("exposure", 		get(Device::Exposure));
-			command.add("auto_exposure", get(Device::AutoExposure));
+		if(_isQuery(message)) {
+			DeviceCommand command(binary);
+			for(Device::Param code : { Device::Saturation, Device::Brightness, Device::Hue, Device::Contrast, Device::Whiteness, Device::Exposure, Device::AutoExposure })
+				command.add(DeviceCommand::param(code), get(code));
 			
-			_server.sendInfo(client, Message(Message::DEVICE | Message::PROPERTIES, command.str()));
+			_server.sendInfo(client, command.message(Message::DEVICE | Message::PROPERTIES));
 		}
 		else {
 			Device::Param code;
 			bool exist = false;
-			MessageFormat command(msg);
+			DeviceCommand command(message);
 			
 			// --- get one ---
-			code = command.valueOf<Device::Param>("code?", &exist);
+			code = command.valueOf<Device::Param>(DeviceCommand::CodeQuery, &exist);
 			if(exist) {
-				MessageFormat answer;
+				DeviceCommand answer(binary);
 				
-				answer.add("code", 	code);
-				answer.add("value",	get(code));
+				answer.add(DeviceCommand::Code, 	code);
+				answer.add(DeviceCommand::Value,	get(code));
 				
-				_server.sendInfo(client, Message(Message::DEVICE | Message::PROPERTIES, answer.str()));
+				_server.sendInfo(client, answer.message(Message::DEVICE | Message::PROPERTIES));
 				return;
 			}
 			
 			// --- set one ---
 			// Couple Code/Value
-			code = command.valueOf<Device::Param>("code", &exist);
+			code = command.valueOf<Device::Param>(DeviceCommand::Code, &exist);
 			if(exist) {
-				set(code, command.valueOf<double>("value"));
+				set(code, command.valueOf<double>(DeviceCommand::Value));
 				return;
 			}
 		}	
@@ -243,24 +311,97 @@ private:
 		if(msg == "refresh") {
 			refresh();
 		}
+		else if(msg == "local?") { // The client tries the shared memory, it is there only on this host
+			std::lock_guard<std::mutex> lockLocal(_mutLocal);
+			if(_local.opened()) {
+				_server.sendInfo(client, Message(Message::DEVICE | Message::TEXT, "local=" + _local.name() + "," + std::to_string(_localToken)));
+				_localClients[client.id()] = client;
+			}
+		}
+	}
+	void _treatReport(const Server::ClientInfo& client, const std::string& msg) {
+		ReceptionReport report;
+		if(!_adaptive || !report.read(msg))
+			return;
+		
+		// Frames dropped in the client's queue since its last report
+		const Server::DropCounters counters = _server.getDropCounters(client);
+		const uint64_t drops = counters.audio + counters.videoKey + counters.videoDelta;
+		
+		std::lock_guard<std::mutex> lockRate(_mutRate);
+		uint64_t& lastDrops = _drops[(uint64_t)client.id()];
+		
+		_rateController.update((uint64_t)client.id(), report, drops - lastDrops);
+		lastDrops = drops;
+		
+		Gb::Encoding encoding;
+		if(_rateController.target(encoding))
+			setEncoding(encoding);
+	}
+	
+	// "?", in any format
+	static bool _isQuery(const Message& message) {
+		return message.size() == 1 && message.content() && message.content()[0] == '?';
+	}
+	
+	// Copy of a callback, called out of the lock
+	template <typename F>
+	F _callback(const F& cbk) const {
+		std::lock_guard<std::mutex> lockCbk(_mutCbk);
+		return cbk;
+	}
+	
+	// Only H264 has frames depending on the previous ones: look for an IDR or SPS nal unit (annex B)
+	static bool _isKeyFrame(const Gb::Frame& frame) {
+		if(frame.type != Gb::FrameType::H264)
+			return true;
+		
+		const unsigned char* data = frame.start();
+		const size_t len = frame.length();
+		
+		for(size_t i = 0; i + 3 < len; i++) {
+			if(data[i] != 0 || data[i+1] != 0 || data[i+2] != 1)
+				continue;
+			
+			const unsigned char nalType = data[i+3] & 0x1F;
+			if(nalType == 5 || nalType == 7)
+				return true;
+			
+			i += 2;
+		}
+		
+		return false;
 	}
 	
 	
 	// -- Members --
+	static const size_t LOCAL_SLOTS 	= 8;
+	static const size_t LOCAL_SLOT_SIZE = 8 * 1024 * 1024; // A bgr24 1080p frame
+	
 	int _port;
 	std::string _pathDest;
 	
 	Server _server;
 	DeviceMt _device;
 	
+	std::atomic<bool> _adaptive;
+	std::mutex _mutRate;
+	RateController _rateController;
+	std::map<uint64_t, uint64_t> _drops; // Last counts by client id
+	
+	std::mutex _mutLocal;
+	bool _localSharing;
+	size_t _localSlots;
+	size_t _localSlotSize;
+	SharedRing _local;
+	uint64_t _localToken;
+	std::map<SOCKET, Server::ClientInfo> _localClients; // Told to read the shared memory
+	
 	mutable std::mutex _mutCbk;
 	std::function<void(const Error& error)> _cbkError;	
 	std::function<void(const Gb::Frame&)> _cbkFrame;
 	std::function<void(void)> _cbkOpen;
 	
-	std::map<SOCKET, bool> _clientPlayer;
-	
-	std::future<void> _futureFrame;
-	std::future<void> _futureOpen;
+	Dispatcher _dispatcher;
 };
 
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// ------------------- BufferPool : the memory of the messages, recycled -------------------
+// A free list by size class (powers of 2). Bigger buffers are allocated each time.
+class BufferPool {
+public:
+	// Constants
+	static const size_t MIN_CLASS 		= 8; 		// 256 B
+	static const size_t MAX_CLASS 		= 24; 		// 16 MB
+	static const size_t MIN_FREE 		= 4; 		// Buffers kept by class, at least
+	static const size_t MAX_FREE_BYTES 	= 32 << 20; // Bytes kept by class, above the minimum
+	
+	// Never destroyed: messages may be released late, by static or thread local objects
+	static BufferPool& shared() {
+		static BufferPool* pPool = new BufferPool();
+		return *pPool;
+	}
+	
+	// Methods
+	// At least 'size' bytes, 'capacity' is filled with the real size
+	char* acquire(const size_t size, size_t& capacity) {
+		const size_t iClass = _class(size);
+		if(iClass > MAX_CLASS) {
+			capacity = size;
+			_nAllocations++;
+			return new char[size];
+		}
+		
+		capacity = (size_t)1 << iClass;
+		_Class& sizeClass = _classes[iClass - MIN_CLASS];
+		{
+			std::lock_guard<std::mutex> lockClass(sizeClass.mut);
+			if(!sizeClass.free.empty()) {
+				char* buffer = sizeClass.free.back();
+				sizeClass.free.pop_back();
+				return buffer;
+			}
+		}
+		
+		_nAllocations++;
+		return new char[capacity];
+	}
+	void release(char* buffer, const size_t capacity) {
+		if(!buffer)
+			return;
+		
+		const size_t iClass = _class(capacity);
+		if(iClass <= MAX_CLASS && capacity == ((size_t)1 << iClass)) {
+			_Class& sizeClass = _classes[iClass - MIN_CLASS];
+			std::lock_guard<std::mutex> lockClass(sizeClass.mut);
+			
+			if(sizeClass.free.size() < MIN_FREE || (sizeClass.free.size() + 1) * capacity <= MAX_FREE_BYTES) {
+				sizeClass.free.push_back(buffer);
+				return;
+			}
+		}
+		delete[] buffer;
+	}
+	
+	// Size really given for 'size'
+	static size_t capacityOf(const size_t size) {
+		const size_t iClass = _class(size);
+		return iClass > MAX_CLASS ? size : ((size_t)1 << iClass);
+	}
+	
+	// Getters
+	uint64_t allocations() const { // Buffers not found in the free lists
+		return _nAllocations;
+	}
+	
+private:
+	struct _Class {
+		std::mutex mut;
+		std::vector<char*> free;
+	};
+	
+	BufferPool() : _nAllocations(0) {
+	}
+	
+	static size_t _class(const size_t size) {
+		size_t iClass = MIN_CLASS;
+		while(iClass <= MAX_CLASS && ((size_t)1 << iClass) < size)
+			iClass++;
+		return iClass;
+	}
+	
+	// Members
+	_Class _classes[MAX_CLASS - MIN_CLASS + 1];
+	std::atomic<uint64_t> _nAllocations;
+};
+
+// A buffer of the pool, given back when destroyed
+class PooledBuffer {
+public:
+	PooledBuffer() : _data(nullptr), _capacity(0) {
+	}
+	explicit PooledBuffer(const size_t size) : _data(nullptr), _capacity(0) {
+		_data = BufferPool::shared().acquire(size, _capacity);
+	}
+	PooledBuffer(PooledBuffer&& other) : _data(other._data), _capacity(other._capacity) {
+		other._data 	= nullptr;
+		other._capacity = 0;
+	}
+	PooledBuffer& operator=(PooledBuffer&& other) {
+		if(this != &other) {
+			BufferPool::shared().release(_data, _capacity);
+			_data 			= other._data;
+			_capacity 		= other._capacity;
+			other._data 	= nullptr;
+			other._capacity = 0;
+		}
+		return *this;
+	}
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+	
+	~PooledBuffer() {
+		BufferPool::shared().release(_data, _capacity);
+	}
+	
+	// Getters
+	char* data() const {
+		return _data;
+	}
+	size_t capacity() const {
+		return _capacity;
+	}
+	
+private:
+	char* _data;
+	size_t _capacity;
+};
+
+// Allocator on the pool, for the objects following the messages (shared pointers, queues, tasks)
+template <typename T>
+struct PoolAllocator {
+	typedef T value_type;
+	
+	PoolAllocator() {
+	}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U>&) {
+	}
+	
+	T* allocate(const size_t n) {
+		size_t capacity = 0;
+		return reinterpret_cast<T*>(BufferPool::shared().acquire(n * sizeof(T), capacity));
+	}
+	void deallocate(T* p, const size_t n) {
+		BufferPool::shared().release(reinterpret_cast<char*>(p), BufferPool::capacityOf(n * sizeof(T)));
+	}
+	
+	template <typename U>
+	bool operator==(const PoolAllocator<U>&) const {
+		return true;
+	}
+	template <typename U>
+	bool operator!=(const PoolAllocator<U>&) const {
+		return false;
+	}
+};
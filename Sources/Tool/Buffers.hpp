@@ -1,88 +1,230 @@
 #pragma once
 
 #include <iostream>
-#include <deque>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <cstdint>
 
 #include "../Network/Message.hpp"
+#include "Timer.hpp"
 
-// Buffer
+// ------------------- RingBuffer : bounded, one producer -------------------
+// The producer never waits for the reader: when full, the oldest element is replaced.
+// Pops claim their slot, so they can come from any thread (a clear from another thread).
+// The reader can sleep until something is pushed.
 template <typename T>
-class VirtualBuffer {
+class RingBuffer {
 public:
-	void lock() const {
-		mut.lock();
+	static const size_t CACHE_LINE = 64;
+	
+	// Constructors
+	// The capacity is rounded up to a power of 2
+	explicit RingBuffer(const size_t capacity = 16) :
+		_capacity(_round(capacity)),
+		_mask(_capacity - 1),
+		_slots(new _Slot[_capacity])
+	{
+		for(size_t i = 0; i < _capacity; i++)
+			_slots[i].seq.store(i, std::memory_order_relaxed);
+		
+		_head.value.store(0, std::memory_order_relaxed);
+		_tail.value.store(0, std::memory_order_relaxed);
+		_dropped.value.store(0, std::memory_order_relaxed);
+		_sleeping.value.store(0, std::memory_order_relaxed);
 	}
-	void unlock() const {
-		mut.unlock();
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator=(const RingBuffer&) = delete;
+	
+	// Methods
+	// [Producer only]
+	void push(T t) {
+		const uint64_t tail = _tail.value.load(std::memory_order_relaxed);
+		_Slot& slot = _slots[tail & _mask];
+		
+		for(;;) {
+			uint64_t head = _head.value.load(std::memory_order_acquire);
+			
+			if(tail - head < _capacity) {
+				// A reader may still be moving the previous element out
+				while(slot.seq.load(std::memory_order_acquire) != tail)
+					std::this_thread::yield();
+				break;
+			}
+			
+			// Full: take the oldest from the readers, its slot is the one to write
+			if(_head.value.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel)) {
+				_dropped.value.fetch_add(1, std::memory_order_relaxed);
+				break;
+			}
+		}
+		
+		slot.value = std::move(t);
+		slot.seq.store(tail + 1, std::memory_order_release);
+		_tail.value.store(tail + 1, std::memory_order_seq_cst);
+		
+		// Wake a reader
+		if(_sleeping.value.load(std::memory_order_seq_cst) > 0) {
+			std::lock_guard<std::mutex> lockSleep(_mutSleep);
+			_cvSleep.notify_all();
+		}
 	}
-	size_t size() const {
-		return buffer.size();
-	}	
 	
-	virtual bool update(T& t) = 0;
+	// Return false if empty
+	bool pop(T& t) {
+		for(;;) {
+			uint64_t head = _head.value.load(std::memory_order_acquire);
+			if(head == _tail.value.load(std::memory_order_acquire))
+				return false;
+			
+			if(_head.value.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel)) {
+				_Slot& slot = _slots[head & _mask];
+				t = std::move(slot.value);
+				slot.seq.store(head + _capacity, std::memory_order_release);
+				return true;
+			}
+		}
+	}
 	
-	void pop() {
-		buffer.pop_front();
-		times.pop_front();	
+	// Pop, sleeping until something comes. Return false after the timeout (< 0 : none) or a wake().
+	bool wait(T& t, const int timeoutMs = -1) {
+		if(pop(t))
+			return true;
+		
+		const uint64_t generation = _generation.load();
+		std::unique_lock<std::mutex> lockSleep(_mutSleep);
+		_sleeping.value.fetch_add(1, std::memory_order_seq_cst);
+		
+		auto ready = [&]() {
+			return !empty() || _generation != generation;
+		};
+		if(timeoutMs < 0)
+			_cvSleep.wait(lockSleep, ready);
+		else
+			_cvSleep.wait_for(lockSleep, std::chrono::milliseconds(timeoutMs), ready);
+		
+		_sleeping.value.fetch_sub(1, std::memory_order_seq_cst);
+		lockSleep.unlock();
+		
+		return pop(t);
 	}
 	
-	void push(const T& t, const uint64_t& time) {
-		buffer.push_back(t);
-		times.push_back(time);
+	// Release the readers waiting
+	void wake() {
+		std::lock_guard<std::mutex> lockSleep(_mutSleep);
+		_generation.fetch_add(1);
+		_cvSleep.notify_all();
 	}
 	
 	void clear() {
-		buffer.clear();
-		times.clear();
+		T t;
+		while(pop(t));
+	}
+	
+	// Getters
+	size_t size() const {
+		const uint64_t head = _head.value.load(std::memory_order_acquire);
+		const uint64_t tail = _tail.value.load(std::memory_order_seq_cst); // Against push(), before the reader sleeps
+		return tail > head ? (size_t)(tail - head) : 0;
+	}
+	bool empty() const {
+		return size() == 0;
+	}
+	size_t capacity() const {
+		return _capacity;
+	}
+	// Elements replaced before being read
+	uint64_t dropped() const {
+		return _dropped.value.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct alignas(CACHE_LINE) _Slot {
+		std::atomic<uint64_t> seq; // == position : free to write, == position+1 : to read
+		T value;
+	};
+	struct alignas(CACHE_LINE) _Index {
+		std::atomic<uint64_t> value;
+	};
+	
+	static size_t _round(const size_t capacity) {
+		size_t n = 1;
+		while(n < capacity)
+			n <<= 1;
+		return n;
 	}
 	
-protected:
-	mutable std::mutex mut;
-	std::deque<T> buffer;
-	std::deque<uint64_t> times;
+	// Members
+	const size_t _capacity;
+	const size_t _mask;
+	std::unique_ptr<_Slot[]> _slots;
 	
-	Timer timer;
-	int64_t timeToWait = 0;
+	_Index _head; // Next to read
+	_Index _tail; // Next to write
+	_Index _dropped;
+	_Index _sleeping;
+	
+	std::mutex _mutSleep;
+	std::condition_variable _cvSleep;
+	std::atomic<uint64_t> _generation{0}; // Changed by wake()
 };
 
 // --- For datas ---
-class DataBuffer : public VirtualBuffer<MessageFormat> {	
+// Given at the pace they were pushed
+class DataBuffer {
 public:
+	explicit DataBuffer(const size_t capacity = 16) :
+		_ring(capacity),
+		_lastTime(0),
+		_timeToWait(0)
+	{
+	}
+	
+	void push(const MessageFormat& message, const uint64_t time) {
+		_ring.push(std::make_pair(message, time));
+	}
 	bool update(MessageFormat& message) {
-		if(size() > 0) {			
-			if(timer.elapsed_mus() >= timeToWait ) {
-				timer.beg();
-				
-				// Change messag disp
-				message = buffer.front();
-				timeToWait = 1000*((int64_t)times[1] - (int64_t)times[0])/2;
-				
-				// Change buffer
-				pop();
-				
-				return !message.str().empty();
-			}
-		}	
-		return false;
+		if(_timer.elapsed_mus() < _timeToWait)
+			return false;
+		
+		std::pair<MessageFormat, uint64_t> entry;
+		if(!_ring.pop(entry))
+			return false;
+		
+		_timer.beg();
+		_timeToWait = _lastTime > 0 && entry.second > _lastTime ? 1000*(int64_t)(entry.second - _lastTime)/2 : 0;
+		_lastTime = entry.second;
+		
+		message = entry.first;
+		return !message.str().empty();
+	}
+	void clear() {
+		_ring.clear();
 	}
+	size_t size() const {
+		return _ring.size();
+	}
+
+private:
+	RingBuffer<std::pair<MessageFormat, uint64_t>> _ring;
+	Timer _timer;
+	uint64_t _lastTime;
+	int64_t _timeToWait;
 };
 
 // --- For message ---
-class MsgBuffer : public VirtualBuffer<Message> {	
+class MsgBuffer : public RingBuffer<Message> {
 public:
+	explicit MsgBuffer(const size_t capacity = 16) :
+		RingBuffer<Message>(capacity)
+	{
+	}
+	
 	bool update(Message& message) {
-		if(size() > 0) {			
-			// Change messag disp
-			message = buffer.front();
-			
-			// Change buffer
-			pop();
-			
-			return !message.str().empty();
-		}
-		return false;
+		return pop(message) && !message.str().empty();
 	}
 };
 
-
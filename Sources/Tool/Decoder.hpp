@@ -57,6 +57,10 @@ public:
 		) >= 0;
 	}	
 	bool decode2bgr24(const std::vector<unsigned char>& dataIn, std::vector<unsigned char>& dataOut, int width, int height) {
+		return decode2bgr24(dataIn.data(), dataIn.size(), dataOut, width, height);
+	}
+	// Read in place: shared memory, network buffer
+	bool decode2bgr24(const unsigned char* dataIn, const size_t lenIn, std::vector<unsigned char>& dataOut, int width, int height) {
 		if(!_jpgDecompressor)
 			return false;
 		
@@ -66,7 +70,7 @@ public:
 		
 		return tjDecompress2 (
 			_jpgDecompressor, 
-			dataIn.data(), (int)dataIn.size(), 
+			dataIn, (int)lenIn, 
 			&dataOut[0], 
 			width, 0, height, 
 			TJPF_BGR, TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE
@@ -114,7 +118,11 @@ public:
 	}
 	
 	bool decode(const std::vector<unsigned char>& dataIn, std::vector<unsigned char>& dataOut, int* pWidth = nullptr, int* pHeight = nullptr) {
-		return _decodeH264(dataIn, dataOut, pWidth, pHeight);
+		return _decodeH264(dataIn.data(), dataIn.size(), dataOut, pWidth, pHeight);
+	}
+	// Read in place: shared memory, network buffer
+	bool decode(const unsigned char* dataIn, const size_t lenIn, std::vector<unsigned char>& dataOut, int* pWidth = nullptr, int* pHeight = nullptr) {
+		return _decodeH264(dataIn, lenIn, dataOut, pWidth, pHeight);
 	}
 	
 private:
@@ -141,7 +149,7 @@ private:
 		_decoder = nullptr;
 	}
 	
-	bool _decodeH264(const std::vector<unsigned char>& dataIn, std::vector<unsigned char>& dataOut, int* pWidth = nullptr, int* pHeight = nullptr) {
+	bool _decodeH264(const unsigned char* dataIn, const size_t lenIn, std::vector<unsigned char>& dataOut, int* pWidth = nullptr, int* pHeight = nullptr) {
 		if(!_decoder)
 			return false;
 		
@@ -152,7 +160,7 @@ private:
 		SBufferInfo decInfo;
 		memset(&decInfo, 0, sizeof (SBufferInfo));
 		
-		int err = _decoder->DecodeFrame2 (&dataIn[0], (int)dataIn.size(), yuvDecode, &decInfo);
+		int err = _decoder->DecodeFrame2 (dataIn, (int)lenIn, yuvDecode, &decInfo);
 		if(err == 0 && decInfo.iBufferStatus == 1) {					
 			int oStride = decInfo.UsrData.sSystemBuffer.iStride[0];
 			int oWidth 	= decInfo.UsrData.sSystemBuffer.iWidth;
@@ -94,7 +94,7 @@ private:
 
 class EncoderH264 {
 public:	
-	EncoderH264() : _width(0), _height(0), _flagRefresh(false), _encoder(nullptr)
+	EncoderH264() : _width(0), _height(0), _flagRefresh(false), _flagRate(false), _bitrate(1000000), _frameRate(30.0f), _encoder(nullptr)
 	{
 		
 	}
@@ -141,6 +141,16 @@ public:
 		_flagRefresh = true;
 	}
 	
+	// Applied without re-initialization, before the next frame encoded
+	void setBitrate(int bitrate) {
+		_bitrate = bitrate;
+		_flagRate = true;
+	}
+	void setFrameRate(float frameRate) {
+		_frameRate = frameRate;
+		_flagRate = true;
+	}
+	
 private:
 	// Methods
 	bool _setupEncoder() {
@@ -160,9 +170,10 @@ private:
 		encoderParemeters.iComplexityMode 				= LOW_COMPLEXITY; // LOW_, MEDIUM_, HIGH_
 		encoderParemeters.bEnableFrameCroppingFlag = true;
 
-		encoderParemeters.iRCMode = RC_QUALITY_MODE;
-		encoderParemeters.iMinQp 	= 30;
-		encoderParemeters.iMaxQp 	= 40;
+		// The bitrate decides of the quality: it follows the bandwidth
+		encoderParemeters.iRCMode = RC_BITRATE_MODE;
+		encoderParemeters.iMinQp 	= 20;
+		encoderParemeters.iMaxQp 	= 45;
 
 		encoderParemeters.bEnableBackgroundDetection 	= false;
 		encoderParemeters.bEnableFrameSkip 				= true;
@@ -176,9 +187,10 @@ private:
 		
 		encoderParemeters.iPicWidth 			= spartialLayerConfiguration->iVideoWidth 			= _width;
 		encoderParemeters.iPicHeight 		= spartialLayerConfiguration->iVideoHeight 			= _height;
-		encoderParemeters.fMaxFrameRate 	= spartialLayerConfiguration->fFrameRate 			= 30.0f;
-		encoderParemeters.iTargetBitrate 	= spartialLayerConfiguration->iSpatialBitrate 	= 1000000;
-		encoderParemeters.iTargetBitrate 	= spartialLayerConfiguration->iMaxSpatialBitrate = 1000000;
+		encoderParemeters.fMaxFrameRate 	= spartialLayerConfiguration->fFrameRate 			= _frameRate;
+		encoderParemeters.iTargetBitrate 	= spartialLayerConfiguration->iSpatialBitrate 	= _bitrate;
+		encoderParemeters.iMaxBitrate 		= spartialLayerConfiguration->iMaxSpatialBitrate = _bitrate;
+		_flagRate = false;
 		
 		// Color space
 		int videoFormat = videoFormatI420;
@@ -225,6 +237,12 @@ private:
 		if(!_encoder)
 			return false;
 		
+		// New rate asked
+		if(_flagRate) {
+			_flagRate = false;
+			_setRate();
+		}
+		
 		// Info about encoding result
 		SFrameBSInfo encInfo;
 		memset (&encInfo, 0, sizeof(SFrameBSInfo));
@@ -253,10 +271,26 @@ private:
 		return false;
 	}
 	
+	void _setRate() {
+		float frameRate = _frameRate;
+		_encoder->SetOption(ENCODER_OPTION_FRAME_RATE, &frameRate);
+		
+		// The maximum is never below the target
+		SBitrateInfo bitrate;
+		bitrate.iLayer 	= SPATIAL_LAYER_ALL;
+		bitrate.iBitrate 	= _bitrate;
+		
+		_encoder->SetOption(ENCODER_OPTION_MAX_BITRATE, &bitrate);
+		_encoder->SetOption(ENCODER_OPTION_BITRATE, &bitrate);
+	}
+	
 	// Members
 	int _width;
 	int _height;
 	std::atomic<bool> _flagRefresh;
+	std::atomic<bool> _flagRate;
+	std::atomic<int> _bitrate;
+	std::atomic<float> _frameRate;
 	ISVCEncoder* _encoder;
 	
 	SSourcePicture _pic;
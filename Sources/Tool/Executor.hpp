@@ -0,0 +1,400 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "BufferPool.hpp"
+
+// ------------------- Executor : where the callbacks run -------------------
+// Tasks posted with the same key run one at a time, in the order they were posted.
+// Key 0 : no order.
+class Executor {
+public:
+	typedef std::function<void(void)> Task;
+	
+	virtual ~Executor() {
+	}
+	
+	// Methods
+	void post(Task task, const uint64_t key = 0) {
+		if(key == 0)
+			return _submit(std::move(task));
+		
+		{
+			std::lock_guard<std::mutex> lockStrands(_mutStrands);
+			_Strand& strand = _strands[key];
+			strand.tasks.push_back(std::move(task));
+			
+			if(strand.running) // Its runner will take it
+				return;
+			strand.running = true;
+		}
+		
+		_submit([this, key]() {
+			this->_runStrand(key);
+		});
+	}
+	
+	// Instances
+	static std::shared_ptr<Executor> inlined();
+	static std::shared_ptr<Executor> pool(size_t nThreads = 0);
+	static std::shared_ptr<Executor> stealing(size_t nThreads = 0);
+	
+	// Used by default: a pool with a thread by core
+	static std::shared_ptr<Executor> shared() {
+		static std::shared_ptr<Executor> pShared = pool();
+		return pShared;
+	}
+
+protected:
+	// Run the task, now or later
+	virtual void _submit(Task task) = 0;
+	
+	static size_t _count(size_t nThreads) {
+		if(nThreads > 0)
+			return nThreads;
+		
+		const size_t nCores = std::thread::hardware_concurrency();
+		return nCores > 0 ? nCores : 2;
+	}
+
+private:
+	struct _Strand {
+		bool running = false;
+		std::deque<Task> tasks;
+	};
+	
+	// A few tasks of the key, then the others get a turn
+	void _runStrand(const uint64_t key) {
+		const int MAX_TASKS = 16;
+		const size_t MAX_STRANDS = 256;
+		
+		for(int i = 0; i < MAX_TASKS; i++) {
+			Task task;
+			{
+				std::lock_guard<std::mutex> lockStrands(_mutStrands);
+				_Strand& strand = _strands[key];
+				
+				if(strand.tasks.empty()) {
+					strand.running = false;
+					
+					// Kept for the next tasks of the key, unless too many are idle
+					if(_strands.size() > MAX_STRANDS)
+						_strands.erase(key);
+					return;
+				}
+				task = std::move(strand.tasks.front());
+				strand.tasks.pop_front();
+			}
+			task();
+		}
+		
+		_submit([this, key]() {
+			this->_runStrand(key);
+		});
+	}
+	
+	// Members
+	std::mutex _mutStrands;
+	std::unordered_map<uint64_t, _Strand> _strands;
+};
+
+
+// ---- Inline : in the thread posting ----
+class InlineExecutor : public Executor {
+protected:
+	void _submit(Task task) override {
+		task();
+	}
+};
+
+
+// ---- Pool : threads sharing one queue ----
+class PoolExecutor : public Executor {
+public:
+	explicit PoolExecutor(size_t nThreads = 0) : _running(true) {
+		const size_t n = _count(nThreads);
+		
+		for(size_t i = 0; i < n; i++)
+			_workers.push_back(std::thread(&PoolExecutor::_work, this));
+	}
+	~PoolExecutor() {
+		{
+			std::lock_guard<std::mutex> lockTasks(_mutTasks);
+			_running = false;
+		}
+		_cv.notify_all();
+		
+		for(std::thread& thread : _workers)
+			if(thread.joinable())
+				thread.join();
+	}
+
+protected:
+	void _submit(Task task) override {
+		{
+			std::lock_guard<std::mutex> lockTasks(_mutTasks);
+			_tasks.push_back(std::move(task));
+		}
+		_cv.notify_one();
+	}
+
+private:
+	// Until stopped and nothing is left
+	void _work() {
+		for(;;) {
+			Task task;
+			{
+				std::unique_lock<std::mutex> lockTasks(_mutTasks);
+				_cv.wait(lockTasks, [this]() {
+					return !_tasks.empty() || !_running;
+				});
+				
+				if(_tasks.empty())
+					return;
+				
+				task = std::move(_tasks.front());
+				_tasks.pop_front();
+			}
+			task();
+		}
+	}
+	
+	// Members
+	bool _running;
+	std::mutex _mutTasks;
+	std::condition_variable _cv;
+	std::deque<Task> _tasks;
+	std::vector<std::thread> _workers;
+};
+
+
+// ---- Work stealing : a queue by thread, an idle thread takes the oldest tasks of the others ----
+// Tasks posted by a worker stay in its queue.
+class StealingExecutor : public Executor {
+public:
+	explicit StealingExecutor(size_t nThreads = 0) : _running(true), _pending(0), _next(0) {
+		const size_t n = _count(nThreads);
+		
+		for(size_t i = 0; i < n; i++)
+			_queues.push_back(std::unique_ptr<_Queue>(new _Queue()));
+		for(size_t i = 0; i < n; i++)
+			_workers.push_back(std::thread(&StealingExecutor::_work, this, i));
+	}
+	~StealingExecutor() {
+		{
+			std::lock_guard<std::mutex> lockIdle(_mutIdle);
+			_running = false;
+		}
+		_cv.notify_all();
+		
+		for(std::thread& thread : _workers)
+			if(thread.joinable())
+				thread.join();
+	}
+
+protected:
+	void _submit(Task task) override {
+		// A worker keeps its tasks, the others are spread
+		const size_t iQueue = (_worker().first == this) ? _worker().second : (_next++ % _queues.size());
+		{
+			std::lock_guard<std::mutex> lockQueue(_queues[iQueue]->mut);
+			_queues[iQueue]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lockIdle(_mutIdle);
+			_pending++;
+		}
+		_cv.notify_one();
+	}
+
+private:
+	struct _Queue {
+		std::mutex mut;
+		std::deque<Task> tasks;
+	};
+	
+	// Executor and queue of the calling thread
+	static std::pair<const StealingExecutor*, size_t>& _worker() {
+		static thread_local std::pair<const StealingExecutor*, size_t> worker(nullptr, 0);
+		return worker;
+	}
+	
+	// Own queue from the newest, the others from the oldest
+	bool _take(const size_t iQueue, Task& task) {
+		for(size_t i = 0; i < _queues.size(); i++) {
+			_Queue& queue = *_queues[(iQueue + i) % _queues.size()];
+			std::lock_guard<std::mutex> lockQueue(queue.mut);
+			
+			if(queue.tasks.empty())
+				continue;
+			
+			if(i == 0) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			else {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+			return true;
+		}
+		return false;
+	}
+	
+	void _work(const size_t iQueue) {
+		_worker() = std::make_pair(this, iQueue);
+		
+		for(;;) {
+			{
+				std::unique_lock<std::mutex> lockIdle(_mutIdle);
+				_cv.wait(lockIdle, [this]() {
+					return _pending > 0 || !_running;
+				});
+				
+				if(_pending == 0)
+					return;
+				_pending--;
+			}
+			
+			// One task is there for this wake up, maybe taken by someone else meanwhile: look again
+			Task task;
+			while(!_take(iQueue, task))
+				std::this_thread::yield();
+			task();
+		}
+	}
+	
+	// Members
+	bool _running;
+	size_t _pending; // Tasks not taken yet
+	std::atomic<size_t> _next;
+	
+	std::mutex _mutIdle;
+	std::condition_variable _cv;
+	std::vector<std::unique_ptr<_Queue>> _queues;
+	std::vector<std::thread> _workers;
+};
+
+
+// -- Instances --
+inline std::shared_ptr<Executor> Executor::inlined() {
+	return std::make_shared<InlineExecutor>();
+}
+inline std::shared_ptr<Executor> Executor::pool(size_t nThreads) {
+	return std::make_shared<PoolExecutor>(nThreads);
+}
+inline std::shared_ptr<Executor> Executor::stealing(size_t nThreads) {
+	return std::make_shared<StealingExecutor>(nThreads);
+}
+
+
+// ------------------- Dispatcher : the callbacks of one object -------------------
+// Callbacks with the same key are ordered, and they are all done before the dispatcher dies.
+class Dispatcher {
+public:
+	explicit Dispatcher(const std::shared_ptr<Executor>& pExecutor = Executor::shared()) :
+		_pExecutor(pExecutor),
+		_id(_nextId()),
+		_pending(0)
+	{
+	}
+	~Dispatcher() {
+		wait();
+	}
+	
+	// Methods
+	// Nothing is done if the callback is empty
+	template <typename F, typename... Args>
+	void post(const uint64_t key, const F& callback, Args&&... args) {
+		if(!callback)
+			return;
+		
+		{
+			std::lock_guard<std::mutex> lockPending(_mutPending);
+			_pending++;
+		}
+		
+		// Callback and arguments copied once, in a call from the pool: the task is only a pointer, without allocation
+		typedef decltype(std::bind(callback, std::forward<Args>(args)...)) Bound;
+		
+		PoolAllocator<_Call<Bound>> allocator;
+		_Call<Bound>* pCall = allocator.allocate(1);
+		new (pCall) _Call<Bound>(this, std::bind(callback, std::forward<Args>(args)...));
+		
+		_executor()->post([pCall]() {
+			_run(pCall);
+		}, _key(key));
+	}
+	
+	// Until every callback posted is done
+	void wait() {
+		std::unique_lock<std::mutex> lockPending(_mutPending);
+		_cvPending.wait(lockPending, [this]() {
+			return _pending == 0;
+		});
+	}
+	
+	// Setters
+	void setExecutor(const std::shared_ptr<Executor>& pExecutor) {
+		std::lock_guard<std::mutex> lockExecutor(_mutExecutor);
+		_pExecutor = pExecutor ? pExecutor : Executor::shared();
+	}
+
+private:
+	template <typename Bound>
+	struct _Call {
+		_Call(Dispatcher* dispatcher, Bound&& b) : pDispatcher(dispatcher), bound(std::move(b)) {
+		}
+		
+		Dispatcher* pDispatcher;
+		Bound bound;
+	};
+	
+	// Every task posted runs once: the call is released there
+	template <typename Bound>
+	static void _run(_Call<Bound>* pCall) {
+		Dispatcher* pDispatcher = pCall->pDispatcher;
+		pCall->bound();
+		
+		pCall->~_Call<Bound>();
+		PoolAllocator<_Call<Bound>>().deallocate(pCall, 1);
+		
+		std::lock_guard<std::mutex> lockPending(pDispatcher->_mutPending);
+		if(--pDispatcher->_pending == 0)
+			pDispatcher->_cvPending.notify_all();
+	}
+	
+	std::shared_ptr<Executor> _executor() {
+		std::lock_guard<std::mutex> lockExecutor(_mutExecutor);
+		return _pExecutor;
+	}
+	
+	// Keys of different dispatchers don't meet
+	uint64_t _key(const uint64_t key) const {
+		const uint64_t mixed = (_id * 0x9E3779B97F4A7C15ULL) ^ key;
+		return mixed != 0 ? mixed : 1;
+	}
+	static uint64_t _nextId() {
+		static std::atomic<uint64_t> nextId(1);
+		return nextId++;
+	}
+	
+	// Members
+	std::mutex _mutExecutor;
+	std::shared_ptr<Executor> _pExecutor;
+	const uint64_t _id;
+	
+	std::mutex _mutPending;
+	std::condition_variable _cvPending;
+	size_t _pending;
+};
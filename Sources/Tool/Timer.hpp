@@ -42,6 +42,16 @@ public:
 		return static_cast<uint64_t>(std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()).time_since_epoch().count());
 	}
 
+	// System clock, as the kernel timestamps of the packets
+	static uint64_t realtimeMus() {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	}
+
+	// Steady clock, for durations between machines which aren't synchronized
+	static uint64_t monotonicMus() {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
 	static void wait(int ms) {
 		if(ms > 0)
 			std::this_thread::sleep_for(std::chrono::milliseconds(ms));
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
 
+#include "Timer.hpp"
 #include "Decoder.hpp"
 #include "Encoder.hpp"
 
@@ -9,7 +11,7 @@
 
 class Translator {
 public:
-	Translator() {
+	Translator() : _frameRate(30.0f), _jpgQuality(30), _nextFrameMus(0) {
 	}
 	~Translator() {
 		cleanup();
@@ -25,6 +27,13 @@ public:
 	void refresh() {
 		_encoderH264.refresh();
 	}
+	void setEncoding(const Gb::Encoding& encoding) {
+		_encoderH264.setBitrate(encoding.bitrate);
+		_encoderH264.setFrameRate(encoding.frameRate);
+		
+		_frameRate 	= encoding.frameRate;
+		_jpgQuality = encoding.jpgQuality;
+	}
 	bool cleanup() {
 		_encoderH264.cleanup();
 		_encoderJpg.cleanup();
@@ -41,6 +50,12 @@ public:
 		int h = rawFrame.size.height;
 		int area = w*h;
 		
+		// -- Frame rate: skip the frames coming too early
+		if(_skipFrame()) {
+			frame.clear();
+			return false;
+		}
+		
 		// -- From jpg to h264: (Brief stop at YUV422 and YUV420 step)
 		if(frame.type == Gb::FrameType::H264 || frame.type == Gb::FrameType::Yuv422 || frame.type == Gb::FrameType::Yuv420) {
 			// jpg decompress : jpg422 -> yuv422
@@ -74,7 +89,7 @@ public:
 			// jpg decompress : jpg422 -> bgr24
 			if(_decoderJpg.decode2bgr24(rawFrame.buffer, bgrBuffer, w, h)) {
 				// jpg compress : bgr24 -> jpg420
-				if(_encoderJpg.encodeBgr24(bgrBuffer, frame.buffer, w, h, 30)) {
+				if(_encoderJpg.encodeBgr24(bgrBuffer, frame.buffer, w, h, _jpgQuality)) {
 					success = true;
 				}
 			}
@@ -115,6 +130,27 @@ End_Translation:
 	}
 	
 private:
+	// A frame is kept when it is closer to its expected time than to the next one
+	bool _skipFrame() {
+		if(_frameRate <= 0.0f)
+			return false;
+		
+		const int64_t interval 	= (int64_t)(1e6 / _frameRate);
+		const int64_t now 		= _clock.clock_mus();
+		
+		if(now + interval/2 < _nextFrameMus)
+			return true;
+		
+		// Late by more than half a frame: new reference
+		_nextFrameMus = (_nextFrameMus > now - interval/2) ? _nextFrameMus + interval : now + interval/2;
+		return false;
+	}
+	
+	std::atomic<float> _frameRate;
+	std::atomic<int> _jpgQuality;
+	Timer _clock;
+	int64_t _nextFrameMus;
+	
 	std::vector<unsigned char> _yuv422Frame;
 	std::vector<unsigned char> _yuv420Frame;
 	EncoderH264 _encoderH264;
@@ -100,7 +100,7 @@ int main() {
 			bufferAudio.unlock();
 		}
 
-		if (message.code() == Message::VIDEO) {
+		if (message.code() & Message::VIDEO) {
 			// Store message
 			bufferVideo.lock();
 			bufferVideo.push(message, message.timestamp());
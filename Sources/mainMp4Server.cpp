@@ -59,9 +59,7 @@ void loopSoundSend(Server* pServer, snd_pcm_t** pCapture, const int BUF_SIZE) {
 				
 		// Send buffer
 		mutServer.lock();
-		for(auto& client : pServer->getClients()) {
-			pServer->sendData(client, Message(Message::SOUND, &buf_8[0], BUF_SIZE, timestamp));
-		}
+		pServer->broadcastData(Message::SOUND, &buf_8[0], BUF_SIZE, timestamp);
 		mutServer.unlock();
 	}
 }
@@ -80,9 +78,7 @@ void loopVideoSend(Server* pServer, Device* pDevice) {
 		uint64_t timestamp = (uint64_t)relTime; // Round
 			
 		mutServer.lock();
-		for(auto& client : pServer->getClients()) {
-			pServer->sendData(client, Message(Message::VIDEO, (char*)frame.start(), frame.length(), timestamp));
-		}	
+		pServer->broadcastData(Message::VIDEO | Message::KEY_FRAME, (char*)frame.start(), frame.length(), timestamp); // Jpg only
 		mutServer.unlock();
 	}
 }
@@ -111,6 +107,10 @@ int main (int argc, char *argv[]) {
 	// -- Network
 	Server server;
 	
+	server.onClientConnect([&](const Server::ClientInfo& client) {
+		server.subscribe(client);
+	});
+	
 	server.onInfo([&](const Server::ClientInfo& client, const Message& message) {
 		if(message.code() == (Message::FORMAT | Message::SOUND)) {
 			MessageFormat cmd;
@@ -13,7 +13,7 @@ Sources/mainServer.cpp Sources/GPIO/Gpio.cpp Sources/GPIO/ManagerGpio.cpp  \
 -I/usr/local/include \
 -L/usr/lib  \
 -L/usr/local/lib \
--lpthread -lturbojpeg -lopenh264
+-lpthread -lrt -lturbojpeg -lopenh264
 
 echo " ---- Launch ----"
 ./Server
\ No newline at end of file